@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "arena.h"
+
+/* The chunk allocations currently come from */
+static struct arena_chunk_s *arena_chunk = NULL;
+
+/* A released chunk kept around, so each line doesn't malloc a new one */
+static struct arena_chunk_s *spare_chunk = NULL;
+
+
+/*
+ * get a new chunk with room for at least size bytes.
+ */
+static struct arena_chunk_s *new_chunk(size_t size)
+{
+    struct arena_chunk_s *chunk;
+
+    if(size <= ARENA_CHUNK_SIZE && spare_chunk)
+    {
+        chunk = spare_chunk;
+        spare_chunk = NULL;
+    }
+    else
+    {
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(struct arena_chunk_s)+chunk_size);
+        if(!chunk)
+        {
+            fprintf(stderr, "fatal error: no memory for command arena\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunk_size;
+    }
+
+    chunk->used = 0;
+    chunk->prev = arena_chunk;
+    arena_chunk = chunk;
+    return chunk;
+}
+
+
+/*
+ * give a chunk back, keeping one regular-sized chunk for reuse.
+ */
+static void free_chunk(struct arena_chunk_s *chunk)
+{
+    if(chunk->size == ARENA_CHUNK_SIZE && !spare_chunk)
+    {
+        spare_chunk = chunk;
+        return;
+    }
+    free(chunk);
+}
+
+
+/*
+ * allocate memory from the command arena, aligned for any type.
+ */
+void *arena_alloc(size_t size)
+{
+    struct arena_chunk_s *chunk = arena_chunk;
+    size_t align = sizeof(max_align_t);
+
+    size = (size + align-1) & ~(align-1);
+    if(!size)
+    {
+        size = align;
+    }
+
+    if(!chunk || chunk->size - chunk->used < size)
+    {
+        chunk = new_chunk(size);
+    }
+
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+
+char *arena_strndup(const char *str, size_t n)
+{
+    char *p = arena_alloc(n+1);
+    memcpy(p, str, n);
+    p[n] = '\0';
+    return p;
+}
+
+
+char *arena_strdup(const char *str)
+{
+    return arena_strndup(str, strlen(str));
+}
+
+
+struct arena_mark_s arena_mark(void)
+{
+    struct arena_mark_s mark;
+
+    mark.chunk = arena_chunk;
+    mark.used  = arena_chunk ? arena_chunk->used : 0;
+    return mark;
+}
+
+
+void arena_release(struct arena_mark_s mark)
+{
+    /* drop the chunks filled after the mark was taken */
+    while(arena_chunk && arena_chunk != mark.chunk)
+    {
+        struct arena_chunk_s *prev = arena_chunk->prev;
+        free_chunk(arena_chunk);
+        arena_chunk = prev;
+    }
+
+    if(arena_chunk)
+    {
+        arena_chunk->used = mark.used;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * The command arena is a bump allocator for the short-lived memory used
+ * while running one line of input: tokens, parse tree nodes, expanded words,
+ * argv arrays and redirection lists.  Nothing allocated from it is freed on
+ * its own; parse_and_execute() takes a mark before each line and releases
+ * everything allocated after the mark in one go.  Marks nest, so a builtin
+ * that runs parse_and_execute() again (like dry) only releases its own
+ * allocations.
+ */
+
+/* Size of a regular arena chunk (bigger requests get a chunk of their own) */
+#define ARENA_CHUNK_SIZE    (64 * 1024)
+
+struct arena_chunk_s
+{
+    struct arena_chunk_s *prev;     /* previously filled chunk */
+    size_t size;                    /* usable bytes in data */
+    size_t used;                    /* bytes handed out so far */
+    _Alignas(max_align_t) char data[];  /* the memory handed out */
+};
+
+/* A position in the arena to release back to */
+struct arena_mark_s
+{
+    struct arena_chunk_s *chunk;
+    size_t used;
+};
+
+/* Allocate memory from the command arena (never returns NULL) */
+void *arena_alloc(size_t size);
+
+/* Copy a string (or its first n chars) into the command arena */
+char *arena_strdup(const char *str);
+char *arena_strndup(const char *str, size_t n);
+
+/* Remember the current arena position */
+struct arena_mark_s arena_mark(void);
+
+/* Free everything allocated after the given mark */
+void arena_release(struct arena_mark_s mark);
+
+#endif
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Allocator traffic of a long script: feeds LINES lines of
+#
+#     dry echo arg$i $HOME "quoted $i" x$i y z > /dev/null
+#
+# to each given shell on stdin, with bench/malloc_count.c preloaded, and
+# reports the malloc/free counts and the run time.  dry keeps the commands
+# from running, so this mostly measures scanning, parsing and expansion.
+#
+# usage: arena.sh [-p PRELOAD] [-n LINES] [SHELL ...]
+#
+# PRELOAD defaults to build/bench/malloc_count.so, LINES to 20000 and the
+# shell to ./mshX.  Give an older build as a second shell to compare.
+
+preload=build/bench/malloc_count.so
+lines=20000
+
+while getopts p:n: opt
+do
+    case $opt in
+        p) preload=$OPTARG ;;
+        n) lines=$OPTARG ;;
+        *) echo "usage: $0 [-p PRELOAD] [-n LINES] [SHELL ...]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- ./mshX
+
+case $preload in
+    /*) ;;
+    *) preload=$(pwd)/$preload ;;
+esac
+
+script=$(mktemp)
+counts=$(mktemp)
+trap 'rm -f "$script" "$counts"' EXIT
+awk -v n="$lines" 'BEGIN {
+    for(i = 1; i <= n; i++)
+        printf "dry echo arg%d $HOME \"quoted %d\" x%d y z > /dev/null\n", i, i, i
+}' > "$script"
+
+echo "$lines lines of dry echo ..."
+for shell in "$@"
+do
+    start=$(date +%s.%N)
+    LD_PRELOAD=$preload "$shell" < "$script" > /dev/null 2> "$counts"
+    end=$(date +%s.%N)
+    echo
+    echo "$shell"
+    grep -o 'malloc_count:.*' "$counts" | tail -n 1
+    awk -v t0="$start" -v t1="$end" 'BEGIN { printf "time: %.2fs\n", t1 - t0 }'
+done
@@ -0,0 +1,119 @@
+/*
+ * LD_PRELOAD shim that counts calls to malloc(), calloc(), realloc() and
+ * free(), and prints the totals to stderr when the process exits.
+ *
+ * usage: LD_PRELOAD=build/bench/malloc_count.so ./mshX ...
+ *
+ * children that leave through _exit() (or exec) don't print anything, so
+ * only the shell itself is counted.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void  (*real_free)(void *);
+
+static unsigned long mallocs, callocs, reallocs, frees;
+
+/*
+ * dlsym() may itself call calloc() before we know where the real one is,
+ * so those first few requests are served from here.
+ */
+static char   early_buf[4096];
+static size_t early_used;
+
+
+static void *early_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if(early_used + size > sizeof(early_buf))
+    {
+        return NULL;
+    }
+    void *p = early_buf + early_used;
+    early_used += size;
+    return p;
+}
+
+
+static int is_early(void *p)
+{
+    return (char *)p >= early_buf && (char *)p < early_buf + sizeof(early_buf);
+}
+
+
+void *malloc(size_t size)
+{
+    if(!real_malloc)
+    {
+        real_malloc = dlsym(RTLD_NEXT, "malloc");
+    }
+    mallocs++;
+    return real_malloc(size);
+}
+
+
+void *calloc(size_t n, size_t size)
+{
+    static int resolving = 0;
+
+    if(!real_calloc)
+    {
+        if(resolving)
+        {
+            return early_alloc(n * size);
+        }
+        resolving = 1;
+        real_calloc = dlsym(RTLD_NEXT, "calloc");
+        resolving = 0;
+    }
+    callocs++;
+    return real_calloc(n, size);
+}
+
+
+void *realloc(void *p, size_t size)
+{
+    if(!real_realloc)
+    {
+        real_realloc = dlsym(RTLD_NEXT, "realloc");
+    }
+    reallocs++;
+    return real_realloc(p, size);
+}
+
+
+void free(void *p)
+{
+    if(!p || is_early(p))
+    {
+        return;
+    }
+    if(!real_free)
+    {
+        real_free = dlsym(RTLD_NEXT, "free");
+    }
+    frees++;
+    real_free(p);
+}
+
+
+__attribute__((destructor))
+static void report(void)
+{
+    char buf[160];
+    int len = snprintf(buf, sizeof(buf),
+                       "malloc_count: malloc=%lu calloc=%lu realloc=%lu free=%lu\n",
+                       mallocs, callocs, reallocs, frees);
+    /* stdio may already be torn down, and mustn't allocate here anyway */
+    if(write(STDERR_FILENO, buf, len) < 0)
+    {
+        return;
+    }
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Pipeline throughput at different PIPESIZE values: pushes BYTES of zeroes
+# through `head | cat | cat | cat | wc -c` inside the shell, once for each
+# pipe size, and reports MB/s.
+#
+# usage: pipesize.sh [-s SHELL] [-b BYTES] [SIZE ...]
+#
+# SHELL defaults to ./mshX, BYTES to 1000000000, and the sizes to
+# 4k 16k 64k 256k 1m.  Sizes above /proc/sys/fs/pipe-max-size need root.
+
+shell=./mshX
+bytes=1000000000
+
+while getopts s:b: opt
+do
+    case $opt in
+        s) shell=$OPTARG ;;
+        b) bytes=$OPTARG ;;
+        *) echo "usage: $0 [-s SHELL] [-b BYTES] [SIZE ...]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- 4k 16k 64k 256k 1m
+
+echo "$bytes bytes through head | cat | cat | cat | wc -c"
+echo
+echo "PIPESIZE      MB/s"
+for size in "$@"
+do
+    start=$(date +%s.%N)
+    out=$("$shell" -c "export PIPESIZE=$size; head -c $bytes /dev/zero | cat | cat | cat | wc -c" </dev/null)
+    end=$(date +%s.%N)
+    if [ "$out" != "$bytes" ]
+    then
+        echo "$size: pipeline moved '$out' bytes, expected $bytes" >&2
+        exit 1
+    fi
+    awk -v s="$size" -v b="$bytes" -v t0="$start" -v t1="$end" \
+        'BEGIN { printf "%8s  %8.0f\n", s, b / 1e6 / (t1 - t0) }'
+done
@@ -0,0 +1,118 @@
+/*
+ * Spawns per second with fork()+execve() and with posix_spawn(), the two
+ * ways the shell starts an external command, from a process that has
+ * touched a given amount of memory.  fork() copies the page tables of all
+ * of it, posix_spawn() (a vfork-style clone in glibc) copies none.
+ *
+ * usage: spawn [-n COUNT] [-c COMMAND] [MB ...]
+ *
+ * runs COMMAND (default /bin/true) COUNT times (default 300) each way, at
+ * each of the given sizes in megabytes (default 1 64 512).
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static double run_fork(char **argv, int count)
+{
+    double start = now();
+    for(int i = 0; i < count; i++)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            execve(argv[0], argv, environ);
+            _exit(127);
+        }
+        if(pid < 0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return count / (now() - start);
+}
+
+
+static double run_spawn(char **argv, int count)
+{
+    double start = now();
+    for(int i = 0; i < count; i++)
+    {
+        pid_t pid;
+        int res = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+        if(res != 0)
+        {
+            fprintf(stderr, "posix_spawn: %s\n", strerror(res));
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return count / (now() - start);
+}
+
+
+int main(int argc, char **argv)
+{
+    char *command = "/bin/true";
+    int count = 300;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:c:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': count = atoi(optarg); break;
+            case 'c': command = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n COUNT] [-c COMMAND] [MB ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    static char *default_sizes[] = { "1", "64", "512" };
+    char **sizes = (optind < argc) ? argv + optind : default_sizes;
+    int nsizes = (optind < argc) ? argc - optind : 3;
+    char *child_argv[] = { command, NULL };
+    char *mem = NULL;
+
+    printf("%d spawns of %s\n\n", count, command);
+    printf("     RSS  fork+exec   posix_spawn\n");
+    for(int i = 0; i < nsizes; i++)
+    {
+        /* grow to the size, and touch every page so it's really mapped */
+        size_t mb = strtoul(sizes[i], NULL, 10);
+        free(mem);
+        mem = malloc(mb << 20);
+        if(!mem)
+        {
+            perror("malloc");
+            return 1;
+        }
+        memset(mem, 1, mb << 20);
+
+        double forks = run_fork(child_argv, count);
+        double spawns = run_spawn(child_argv, count);
+        printf("  %4zuMB  %6.0f/s     %6.0f/s\n", mb, forks, spawns);
+    }
+    free(mem);
+    return 0;
+}
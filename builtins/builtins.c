@@ -2,10 +2,19 @@
 
 struct builtin_s builtins[] =
 {   
+    { "bg"      , bg_builtin      },
     { "cd"      , cd              },
     { "dump"    , dump            },
     { "dry"     , dry             },
+    { "exit"    , exit_builtin    },
+    { "export"  , export_builtin  },
+    { "fg"      , fg_builtin      },
+    { "hash"    , hash_builtin    },
     { "history" , history_builtin },
+    { "jobs"    , jobs_builtin    },
+    { "timeline", timeline_builtin },
+    { "unset"   , unset_builtin   },
+    { "wait"    , wait_builtin    },
 };
 
 int builtins_count = sizeof(builtins)/sizeof(struct builtin_s);
\ No newline at end of file
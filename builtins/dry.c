@@ -69,6 +69,7 @@ int dry(int argc, char **argv)
     src.buffer = cmd_line;
     src.buffer_size = strlen(cmd_line);
     src.current_pos = INIT_SRC_POS;
+    src.flags = 0;
     
     parse_and_execute(&src);
     
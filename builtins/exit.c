@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mshX.h"
+
+/* extern declaration for exit status (defined in wordexp.c) */
+extern int exit_status;
+
+/*
+ * exit builtin command - exit the shell
+ * 
+ * Usage:
+ *   exit        - exit with the status of the last command
+ *   exit n      - exit with status n
+ */
+int exit_builtin(int argc, char **argv)
+{
+    int status = exit_status;
+
+    if(argc > 1)
+    {
+        char *end;
+        long n = strtol(argv[1], &end, 10);
+        if(!*argv[1] || *end)
+        {
+            fprintf(stderr, "exit: %s: numeric argument required\n", argv[1]);
+            status = 2;
+        }
+        else
+        {
+            status = n & 0xff;
+        }
+    }
+
+    fflush(stdout);
+    exit(status);
+}
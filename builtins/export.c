@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "../mshX.h"
+#include "../symtab/symtab.h"
+
+/*
+ * check if str is a valid variable name (or, if len is not -1, if its
+ * first len chars are).
+ */
+int is_valid_name(const char *str, int len)
+{
+    if(len < 0)
+    {
+        len = strlen(str);
+    }
+
+    if(len == 0 || !(isalpha((unsigned char)*str) || *str == '_'))
+    {
+        return 0;
+    }
+
+    for(int i = 1; i < len; i++)
+    {
+        if(!(isalnum((unsigned char)str[i]) || str[i] == '_'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * export builtin command - export variables to the commands we run
+ *
+ * Usage:
+ *   export              - list the exported variables (same as export -p)
+ *   export name         - export a variable
+ *   export name=value   - set a variable and export it
+ *   export -n name      - stop exporting a variable
+ */
+int export_builtin(int argc, char **argv)
+{
+    int unexport = 0;
+    int res = 0;
+    int i = 1;
+
+    if(argc > 1 && (strcmp(argv[1], "-n") == 0 || strcmp(argv[1], "-p") == 0))
+    {
+        unexport = (argv[1][1] == 'n');
+        i++;
+    }
+
+    if(i >= argc)
+    {
+        struct symtab_entry_s *entry = get_global_symtab()->first;
+        for( ; entry; entry = entry->next)
+        {
+            if(entry->flags & FLAG_EXPORT)
+            {
+                printf("export %s%s%s%s\n", entry->name, entry->val ? "=\"" : "",
+                       entry->val ? entry->val : "", entry->val ? "\"" : "");
+            }
+        }
+        return 0;
+    }
+
+    for( ; i < argc; i++)
+    {
+        char *eq = strchr(argv[i], '=');
+        int len = eq ? eq-argv[i] : -1;
+
+        if(!is_valid_name(argv[i], len))
+        {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+            res = 1;
+            continue;
+        }
+
+        char name[strlen(argv[i])+1];
+        strcpy(name, argv[i]);
+        if(eq)
+        {
+            name[len] = '\0';
+        }
+
+        struct symtab_entry_s *entry = get_symtab_entry(name);
+        if(!entry)
+        {
+            if(unexport)
+            {
+                continue;
+            }
+            entry = add_to_symtab(name);
+        }
+
+        /* export the new value, not the old one */
+        if(eq)
+        {
+            symtab_entry_setval(entry, eq+1);
+        }
+        symtab_entry_export(entry, !unexport);
+    }
+
+    return res;
+}
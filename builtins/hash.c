@@ -0,0 +1,225 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../mshX.h"
+#include "../executor.h"
+#include "hash.h"
+
+/* Remembered command locations, chained per bucket */
+static hash_entry_t *hash_table[HASH_TABLE_SIZE];
+static int hash_entries = 0;
+
+/* Hash a command name into a bucket index */
+static unsigned int hash_name(const char *name)
+{
+    unsigned int h = 5381;
+
+    while (*name)
+    {
+        h = (h << 5) + h + (unsigned char)*name++;
+    }
+
+    return h % HASH_TABLE_SIZE;
+}
+
+/* Find the entry for a command name */
+static hash_entry_t *hash_find(const char *name)
+{
+    hash_entry_t *entry = hash_table[hash_name(name)];
+
+    while (entry)
+    {
+        if (strcmp(entry->name, name) == 0)
+        {
+            return entry;
+        }
+        entry = entry->next;
+    }
+
+    return NULL;
+}
+
+/* Look up a command, returns the remembered path or NULL */
+char *hash_lookup(const char *name)
+{
+    if (!name)
+    {
+        return NULL;
+    }
+
+    hash_entry_t *entry = hash_find(name);
+    if (!entry)
+    {
+        return NULL;
+    }
+
+    entry->hits++;
+    return entry->path;
+}
+
+/* Remember the full path of a command */
+void hash_add(const char *name, const char *path)
+{
+    if (!name || !path)
+    {
+        return;
+    }
+
+    hash_entry_t *entry = hash_find(name);
+    if (entry)
+    {
+        /* Command moved, replace the old path */
+        char *new_path = strdup(path);
+        if (new_path)
+        {
+            free(entry->path);
+            entry->path = new_path;
+        }
+        return;
+    }
+
+    entry = malloc(sizeof(hash_entry_t));
+    if (!entry)
+    {
+        return;
+    }
+
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    if (!entry->name || !entry->path)
+    {
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+        return;
+    }
+    entry->hits = 0;
+
+    unsigned int bucket = hash_name(name);
+    entry->next = hash_table[bucket];
+    hash_table[bucket] = entry;
+    hash_entries++;
+}
+
+/* Forget a single command, returns 1 if it was remembered */
+int hash_remove(const char *name)
+{
+    hash_entry_t **pentry = &hash_table[hash_name(name)];
+
+    while (*pentry)
+    {
+        hash_entry_t *entry = *pentry;
+        if (strcmp(entry->name, name) == 0)
+        {
+            *pentry = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            hash_entries--;
+            return 1;
+        }
+        pentry = &entry->next;
+    }
+
+    return 0;
+}
+
+/* Forget all remembered commands */
+void hash_clear(void)
+{
+    if (hash_entries == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < HASH_TABLE_SIZE; i++)
+    {
+        hash_entry_t *entry = hash_table[i];
+        while (entry)
+        {
+            hash_entry_t *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        hash_table[i] = NULL;
+    }
+    hash_entries = 0;
+}
+
+/*
+ * hash builtin command - show and manage remembered command locations
+ *
+ * Usage:
+ *   hash            - list remembered commands with their hit counts
+ *   hash -r         - forget all remembered commands
+ *   hash -d name    - forget the given commands
+ *   hash name...    - search $PATH for the given commands and remember them
+ */
+int hash_builtin(int argc, char **argv)
+{
+    if (argc == 1)
+    {
+        if (hash_entries == 0)
+        {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+
+        printf("hits\tcommand\n");
+        for (int i = 0; i < HASH_TABLE_SIZE; i++)
+        {
+            for (hash_entry_t *entry = hash_table[i]; entry; entry = entry->next)
+            {
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "-r") == 0)
+    {
+        hash_clear();
+        return 0;
+    }
+
+    int res = 0;
+
+    if (strcmp(argv[1], "-d") == 0)
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            if (!hash_remove(argv[i]))
+            {
+                fprintf(stderr, "hash: %s: not found\n", argv[i]);
+                res = 1;
+            }
+        }
+        return res;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        /* Names with a slash are never searched for */
+        if (strchr(argv[i], '/'))
+        {
+            continue;
+        }
+
+        /* Always search again, so a stale entry gets refreshed */
+        hash_remove(argv[i]);
+        char *path = search_path(argv[i]);
+        if (!path)
+        {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            res = 1;
+            continue;
+        }
+        free(path);
+    }
+
+    return res;
+}
@@ -0,0 +1,30 @@
+#ifndef HASH_H
+#define HASH_H
+
+/* Number of buckets in the command path hash table */
+#define HASH_TABLE_SIZE 256
+
+/* Structure for a single remembered command */
+typedef struct hash_entry_s {
+    char *name;                     /* Command name as typed */
+    char *path;                     /* Full path found by searching $PATH */
+    int hits;                       /* Number of times the entry was used */
+    struct hash_entry_s *next;      /* Next entry in the same bucket */
+} hash_entry_t;
+
+/* Look up a command, returns the remembered path or NULL */
+char *hash_lookup(const char *name);
+
+/* Remember the full path of a command */
+void hash_add(const char *name, const char *path);
+
+/* Forget a single command */
+int hash_remove(const char *name);
+
+/* Forget all remembered commands (called when $PATH changes) */
+void hash_clear(void);
+
+/* hash builtin command */
+int hash_builtin(int argc, char **argv);
+
+#endif /* HASH_H */
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "histindex.h"
+
+/*
+ * Trigram index of the history list.  Every three-byte substring of an
+ * entry maps to the (ascending) numbers of the entries containing it, so a
+ * substring search only looks at the entries that have all the trigrams of
+ * the string, walking the shortest list and binary searching the others.
+ * The table uses open addressing with linear probing; trigrams are never
+ * removed from it, their lists just run empty.
+ */
+static histindex_list_t *slots = NULL;
+static uint32_t nslots = 0;
+static uint32_t nused = 0;
+
+/* A trigram's key, with a high bit set so no key is 0 */
+static uint32_t trigram_key(const char *p)
+{
+    return 0x1000000u | (uint32_t)(unsigned char)p[0] << 16 |
+           (uint32_t)(unsigned char)p[1] << 8 | (uint32_t)(unsigned char)p[2];
+}
+
+/* Home slot of a key */
+static uint32_t trigram_slot(uint32_t key)
+{
+    uint32_t h = key * 2654435761u;
+    return (h ^ (h >> 15)) & (nslots - 1);
+}
+
+/* Double the table, returns 0 on success */
+static int grow_slots(void)
+{
+    uint32_t old_nslots = nslots;
+    histindex_list_t *old_slots = slots;
+
+    nslots = old_nslots ? old_nslots * 2 : HISTINDEX_INIT_SLOTS;
+    slots = calloc(nslots, sizeof(histindex_list_t));
+    if (!slots)
+    {
+        slots = old_slots;
+        nslots = old_nslots;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < old_nslots; i++)
+    {
+        if (old_slots[i].key)
+        {
+            uint32_t j = trigram_slot(old_slots[i].key);
+            while (slots[j].key)
+            {
+                j = (j + 1) & (nslots - 1);
+            }
+            slots[j] = old_slots[i];
+        }
+    }
+
+    free(old_slots);
+    return 0;
+}
+
+/* Find the list of a trigram, adding an empty one if create is set */
+static histindex_list_t *find_list(uint32_t key, int create)
+{
+    if (!slots && (!create || grow_slots() < 0))
+    {
+        return NULL;
+    }
+
+    uint32_t i = trigram_slot(key);
+    while (slots[i].key)
+    {
+        if (slots[i].key == key)
+        {
+            return &slots[i];
+        }
+        i = (i + 1) & (nslots - 1);
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    /* Keep the table at most 3/4 full */
+    if ((nused + 1) * 4 > nslots * 3)
+    {
+        if (grow_slots() < 0)
+        {
+            return NULL;
+        }
+        return find_list(key, create);
+    }
+
+    slots[i].key = key;
+    nused++;
+    return &slots[i];
+}
+
+/* Append a number to a list, returns 0 on success */
+static int list_push(histindex_list_t *list, int num)
+{
+    if (list->len == list->size)
+    {
+        if (list->start > list->len / 2)
+        {
+            /* Reuse the room left by removed entries */
+            memmove(list->nums, list->nums + list->start, (list->len - list->start) * sizeof(int));
+            list->len -= list->start;
+            list->start = 0;
+        }
+        else
+        {
+            int size = list->size ? list->size * 2 : 4;
+            int *nums = realloc(list->nums, size * sizeof(int));
+            if (!nums)
+            {
+                return -1;
+            }
+            list->nums = nums;
+            list->size = size;
+        }
+    }
+
+    list->nums[list->len++] = num;
+    return 0;
+}
+
+/* Index a history entry, numbers must be added in ascending order */
+void histindex_add(int num, const char *text)
+{
+    size_t len = strlen(text);
+
+    for (size_t i = 0; i + 3 <= len; i++)
+    {
+        histindex_list_t *list = find_list(trigram_key(text + i), 1);
+        if (!list)
+        {
+            return;
+        }
+
+        /* Skip a trigram seen earlier in the same entry */
+        if (list->len > list->start && list->nums[list->len - 1] == num)
+        {
+            continue;
+        }
+        if (list_push(list, num) < 0)
+        {
+            return;
+        }
+    }
+}
+
+/* Drop the oldest indexed history entry */
+void histindex_remove(int num, const char *text)
+{
+    size_t len = strlen(text);
+
+    for (size_t i = 0; i + 3 <= len; i++)
+    {
+        histindex_list_t *list = find_list(trigram_key(text + i), 0);
+        if (list && list->start < list->len && list->nums[list->start] == num)
+        {
+            if (++list->start == list->len)
+            {
+                list->start = list->len = 0;
+            }
+        }
+    }
+}
+
+/* Forget all entries */
+void histindex_clear(void)
+{
+    for (uint32_t i = 0; i < nslots; i++)
+    {
+        free(slots[i].nums);
+    }
+    free(slots);
+    slots = NULL;
+    nslots = 0;
+    nused = 0;
+}
+
+/* Find the last position in list at or before hi holding a number <= num */
+static int list_find(histindex_list_t *list, int hi, int num)
+{
+    int lo = list->start;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (list->nums[mid] <= num)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return hi;
+}
+
+/* Call match() on the entries that contain all the trigrams of str, newest first */
+int histindex_search(const char *str, size_t len, int (*match)(int num, void *arg), void *arg)
+{
+    if (len < 3)
+    {
+        return -1;
+    }
+
+    size_t n = len - 2;
+    histindex_list_t **lists = malloc(n * sizeof(histindex_list_t *));
+    int *pos = malloc(n * sizeof(int));
+    int res = 0;
+
+    if (!lists || !pos)
+    {
+        free(lists);
+        free(pos);
+        return -1;
+    }
+
+    /* Get the lists, shortest first (an empty one means no entry matches) */
+    for (size_t i = 0; i < n; i++)
+    {
+        histindex_list_t *list = find_list(trigram_key(str + i), 0);
+        if (!list || list->start == list->len)
+        {
+            goto out;
+        }
+
+        size_t j = i;
+        while (j > 0 && lists[j - 1]->len - lists[j - 1]->start > list->len - list->start)
+        {
+            lists[j] = lists[j - 1];
+            j--;
+        }
+        lists[j] = list;
+    }
+
+    for (size_t k = 1; k < n; k++)
+    {
+        pos[k] = lists[k]->len - 1;
+    }
+
+    /* Walk the shortest list, looking each number up in the others */
+    for (int i = lists[0]->len - 1; i >= lists[0]->start; i--)
+    {
+        int num = lists[0]->nums[i];
+        size_t k;
+
+        for (k = 1; k < n; k++)
+        {
+            pos[k] = list_find(lists[k], pos[k], num);
+            if (pos[k] < lists[k]->start)
+            {
+                /* Nothing older has this trigram */
+                goto out;
+            }
+            if (lists[k]->nums[pos[k]] != num)
+            {
+                break;
+            }
+        }
+
+        if (k == n && (res = match(num, arg)))
+        {
+            break;
+        }
+    }
+
+out:
+    free(lists);
+    free(pos);
+    return res;
+}
@@ -0,0 +1,40 @@
+#ifndef HISTINDEX_H
+#define HISTINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of slots the trigram table starts with (a power of 2) */
+#define HISTINDEX_INIT_SLOTS 1024
+
+/*
+ * Posting list of one trigram: the numbers of the history entries that
+ * contain it, oldest first.  Entries leave the history list oldest first
+ * too, so removing one just moves start past it.
+ */
+typedef struct {
+    uint32_t key;                   /* The trigram's bytes, 0 for a free slot */
+    int start;                      /* First live number in nums */
+    int len;                        /* Numbers in nums, live or not */
+    int size;                       /* Room in nums */
+    int *nums;                      /* History numbers, ascending */
+} histindex_list_t;
+
+/* Index a history entry, numbers must be added in ascending order */
+void histindex_add(int num, const char *text);
+
+/* Drop the oldest indexed history entry */
+void histindex_remove(int num, const char *text);
+
+/* Forget all entries */
+void histindex_clear(void);
+
+/*
+ * Call match() on the number of each indexed entry that contains all the
+ * trigrams of str, newest first, until it returns nonzero.  Returns what
+ * match() returned, 0 if nothing did, or -1 if str is too short to have
+ * any trigrams (the caller has to look at every entry then).
+ */
+int histindex_search(const char *str, size_t len, int (*match)(int num, void *arg), void *arg);
+
+#endif /* HISTINDEX_H */
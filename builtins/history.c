@@ -1,24 +1,95 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         /* flock() */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "history.h"
+#include "histindex.h"
+#include "../symtab/symtab.h"
 
-/* In-memory history storage */
-static char *history[HISTORY_MAX_SIZE];
+/* In-memory history storage, a ring of history_max entries */
+static history_entry_t *history = NULL;
+static int history_max = HISTORY_DEFAULT_SIZE;
 static int history_start = 0;    /* Index of oldest entry */
 static int history_end = 0;      /* Index where next entry will go */
 static int history_total = 0;    /* Total commands ever added (for numbering) */
 static int history_size = 0;     /* Current number of entries */
+static int history_indexed = 0;  /* Entries up to this number are in the trigram index */
+
+/*
+ * The history file (in native byte order):
+ *
+ *   header     "MSHXHST1"
+ *   records    uint32_t len, then len bytes of command text ending in '\0'
+ *   index      uint32_t offset of each record, uint32_t count, "MSHXIDX1"
+ *
+ * Each command is appended as a record when it's entered (cutting off the
+ * index first, if there is one), and an exiting shell writes the index
+ * back, so the next shell finds the newest records without walking the
+ * file.  The file is mmap'd, and the loaded commands point right into the
+ * mapping, so loading does no parsing or copying.  Records are only ever
+ * appended (the file is rewritten with rename()), so the mapping stays valid.
+ */
+static char *hist_path = NULL;
+static int hist_fd = -1;
+static pid_t hist_owner = 0;     /* Forked children mustn't write the index */
+
+/* Offsets of the records in the history file, as far as we know them */
+static uint32_t *hist_offsets = NULL;
+static uint32_t hist_count = 0;
+static uint32_t hist_offsets_size = 0;
+static off_t hist_records_end = 0;  /* Where the records end, 0 if we don't know */
+
+#define RECORD_HDR_LEN  sizeof(uint32_t)
+#define INDEX_TAIL_LEN  (sizeof(uint32_t) + HISTORY_MAGIC_LEN)
+
+/* Read a (possibly unaligned) 32-bit number */
+static uint32_t get_u32(const char *p)
+{
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return n;
+}
+
+/* Free the text of an entry, unless it lives in the mapped file */
+static void free_entry(history_entry_t *entry)
+{
+    if (entry->text && !entry->mapped)
+    {
+        free(entry->text);
+    }
+    entry->text = NULL;
+    entry->mapped = 0;
+}
+
+/* Take an entry that's leaving the list out of the trigram index */
+static void unindex_entry(int num, history_entry_t *entry)
+{
+    if (entry->text && num <= history_indexed)
+    {
+        histindex_remove(num, entry->text);
+    }
+}
 
 /* Initialize the history system */
 void history_init(void)
 {
-    for (int i = 0; i < HISTORY_MAX_SIZE; i++)
+    free(history);
+    history = calloc(history_max, sizeof(history_entry_t));
+    if (!history)
     {
-        history[i] = NULL;
+        fprintf(stderr, "fatal error: no memory for history\n");
+        exit(EXIT_FAILURE);
     }
     history_start = 0;
     history_end = 0;
@@ -26,6 +97,490 @@ void history_init(void)
     history_size = 0;
 }
 
+/* Change the number of commands kept in memory, keeping the newest */
+void history_set_size(int size)
+{
+    if (size <= 0 || size == history_max || !history)
+    {
+        return;
+    }
+
+    history_entry_t *ring = calloc(size, sizeof(history_entry_t));
+    if (!ring)
+    {
+        return;
+    }
+
+    int keep = (history_size < size) ? history_size : size;
+    for (int i = 0; i < history_size; i++)
+    {
+        history_entry_t *entry = &history[(history_start + i) % history_max];
+        if (i < history_size - keep)
+        {
+            unindex_entry(history_total - history_size + 1 + i, entry);
+            free_entry(entry);
+        }
+        else
+        {
+            ring[i - (history_size - keep)] = *entry;
+        }
+    }
+
+    free(history);
+    history = ring;
+    history_max = size;
+    history_size = keep;
+    history_start = 0;
+    history_end = keep % size;
+}
+
+/* Get a numeric shell variable, or def if it's not set */
+static int get_num_var(char *name, int def)
+{
+    struct symtab_entry_s *entry = get_symtab_entry(name);
+    if (!entry || !entry->val || !isdigit((unsigned char)*entry->val))
+    {
+        return def;
+    }
+    return atoi(entry->val);
+}
+
+/* Make room for n record offsets, returns 0 on success */
+static int reserve_offsets(uint32_t n)
+{
+    if (n <= hist_offsets_size)
+    {
+        return 0;
+    }
+
+    uint32_t size = hist_offsets_size ? hist_offsets_size : 64;
+    while (size < n)
+    {
+        size *= 2;
+    }
+
+    uint32_t *offsets = realloc(hist_offsets, size * sizeof(uint32_t));
+    if (!offsets)
+    {
+        return -1;
+    }
+    hist_offsets = offsets;
+    hist_offsets_size = size;
+    return 0;
+}
+
+/*
+ * Check the n offsets of an index that starts at index: each must be past
+ * the magic and past the record before it, and (if we have the file mapped)
+ * point to a whole record that ends in '\0' before the index.  Returns 1 if
+ * they can all be trusted.
+ */
+static int offsets_valid(const char *map, uint32_t n, size_t index)
+{
+    size_t end = HISTORY_MAGIC_LEN;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        size_t pos = hist_offsets[i];
+        if (pos < end || pos + RECORD_HDR_LEN > index)
+        {
+            return 0;
+        }
+        if (!map)
+        {
+            end = pos + 1;
+            continue;
+        }
+
+        uint32_t reclen = get_u32(map + pos);
+        if (reclen == 0 || reclen > index - pos - RECORD_HDR_LEN ||
+            map[pos + RECORD_HDR_LEN + reclen - 1] != '\0')
+        {
+            return 0;
+        }
+        end = pos + RECORD_HDR_LEN + reclen;
+    }
+    return 1;
+}
+
+/*
+ * Find the records of a mapped history file: from the index if it has a
+ * valid one, else by hopping from length to length.  A record cut short by
+ * a crash ends the walk.  Fills in hist_offsets, hist_count and
+ * hist_records_end.
+ */
+static void find_records(const char *map, size_t len)
+{
+    uint32_t n;
+
+    hist_count = 0;
+    hist_records_end = 0;
+
+    if (len >= HISTORY_MAGIC_LEN + INDEX_TAIL_LEN &&
+        memcmp(map + len - HISTORY_MAGIC_LEN, HISTORY_INDEX_MAGIC, HISTORY_MAGIC_LEN) == 0)
+    {
+        n = get_u32(map + len - INDEX_TAIL_LEN);
+        size_t index = len - INDEX_TAIL_LEN - (size_t)n * sizeof(uint32_t);
+
+        if ((size_t)n * sizeof(uint32_t) <= len - INDEX_TAIL_LEN - HISTORY_MAGIC_LEN &&
+            reserve_offsets(n) == 0)
+        {
+            memcpy(hist_offsets, map + index, (size_t)n * sizeof(uint32_t));
+
+            /* Every record must be whole, and the last must end where the index starts */
+            uint32_t last = n ? hist_offsets[n - 1] : 0;
+            if (n == 0 ? index == HISTORY_MAGIC_LEN :
+                (offsets_valid(map, n, index) &&
+                 last + RECORD_HDR_LEN + get_u32(map + last) == index))
+            {
+                hist_count = n;
+                hist_records_end = index;
+                return;
+            }
+        }
+    }
+
+    /* No (usable) index, walk the records */
+    size_t pos = HISTORY_MAGIC_LEN;
+    n = 0;
+    while (pos + RECORD_HDR_LEN <= len)
+    {
+        uint32_t reclen = get_u32(map + pos);
+        if (reclen == 0 || reclen > len - pos - RECORD_HDR_LEN ||
+            map[pos + RECORD_HDR_LEN + reclen - 1] != '\0' || reserve_offsets(n + 1) < 0)
+        {
+            break;
+        }
+        hist_offsets[n++] = pos;
+        pos += RECORD_HDR_LEN + reclen;
+    }
+
+    hist_count = n;
+    hist_records_end = pos;
+}
+
+/*
+ * Read the index at the end of the history file (whose last bytes are in
+ * tail), unless it's the one we already have.  Returns where the records
+ * end, or -1 if the index is no good.
+ */
+static off_t read_index(int fd, off_t size, const char *tail)
+{
+    uint32_t n = get_u32(tail);
+    off_t index = size - INDEX_TAIL_LEN - (off_t)n * sizeof(uint32_t);
+    char len[RECORD_HDR_LEN];
+
+    if (index < HISTORY_MAGIC_LEN)
+    {
+        return -1;
+    }
+    if (hist_records_end && n == hist_count && index == hist_records_end)
+    {
+        return index;
+    }
+
+    if (reserve_offsets(n) < 0 ||
+        pread(fd, hist_offsets, (size_t)n * sizeof(uint32_t), index) != (ssize_t)(n * sizeof(uint32_t)))
+    {
+        return -1;
+    }
+
+    /* The offsets must be in order, and the last record must end where the index starts */
+    if (n == 0 ? index != HISTORY_MAGIC_LEN :
+        (!offsets_valid(NULL, n, index) ||
+         pread(fd, len, RECORD_HDR_LEN, hist_offsets[n - 1]) != RECORD_HDR_LEN ||
+         (off_t)(hist_offsets[n - 1] + RECORD_HDR_LEN + get_u32(len)) != index))
+    {
+        return -1;
+    }
+
+    hist_count = n;
+    hist_records_end = index;
+    return index;
+}
+
+/*
+ * Get the history file ready for appending: cut off the index if it has
+ * one, and bring our record offsets up to date from it.  If another shell
+ * appended records since we last looked, and left no index, we lose track
+ * of the offsets until the file is walked again.  The file must be locked.
+ */
+static void sync_records(int fd)
+{
+    struct stat st;
+    char tail[INDEX_TAIL_LEN];
+
+    if (fstat(fd, &st) < 0)
+    {
+        hist_records_end = 0;
+        return;
+    }
+    if (hist_records_end && st.st_size == hist_records_end)
+    {
+        return;
+    }
+
+    /* Records end in '\0', so they can't look like the index magic */
+    if (st.st_size >= (off_t)(HISTORY_MAGIC_LEN + INDEX_TAIL_LEN) &&
+        pread(fd, tail, INDEX_TAIL_LEN, st.st_size - INDEX_TAIL_LEN) == (ssize_t)INDEX_TAIL_LEN &&
+        memcmp(tail + sizeof(uint32_t), HISTORY_INDEX_MAGIC, HISTORY_MAGIC_LEN) == 0)
+    {
+        off_t index = read_index(fd, st.st_size, tail);
+        if (index > 0 && ftruncate(fd, index) == 0)
+        {
+            return;
+        }
+    }
+    hist_records_end = 0;
+}
+
+/* Open the history file, creating it if needed, returns the fd or -1 */
+static int open_history_file(void)
+{
+    int fd = open(hist_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    char magic[HISTORY_MAGIC_LEN];
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+        if (write(fd, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != HISTORY_MAGIC_LEN)
+        {
+            st.st_size = -1;
+        }
+    }
+    else if (pread(fd, magic, HISTORY_MAGIC_LEN, 0) != HISTORY_MAGIC_LEN ||
+             memcmp(magic, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "history: %s is not a mshX history file, not saving history\n",
+                hist_path);
+        st.st_size = -1;
+    }
+    flock(fd, LOCK_UN);
+
+    if (st.st_size < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Append a command to the history file */
+static void append_record(const char *text, size_t len)
+{
+    struct stat st, path_st;
+    uint32_t reclen = len + 1;
+    struct iovec iov[2];
+
+    if (hist_fd < 0)
+    {
+        return;
+    }
+
+    /* Another shell may have rewritten the file, follow it to the new one */
+    if (stat(hist_path, &path_st) < 0 || fstat(hist_fd, &st) < 0 ||
+        path_st.st_ino != st.st_ino || path_st.st_dev != st.st_dev)
+    {
+        close(hist_fd);
+        hist_records_end = 0;
+        if ((hist_fd = open_history_file()) < 0)
+        {
+            return;
+        }
+    }
+
+    iov[0].iov_base = &reclen;
+    iov[0].iov_len = sizeof(reclen);
+    iov[1].iov_base = (void *)text;
+    iov[1].iov_len = reclen;
+
+    flock(hist_fd, LOCK_EX);
+    sync_records(hist_fd);
+    if (writev(hist_fd, iov, 2) != (ssize_t)(sizeof(reclen) + reclen))
+    {
+        fprintf(stderr, "history: cannot write %s: %s\n", hist_path, strerror(errno));
+        hist_records_end = 0;
+    }
+    else if (hist_records_end && reserve_offsets(hist_count + 1) == 0)
+    {
+        hist_offsets[hist_count++] = hist_records_end;
+        hist_records_end += sizeof(reclen) + reclen;
+    }
+    else
+    {
+        hist_records_end = 0;
+    }
+    flock(hist_fd, LOCK_UN);
+}
+
+/* Write the index of records offsets[0..n-1] to fd */
+static int write_index(int fd, uint32_t *offsets, uint32_t n)
+{
+    struct iovec iov[3];
+
+    iov[0].iov_base = offsets;
+    iov[0].iov_len = n * sizeof(uint32_t);
+    iov[1].iov_base = &n;
+    iov[1].iov_len = sizeof(n);
+    iov[2].iov_base = HISTORY_INDEX_MAGIC;
+    iov[2].iov_len = HISTORY_MAGIC_LEN;
+    return writev(fd, iov, 3) < 0 ? -1 : 0;
+}
+
+/* Write the records from number first on, and their index, to a new file fd */
+static int write_records(int fd, const char *map, uint32_t first)
+{
+    size_t base = hist_offsets[first] - HISTORY_MAGIC_LEN;
+    size_t len = hist_records_end - hist_offsets[first];
+
+    if (write(fd, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != HISTORY_MAGIC_LEN ||
+        write(fd, map + hist_offsets[first], len) != (ssize_t)len)
+    {
+        return -1;
+    }
+
+    for (uint32_t i = first; i < hist_count; i++)
+    {
+        hist_offsets[i] -= base;
+    }
+    return write_index(fd, hist_offsets + first, hist_count - first);
+}
+
+/*
+ * Write the index at the end of the history file when the shell exits,
+ * first trimming the file to the newest $HISTFILESIZE records.
+ */
+static void history_save(void)
+{
+    struct stat st;
+    char *map = MAP_FAILED;
+
+    if (hist_fd < 0 || getpid() != hist_owner)
+    {
+        return;
+    }
+
+    flock(hist_fd, LOCK_EX);
+    sync_records(hist_fd);
+    if (fstat(hist_fd, &st) < 0 || st.st_size <= HISTORY_MAGIC_LEN)
+    {
+        flock(hist_fd, LOCK_UN);
+        return;
+    }
+
+    int file_max = get_num_var("HISTFILESIZE", HISTORY_DEFAULT_FILE_SIZE);
+    if (!hist_records_end || hist_records_end != st.st_size ||
+        (file_max > 0 && hist_count > (uint32_t)file_max))
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist_fd, 0);
+        if (map != MAP_FAILED && !hist_records_end)
+        {
+            find_records(map, st.st_size);
+        }
+    }
+
+    uint32_t first = (file_max > 0 && hist_count > (uint32_t)file_max) ? hist_count - file_max : 0;
+    if (hist_records_end == st.st_size && first == 0)
+    {
+        /* Just add the index */
+        if (write_index(hist_fd, hist_offsets, hist_count) < 0)
+        {
+            fprintf(stderr, "history: cannot write %s: %s\n", hist_path, strerror(errno));
+        }
+    }
+    else if (map != MAP_FAILED && hist_count > 0)
+    {
+        /* Write a trimmed copy and move it over the file */
+        size_t len = strlen(hist_path);
+        char tmp[len + 8];
+        sprintf(tmp, "%s.XXXXXX", hist_path);
+        int fd = mkstemp(tmp);
+        if (fd >= 0)
+        {
+            if (write_records(fd, map, first) == 0)
+            {
+                rename(tmp, hist_path);
+            }
+            else
+            {
+                unlink(tmp);
+            }
+            close(fd);
+        }
+    }
+
+    if (map != MAP_FAILED)
+    {
+        munmap(map, st.st_size);
+    }
+    flock(hist_fd, LOCK_UN);
+}
+
+/* Load the history file and keep adding to it (interactive shell only) */
+void history_load(void)
+{
+    struct symtab_entry_s *entry = get_symtab_entry("HISTFILE");
+    struct stat st;
+
+    history_set_size(get_num_var("HISTSIZE", HISTORY_DEFAULT_SIZE));
+
+    if (entry && entry->val && *entry->val)
+    {
+        hist_path = strdup(entry->val);
+    }
+    else
+    {
+        entry = get_symtab_entry("HOME");
+        if (!entry || !entry->val)
+        {
+            return;
+        }
+        hist_path = malloc(strlen(entry->val) + sizeof(HISTORY_FILE_NAME) + 1);
+        if (hist_path)
+        {
+            sprintf(hist_path, "%s/%s", entry->val, HISTORY_FILE_NAME);
+        }
+    }
+
+    if (!hist_path || (hist_fd = open_history_file()) < 0)
+    {
+        return;
+    }
+    hist_owner = getpid();
+    atexit(history_save);
+
+    if (fstat(hist_fd, &st) < 0 || st.st_size <= HISTORY_MAGIC_LEN)
+    {
+        return;
+    }
+
+    /* The mapping is never unmapped: loaded entries point into it */
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    find_records(map, st.st_size);
+
+    /* Only the newest history_max records are needed */
+    uint32_t first = (hist_count > (uint32_t)history_max) ? hist_count - history_max : 0;
+    for (uint32_t i = first; i < hist_count; i++)
+    {
+        history_entry_t *e = &history[history_end];
+        e->text = map + hist_offsets[i] + RECORD_HDR_LEN;
+        e->mapped = 1;
+        history_end = (history_end + 1) % history_max;
+        history_size++;
+    }
+    history_total = history_size;
+}
+
 /* Add a command to history */
 void history_add(const char *cmd)
 {
@@ -45,48 +600,48 @@ void history_add(const char *cmd)
         return;
     }
     
-    /* Don't add duplicate of last command */
-    if (history_size > 0)
+    /* Store new command (strip trailing newline) */
+    size_t len = strlen(cmd);
+    if (len > 0 && cmd[len - 1] == '\n')
     {
-        int last_idx = (history_end - 1 + HISTORY_MAX_SIZE) % HISTORY_MAX_SIZE;
-        if (history[last_idx] && strcmp(history[last_idx], cmd) == 0)
-        {
-            return;
-        }
+        len--;
     }
     
-    /* Free old entry if circular buffer is full */
-    if (history[history_end])
+    /* Don't add duplicate of last command */
+    char *last = history_get_last();
+    if (last && strncmp(last, cmd, len) == 0 && last[len] == '\0')
     {
-        free(history[history_end]);
+        return;
     }
     
-    /* Store new command (strip trailing newline) */
-    size_t len = strlen(cmd);
-    if (len > 0 && cmd[len - 1] == '\n')
+    /* Free old entry if circular buffer is full */
+    history_entry_t *entry = &history[history_end];
+    if (history_size == history_max)
     {
-        len--;
+        unindex_entry(history_total - history_size + 1, entry);
     }
+    free_entry(entry);
     
-    history[history_end] = malloc(len + 1);
-    if (history[history_end])
+    entry->text = malloc(len + 1);
+    if (entry->text)
     {
-        strncpy(history[history_end], cmd, len);
-        history[history_end][len] = '\0';
+        memcpy(entry->text, cmd, len);
+        entry->text[len] = '\0';
+        append_record(entry->text, len);
     }
     
     /* Update circular buffer indices */
-    history_end = (history_end + 1) % HISTORY_MAX_SIZE;
+    history_end = (history_end + 1) % history_max;
     history_total++;
     
-    if (history_size < HISTORY_MAX_SIZE)
+    if (history_size < history_max)
     {
         history_size++;
     }
     else
     {
         /* Buffer is full, move start forward */
-        history_start = (history_start + 1) % HISTORY_MAX_SIZE;
+        history_start = (history_start + 1) % history_max;
     }
 }
 
@@ -108,9 +663,9 @@ char *history_get(int index)
     
     /* Convert to array index */
     int offset = index - first_num;
-    int array_idx = (history_start + offset) % HISTORY_MAX_SIZE;
+    int array_idx = (history_start + offset) % history_max;
     
-    return history[array_idx];
+    return history[array_idx].text;
 }
 
 /* Get the last command */
@@ -121,8 +676,8 @@ char *history_get_last(void)
         return NULL;
     }
     
-    int last_idx = (history_end - 1 + HISTORY_MAX_SIZE) % HISTORY_MAX_SIZE;
-    return history[last_idx];
+    int last_idx = (history_end - 1 + history_max) % history_max;
+    return history[last_idx].text;
 }
 
 /* Get total number of commands in history */
@@ -131,21 +686,141 @@ int history_count(void)
     return history_size;
 }
 
-/* Clear all history */
+/* Clear all history (the history file keeps it) */
 void history_clear(void)
 {
-    for (int i = 0; i < HISTORY_MAX_SIZE; i++)
+    for (int i = 0; i < history_max; i++)
     {
-        if (history[i])
-        {
-            free(history[i]);
-            history[i] = NULL;
-        }
+        free_entry(&history[i]);
     }
     history_start = 0;
     history_end = 0;
     history_total = 0;
     history_size = 0;
+    histindex_clear();
+    history_indexed = 0;
+}
+
+/* What a history search looks for */
+typedef struct {
+    char *str;                  /* The string */
+    int prefix;                 /* It has to start the command */
+    int *found;                 /* Numbers of the entries found (history -s) */
+    int nfound;
+    int size;
+} history_search_t;
+
+/* Check that entry num really has the string, the index only knows its trigrams */
+static int entry_matches(int num, history_search_t *search)
+{
+    char *text = history_get(num);
+
+    if (!text)
+    {
+        return 0;
+    }
+    if (search->prefix)
+    {
+        return strncmp(text, search->str, strlen(search->str)) == 0;
+    }
+    return strstr(text, search->str) != NULL;
+}
+
+/* Search callback: stop at the newest match */
+static int match_newest(int num, void *arg)
+{
+    return entry_matches(num, arg) ? num : 0;
+}
+
+/* Search callback: collect all matches */
+static int match_all(int num, void *arg)
+{
+    history_search_t *search = arg;
+
+    if (!entry_matches(num, search))
+    {
+        return 0;
+    }
+    if (search->nfound == search->size)
+    {
+        int size = search->size ? search->size * 2 : 16;
+        int *found = realloc(search->found, size * sizeof(int));
+        if (!found)
+        {
+            return 1;
+        }
+        search->found = found;
+        search->size = size;
+    }
+    search->found[search->nfound++] = num;
+    return 0;
+}
+
+/*
+ * Call match() on the entries holding the search string, newest first,
+ * until it returns nonzero (which is returned).  The trigram index is
+ * brought up to date first: entries are only indexed once something is
+ * searched for, so loading a big history file costs nothing extra.
+ */
+static int history_search(history_search_t *search, int (*match)(int num, void *arg))
+{
+    int first_num = history_total - history_size + 1;
+    int num = (history_indexed >= first_num) ? history_indexed + 1 : first_num;
+
+    for ( ; num <= history_total; num++)
+    {
+        char *text = history_get(num);
+        if (text)
+        {
+            histindex_add(num, text);
+        }
+    }
+    history_indexed = history_total;
+
+    int res = histindex_search(search->str, strlen(search->str), match, search);
+    if (res >= 0)
+    {
+        return res;
+    }
+
+    /* Too short for the index, look at every entry */
+    for (num = history_total; num >= first_num; num--)
+    {
+        if ((res = match(num, search)))
+        {
+            return res;
+        }
+    }
+    return 0;
+}
+
+/* Find the newest entry holding (or starting with) the first len bytes of str */
+static int find_newest(const char *str, size_t len, int prefix)
+{
+    history_search_t search = { NULL, prefix, NULL, 0, 0 };
+    int num = 0;
+
+    if (len > 0 && (search.str = strndup(str, len)))
+    {
+        num = history_search(&search, match_newest);
+        free(search.str);
+    }
+    return num;
+}
+
+/* Print the entries holding a string (history -s) */
+static int print_matches(char *str)
+{
+    history_search_t search = { str, 0, NULL, 0, 0 };
+
+    history_search(&search, match_all);
+    for (int i = search.nfound - 1; i >= 0; i--)
+    {
+        printf("%5d  %s\n", search.found[i], history_get(search.found[i]));
+    }
+    free(search.found);
+
+    return search.nfound ? 0 : 1;
 }
 
 /* Print all history (builtin command) */
@@ -159,6 +834,17 @@ int history_builtin(int argc, char **argv)
         history_clear();
         return 0;
     }
+
+    /* Check for -s (search) option */
+    if (argc > 1 && strcmp(argv[1], "-s") == 0)
+    {
+        if (argc != 3)
+        {
+            fprintf(stderr, "history: usage: history [-c] [-s string] [n]\n");
+            return 2;
+        }
+        return print_matches(argv[2]);
+    }
     
     /* Check for count argument */
     if (argc > 1)
@@ -185,152 +871,222 @@ int history_builtin(int argc, char **argv)
     
     for (int i = start_offset; i < history_size; i++)
     {
-        int array_idx = (history_start + i) % HISTORY_MAX_SIZE;
+        int array_idx = (history_start + i) % history_max;
         int cmd_num = first_num + i;
         
-        if (history[array_idx])
+        if (history[array_idx].text)
         {
-            printf("%5d  %s\n", cmd_num, history[array_idx]);
+            printf("%5d  %s\n", cmd_num, history[array_idx].text);
         }
     }
     
     return 0;
 }
 
-/* Expand history references like !! and !n in command string */
-/* Returns: expanded string, or NULL if no expansion needed, or empty string "" on error */
-char *history_expand(const char *cmd)
+/* Growable buffer for the expanded command */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+    int nomem;                  /* An append failed */
+} history_buf_t;
+
+/* Append n bytes of str to the buffer */
+static void buf_append(history_buf_t *b, const char *str, size_t n)
 {
-    if (!cmd || !strchr(cmd, '!'))
+    if (b->len + n + 1 > b->size)
     {
-        return NULL;  /* No expansion needed */
+        size_t size = b->size ? b->size : 128;
+        while (size < b->len + n + 1)
+        {
+            size *= 2;
+        }
+
+        char *buf = realloc(b->buf, size);
+        if (!buf)
+        {
+            b->nomem = 1;
+            return;
+        }
+        b->buf = buf;
+        b->size = size;
     }
-    
-    /* Allocate result buffer */
-    size_t result_size = HISTORY_MAX_CMD_LEN;
-    char *result = malloc(result_size);
-    if (!result)
+
+    memcpy(b->buf + b->len, str, n);
+    b->len += n;
+    b->buf[b->len] = '\0';
+}
+
+/*
+ * Quick substitution: ^old^new^ repeats the last command with the first
+ * old replaced by new.  Returns where the rest of the line starts, or NULL
+ * if it failed.
+ */
+static const char *quick_subst(const char *cmd, history_buf_t *result)
+{
+    const char *old = cmd + 1;
+    size_t old_len = strcspn(old, "^\n");
+    const char *new = old + old_len;
+    size_t new_len = 0;
+    char *last = history_get_last();
+    char *at = NULL;
+
+    if (*new == '^')
+    {
+        new++;
+        new_len = strcspn(new, "^\n");
+    }
+
+    if (last && old_len > 0)
+    {
+        char *pat = strndup(old, old_len);
+        at = pat ? strstr(last, pat) : NULL;
+        free(pat);
+    }
+
+    if (!at)
     {
+        fprintf(stderr, "%.*s: substitution failed\n", (int)strcspn(cmd, "\n"), cmd);
         return NULL;
     }
+
+    buf_append(result, last, at - last);
+    buf_append(result, new, new_len);
+    buf_append(result, at + old_len, strlen(at + old_len));
+
+    new += new_len;
+    return (*new == '^') ? new + 1 : new;
+}
+
+/*
+ * Expand history references in a command: !!, !n, !-n, !string (the newest
+ * command starting with string), !?string? (the newest command containing
+ * it) and ^old^new^ at the start of the line.  Nothing is expanded inside
+ * single quotes, or after a backslash.
+ * Returns: expanded string, or NULL if no expansion needed, or empty string "" on error
+ */
+char *history_expand(const char *cmd)
+{
+    if (!cmd || (!strchr(cmd, '!') && cmd[0] != '^'))
+    {
+        return NULL;  /* No expansion needed */
+    }
     
-    size_t result_len = 0;
+    history_buf_t result = { NULL, 0, 0, 0 };
     const char *p = cmd;
     int expanded = 0;
     int error = 0;
-    char error_token[64] = "";
+    char quote = 0;
     
-    while (*p && !error)
+    buf_append(&result, "", 0);
+    if (cmd[0] == '^')
     {
-        if (*p == '!' && *(p + 1))
+        p = quick_subst(cmd, &result);
+        expanded = 1;
+        error = !p;
+    }
+    
+    while (!error && *p)
+    {
+        /* Track quotes: single quotes stop expansion, but not inside double quotes */
+        if (*p == '\\' && quote != '\'' && p[1])
         {
-            char *expansion = NULL;
-            int skip = 0;
-            int is_history_ref = 0;
+            buf_append(&result, p, 2);
+            p += 2;
+            continue;
+        }
+        if ((*p == '\'' || *p == '"') && (!quote || quote == *p))
+        {
+            quote = quote ? 0 : *p;
+        }
+        
+        if (*p == '!' && quote != '\'' && p[1] && !strchr(" \t\n=(", p[1]))
+        {
+            const char *event = p;
+            int num = 0;
             
-            if (*(p + 1) == '!')
+            if (p[1] == '!')
             {
                 /* !! - last command */
-                is_history_ref = 1;
-                expansion = history_get_last();
-                skip = 2;
-                if (!expansion)
-                {
-                    strcpy(error_token, "!!");
-                }
+                num = history_total;
+                p += 2;
             }
-            else if (*(p + 1) == '-' && isdigit((unsigned char)*(p + 2)))
+            else if (p[1] == '-' && isdigit((unsigned char)p[2]))
             {
                 /* !-n - nth previous command */
-                is_history_ref = 1;
-                int n = atoi(p + 2);
-                int target = history_total - n;
-                expansion = history_get(target);
-                skip = 2;
-                while (isdigit((unsigned char)*(p + skip)))
-                {
-                    skip++;
-                }
-                if (!expansion)
+                num = history_total + 1 - atoi(p + 2);
+                for (p += 2; isdigit((unsigned char)*p); p++)
                 {
-                    snprintf(error_token, sizeof(error_token), "!-%d", n);
+                    ;
                 }
             }
-            else if (isdigit((unsigned char)*(p + 1)))
+            else if (isdigit((unsigned char)p[1]))
             {
                 /* !n - command number n */
-                is_history_ref = 1;
-                int n = atoi(p + 1);
-                expansion = history_get(n);
-                skip = 1;
-                while (isdigit((unsigned char)*(p + skip)))
+                num = atoi(p + 1);
+                for (p++; isdigit((unsigned char)*p); p++)
                 {
-                    skip++;
-                }
-                if (!expansion)
-                {
-                    snprintf(error_token, sizeof(error_token), "!%d", n);
+                    ;
                 }
             }
+            else if (p[1] == '?')
+            {
+                /* !?string? - newest command containing string */
+                const char *str = p + 2;
+                size_t len = strcspn(str, "?\n");
+                num = find_newest(str, len, 0);
+                p = str + len + (str[len] == '?');
+            }
+            else
+            {
+                /* !string - newest command starting with string */
+                const char *str = p + 1;
+                size_t len = strcspn(str, " \t\n;&|<>()'\"");
+                num = find_newest(str, len, 1);
+                p = str + len;
+            }
             
-            if (is_history_ref)
+            char *expansion = (num > 0) ? history_get(num) : NULL;
+            if (!expansion)
             {
-                if (expansion)
-                {
-                    size_t exp_len = strlen(expansion);
-                    if (result_len + exp_len >= result_size - 1)
-                    {
-                        /* Need more space */
-                        result_size = result_len + exp_len + HISTORY_MAX_CMD_LEN;
-                        char *new_result = realloc(result, result_size);
-                        if (!new_result)
-                        {
-                            free(result);
-                            return NULL;
-                        }
-                        result = new_result;
-                    }
-                    strcpy(result + result_len, expansion);
-                    result_len += exp_len;
-                    p += skip;
-                    expanded = 1;
-                    continue;
-                }
-                else
-                {
-                    /* History reference failed - event not found */
-                    error = 1;
-                    break;
-                }
+                /* History reference failed - event not found */
+                fprintf(stderr, "%.*s: event not found\n", (int)(p - event), event);
+                error = 1;
+                break;
             }
+            
+            buf_append(&result, expansion, strlen(expansion));
+            expanded = 1;
+            continue;
         }
         
         /* Copy regular character */
-        if (result_len < result_size - 1)
-        {
-            result[result_len++] = *p;
-        }
+        buf_append(&result, p, 1);
         p++;
     }
     
-    result[result_len] = '\0';
+    if (result.nomem)
+    {
+        free(result.buf);
+        return NULL;
+    }
     
     if (error)
     {
-        /* Print error and return empty string to prevent execution */
-        fprintf(stderr, "%s: event not found\n", error_token);
-        result[0] = '\0';
-        return result;  /* Return empty string, not NULL */
+        /* Return empty string to prevent execution */
+        result.buf[0] = '\0';
+        return result.buf;  /* Return empty string, not NULL */
     }
     
     if (!expanded)
     {
-        free(result);
+        free(result.buf);
         return NULL;
     }
     
     /* Print expanded command */
-    printf("%s", result);
+    printf("%s", result.buf);
+    fflush(stdout);
     
-    return result;
+    return result.buf;
 }
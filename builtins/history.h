@@ -1,15 +1,35 @@
 #ifndef HISTORY_H
 #define HISTORY_H
 
-/* Maximum number of commands to store in history */
-#define HISTORY_MAX_SIZE 1000
+/* Default number of commands kept in memory ($HISTSIZE overrides it) */
+#define HISTORY_DEFAULT_SIZE 1000
 
-/* Maximum length of a single command */
-#define HISTORY_MAX_CMD_LEN 4096
+/* Default number of commands kept in the history file ($HISTFILESIZE overrides it) */
+#define HISTORY_DEFAULT_FILE_SIZE 2000
+
+/* History file in $HOME, unless $HISTFILE names another */
+#define HISTORY_FILE_NAME ".mshx_history"
+
+/* Magic strings starting the history file and ending its index */
+#define HISTORY_MAGIC       "MSHXHST1"
+#define HISTORY_INDEX_MAGIC "MSHXIDX1"
+#define HISTORY_MAGIC_LEN   8
+
+/* One remembered command */
+typedef struct {
+    char *text;             /* Command text, without the newline */
+    int mapped;             /* text points into the mapped history file */
+} history_entry_t;
 
 /* Initialize the history system */
 void history_init(void);
 
+/* Load the history file and keep adding to it (interactive shell only) */
+void history_load(void);
+
+/* Change the number of commands kept in memory ($HISTSIZE) */
+void history_set_size(int size);
+
 /* Add a command to history */
 void history_add(const char *cmd);
 
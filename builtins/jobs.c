@@ -0,0 +1,1221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include "jobs.h"
+#include "timeline.h"
+
+/*
+ * The reaper.  Every child the shell starts gets a pidfd, and all the pidfds
+ * sit in one epoll set together with a signalfd for SIGCHLD.  A pidfd turns
+ * readable when its process exits, so epoll_wait() hands us exactly the
+ * children that changed, in the order they changed, however many jobs are
+ * running.  SIGCHLD (with the pid in the signalfd record) tells us about
+ * stopped and continued children, which pidfds don't report.
+ */
+static int epoll_fd = -1;
+static int sigchld_fd = -1;
+
+/* Live processes, hashed by pid (to match SIGCHLD records) */
+static job_proc_t *pid_table[JOBS_PID_BUCKETS];
+static int nwatched = 0;        /* Live processes we know of */
+static int nopidfd = 0;         /* Of those, how many have no pidfd */
+static job_proc_t *nopidfd_list = NULL;  /* and which ones */
+
+/* The job table, in job number order */
+static job_t *job_list = NULL, *job_list_last = NULL;
+
+/* Finished background jobs not reported yet, in the order they finished */
+static job_t *done_first = NULL, *done_last = NULL;
+
+/* The foreground job job_wait() is waiting for */
+static job_t *fg_job = NULL;
+
+/*
+ * Job control.  With a terminal on stdin, the interactive shell runs every
+ * job in a process group of its own and hands the terminal to the foreground
+ * one with tcsetpgrp(), so ^C and ^Z only reach that job and a stopped job
+ * can be resumed later with fg or bg.  Background jobs always get their own
+ * group, so ^C at the terminal doesn't reach them.
+ */
+static int job_control = 0;
+static int shell_tty = -1;
+static pid_t shell_pgid = 0;
+static struct termios shell_tmodes;
+
+/* Block SIGCHLD, so it's only delivered through the signalfd */
+void jobs_block_sigchld(void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+}
+
+/* Let a child started with fork() or popen() see SIGCHLD again */
+void jobs_unblock_sigchld(void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+/* Set up the reaper, called once at startup */
+void jobs_init(void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    jobs_block_sigchld();
+
+    sigchld_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigchld_fd < 0 || epoll_fd < 0)
+    {
+        fprintf(stderr, "error: failed to set up child reaping: %s\n", strerror(errno));
+        return;
+    }
+
+    /* The signalfd is the event with no process attached */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_fd, &ev);
+}
+
+/* Turn on job control if stdin is a terminal (interactive shell only) */
+void jobs_enable_control(void)
+{
+    if (!isatty(STDIN_FILENO))
+    {
+        return;
+    }
+    shell_tty = STDIN_FILENO;
+
+    /* If we were started in the background, wait until we're brought forward */
+    while (tcgetpgrp(shell_tty) != (shell_pgid = getpgrp()))
+    {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    signal(SIGTTIN, SIG_IGN);
+
+    /* Lead our own process group (a session leader already does) */
+    setpgid(0, 0);
+    shell_pgid = getpgrp();
+    tcsetpgrp(shell_tty, shell_pgid);
+    tcgetattr(shell_tty, &shell_tmodes);
+
+    job_control = 1;
+}
+
+/* Start over with an empty job table and a reaper of our own in a forked subshell */
+void jobs_subshell(void)
+{
+    /*
+     * The epoll set is shared with the parent, so let go of it before
+     * forgetting the parent's processes (which would take them out of it).
+     */
+    if (epoll_fd >= 0)
+    {
+        close(epoll_fd);
+    }
+    if (sigchld_fd >= 0)
+    {
+        close(sigchld_fd);
+    }
+    epoll_fd = sigchld_fd = -1;
+
+    while (job_list)
+    {
+        job_free(job_list);
+    }
+
+    /* The subshell's children stay in its process group */
+    job_control = 0;
+    jobs_init();
+}
+
+/* Find the live process with the given pid */
+static job_proc_t *find_proc(pid_t pid)
+{
+    job_proc_t *proc = pid_table[pid % JOBS_PID_BUCKETS];
+
+    while (proc && proc->pid != pid)
+    {
+        proc = proc->hash_next;
+    }
+
+    return proc;
+}
+
+/* Stop watching a process that has finished */
+static void forget_proc(job_proc_t *proc)
+{
+    job_proc_t **pproc = &pid_table[proc->pid % JOBS_PID_BUCKETS];
+
+    while (*pproc && *pproc != proc)
+    {
+        pproc = &(*pproc)->hash_next;
+    }
+    if (!*pproc)
+    {
+        /* Already forgotten */
+        return;
+    }
+    *pproc = proc->hash_next;
+    proc->hash_next = NULL;
+
+    if (proc->pidfd >= 0)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, proc->pidfd, NULL);
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+    else
+    {
+        if (proc->nopidfd_prev)
+        {
+            proc->nopidfd_prev->nopidfd_next = proc->nopidfd_next;
+        }
+        else
+        {
+            nopidfd_list = proc->nopidfd_next;
+        }
+        if (proc->nopidfd_next)
+        {
+            proc->nopidfd_next->nopidfd_prev = proc->nopidfd_prev;
+        }
+        proc->nopidfd_prev = proc->nopidfd_next = NULL;
+        nopidfd--;
+    }
+    nwatched--;
+}
+
+/* Put a job in the job table, giving it the next job number */
+static void link_job(job_t *job)
+{
+    job->id = job_list_last ? job_list_last->id + 1 : 1;
+    job->prev = job_list_last;
+    job->next = NULL;
+
+    if (job_list_last)
+    {
+        job_list_last->next = job;
+    }
+    else
+    {
+        job_list = job;
+    }
+    job_list_last = job;
+}
+
+/* Take a job out of the job table */
+static void unlink_job(job_t *job)
+{
+    if (job->prev)
+    {
+        job->prev->next = job->next;
+    }
+    else
+    {
+        job_list = job->next;
+    }
+    if (job->next)
+    {
+        job->next->prev = job->prev;
+    }
+    else
+    {
+        job_list_last = job->prev;
+    }
+
+    job->id = 0;
+    job->prev = job->next = NULL;
+}
+
+/* Queue a finished background job, so the next prompt reports it */
+static void queue_done(job_t *job)
+{
+    if (job->done_queued)
+    {
+        return;
+    }
+
+    job->done_queued = 1;
+    job->done_next = NULL;
+    if (done_last)
+    {
+        done_last->done_next = job;
+    }
+    else
+    {
+        done_first = job;
+    }
+    done_last = job;
+}
+
+/* Take a job out of the finished jobs queue */
+static void unqueue_done(job_t *job)
+{
+    job_t *prev = NULL;
+
+    for (job_t *j = done_first; j; prev = j, j = j->done_next)
+    {
+        if (j != job)
+        {
+            continue;
+        }
+
+        if (prev)
+        {
+            prev->done_next = j->done_next;
+        }
+        else
+        {
+            done_first = j->done_next;
+        }
+        if (done_last == j)
+        {
+            done_last = prev;
+        }
+        break;
+    }
+    job->done_queued = 0;
+}
+
+/* Create a job, background jobs go into the job table at once */
+job_t *job_new(const char *command, int background)
+{
+    job_t *job = calloc(1, sizeof(job_t));
+    if (!job)
+    {
+        return NULL;
+    }
+
+    job->command = strdup(command ? command : "");
+    job->background = background;
+
+    if (background)
+    {
+        link_job(job);
+    }
+
+    return job;
+}
+
+/* Process group a new process of the job joins: -1 for the shell's, 0 for a new one */
+pid_t job_pgid(job_t *job)
+{
+    if (!job || (!job->background && !job_control))
+    {
+        return -1;
+    }
+    return job->pgid;
+}
+
+/* Terminal a new process of a foreground job takes over, or -1 */
+int job_tty(job_t *job)
+{
+    return (job && !job->background && job_control) ? shell_tty : -1;
+}
+
+/* Join the job's process group in a forked child (before exec) */
+void job_child_setup(job_t *job)
+{
+    pid_t pgid = job_pgid(job);
+    int tty = job_tty(job);
+
+    if (pgid < 0)
+    {
+        return;
+    }
+
+    /* SIGTTOU is still ignored here, so we may take the terminal */
+    setpgid(0, pgid);
+    if (tty >= 0)
+    {
+        tcsetpgrp(tty, getpgrp());
+    }
+}
+
+/* Add a started child to a job */
+job_proc_t *job_add_process(job_t *job, pid_t pid)
+{
+    job_proc_t *proc = calloc(1, sizeof(job_proc_t));
+    if (!proc)
+    {
+        return NULL;
+    }
+
+    proc->pid = pid;
+    proc->state = PROC_RUNNING;
+    proc->job = job;
+
+    /*
+     * The first process leads the job's group.  The child joins it itself
+     * too, so whichever of us runs first, it's in the group before exec.
+     */
+    if (job_pgid(job) >= 0)
+    {
+        if (!job->pgid)
+        {
+            job->pgid = pid;
+        }
+        setpgid(pid, job->pgid);
+    }
+
+    if (job->last_proc)
+    {
+        job->last_proc->next = proc;
+    }
+    else
+    {
+        job->procs = proc;
+    }
+    job->last_proc = proc;
+    job->nprocs++;
+    job->nrunning++;
+
+    unsigned int bucket = pid % JOBS_PID_BUCKETS;
+    proc->hash_next = pid_table[bucket];
+    pid_table[bucket] = proc;
+    nwatched++;
+
+    /* A pidfd can be opened even if the child has already exited */
+    proc->pidfd = -1;
+    if (epoll_fd >= 0 && nwatched - 1 - nopidfd < JOBS_PIDFD_MAX)
+    {
+        proc->pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (proc->pidfd >= 0)
+        {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = proc;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, proc->pidfd, &ev) < 0)
+            {
+                close(proc->pidfd);
+                proc->pidfd = -1;
+            }
+        }
+    }
+    if (proc->pidfd < 0)
+    {
+        proc->nopidfd_prev = NULL;
+        proc->nopidfd_next = nopidfd_list;
+        if (nopidfd_list)
+        {
+            nopidfd_list->nopidfd_prev = proc;
+        }
+        nopidfd_list = proc;
+        nopidfd++;
+    }
+
+    return proc;
+}
+
+/* Mark a process as finished with the given status */
+static void proc_done(job_proc_t *proc, int status)
+{
+    if (proc->state == PROC_RUNNING)
+    {
+        proc->job->nrunning--;
+    }
+    else if (proc->state == PROC_STOPPED)
+    {
+        proc->job->nstopped--;
+    }
+
+    proc->state = PROC_DONE;
+    proc->status = status;
+    forget_proc(proc);
+
+    /* Jobs in the job table are reported, unless job_wait() is on it */
+    job_t *job = proc->job;
+    if (job->id && job != fg_job && job->nrunning == 0 && job->nstopped == 0)
+    {
+        queue_done(job);
+    }
+}
+
+/*
+ * Only the foreground job's events belong to the current timeline, unless
+ * it's a session-wide one
+ */
+static int timeline_wants(job_proc_t *proc)
+{
+    return timeline_is_enabled() && (!proc->job->background || timeline_in_session());
+}
+
+/* Apply a state change reported by wait_proc(), usage is NULL if we didn't collect it */
+static void update_proc(job_proc_t *proc, siginfo_t *info, timeline_usage_t *usage)
+{
+    job_t *job = proc->job;
+    int record = timeline_wants(proc);
+
+    switch (info->si_code)
+    {
+        case CLD_EXITED:
+            proc_done(proc, info->si_status);
+            if (record)
+            {
+                timeline_record_exit(proc->pid, info->si_status, usage);
+            }
+            break;
+
+        case CLD_KILLED:
+        case CLD_DUMPED:
+            proc_done(proc, 128 + info->si_status);
+            if (record)
+            {
+                timeline_record_signaled(proc->pid, info->si_status, usage);
+            }
+            break;
+
+        case CLD_STOPPED:
+        case CLD_TRAPPED:
+            if (proc->state == PROC_RUNNING)
+            {
+                proc->state = PROC_STOPPED;
+                job->nrunning--;
+                job->nstopped++;
+            }
+            proc->status = 128 + info->si_status;
+            if (record)
+            {
+                timeline_record_stopped(proc->pid, info->si_status);
+            }
+            break;
+
+        case CLD_CONTINUED:
+            if (proc->state == PROC_STOPPED)
+            {
+                proc->state = PROC_RUNNING;
+                job->nstopped--;
+                job->nrunning++;
+            }
+            if (record)
+            {
+                timeline_record_continued(proc->pid);
+            }
+            break;
+    }
+}
+
+/*
+ * Collect a state change of one process (options is 0 or WNOHANG), putting
+ * it in info the way waitid() would.  We reap with wait4(), which hands
+ * back the rusage of the process it reaps; when usage isn't NULL we fill
+ * it in, peeking first (WNOWAIT) to read /proc/<pid>/io while the zombie
+ * is still there.  info->si_pid is 0 if there was nothing to collect,
+ * returns -1 on error.
+ */
+static int wait_proc(job_proc_t *proc, siginfo_t *info, int options, timeline_usage_t *usage)
+{
+    struct rusage ru;
+    int status;
+
+    memset(info, 0, sizeof(*info));
+    if (usage)
+    {
+        siginfo_t peek;
+
+        memset(usage, 0, sizeof(*usage));
+        usage->io_read = usage->io_write = -1;
+        memset(&peek, 0, sizeof(peek));
+        if (waitid(P_PID, proc->pid, &peek, WEXITED | WSTOPPED | WCONTINUED | WNOWAIT | options) < 0)
+        {
+            return -1;
+        }
+        if (peek.si_pid == 0)
+        {
+            return 0;
+        }
+        if (peek.si_code == CLD_EXITED || peek.si_code == CLD_KILLED || peek.si_code == CLD_DUMPED)
+        {
+            timeline_read_io(proc->pid, usage);
+        }
+    }
+
+    pid_t pid = wait4(proc->pid, &status, WUNTRACED | WCONTINUED | options, &ru);
+    if (pid <= 0)
+    {
+        return pid;
+    }
+
+    info->si_pid = pid;
+    if (WIFEXITED(status))
+    {
+        info->si_code = CLD_EXITED;
+        info->si_status = WEXITSTATUS(status);
+    }
+    else if (WIFSIGNALED(status))
+    {
+        info->si_code = WCOREDUMP(status) ? CLD_DUMPED : CLD_KILLED;
+        info->si_status = WTERMSIG(status);
+    }
+    else if (WIFSTOPPED(status))
+    {
+        info->si_code = CLD_STOPPED;
+        info->si_status = WSTOPSIG(status);
+    }
+    else
+    {
+        info->si_code = CLD_CONTINUED;
+        info->si_status = SIGCONT;
+    }
+
+    if (usage && (info->si_code == CLD_EXITED || info->si_code == CLD_KILLED ||
+                  info->si_code == CLD_DUMPED))
+    {
+        timeline_set_rusage(usage, &ru);
+    }
+    return 0;
+}
+
+/* Collect the pending state changes of one process */
+static void check_proc(job_proc_t *proc)
+{
+    while (proc->state != PROC_DONE)
+    {
+        siginfo_t info;
+        timeline_usage_t usage;
+        int want = timeline_wants(proc);
+
+        if (wait_proc(proc, &info, WNOHANG, want ? &usage : NULL) < 0)
+        {
+            if (errno == ECHILD)
+            {
+                /* Somebody else reaped it, keep the last status we saw */
+                proc_done(proc, proc->status);
+            }
+            return;
+        }
+        if (info.si_pid == 0)
+        {
+            /* Nothing (more) to report */
+            return;
+        }
+        update_proc(proc, &info, want ? &usage : NULL);
+    }
+}
+
+/* Handle the SIGCHLD records queued on the signalfd */
+static void handle_sigchld(void)
+{
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+
+    while ((n = read(sigchld_fd, si, sizeof(si))) > 0)
+    {
+        for (size_t i = 0; i < n / sizeof(si[0]); i++)
+        {
+            job_proc_t *proc = find_proc(si[i].ssi_pid);
+            if (proc)
+            {
+                check_proc(proc);
+            }
+        }
+    }
+
+    /*
+     * SIGCHLDs arriving together are merged into one, so a ^Z that stops a
+     * whole pipeline may only name one of its processes.  Check the rest of
+     * the foreground job too, as we're waiting on it.
+     */
+    if (fg_job)
+    {
+        for (job_proc_t *proc = fg_job->procs; proc; proc = proc->next)
+        {
+            if (proc->state == PROC_RUNNING)
+            {
+                check_proc(proc);
+            }
+        }
+    }
+
+    /*
+     * Children without a pidfd (old kernels, or too many children) are only
+     * heard of through SIGCHLD, and a merged one names just one of them.
+     * Ask the kernel (without reaping) which child still has a change
+     * waiting and collect that one, until there are none left.  Only a
+     * child we don't know of, which would keep turning up, makes us fall
+     * back to looking at each process without a pidfd.
+     */
+    if (nopidfd > 0)
+    {
+        for (int tries = nwatched; tries > 0; tries--)
+        {
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0 ||
+                info.si_pid == 0)
+            {
+                return;
+            }
+
+            job_proc_t *proc = find_proc(info.si_pid);
+            if (!proc)
+            {
+                break;
+            }
+            check_proc(proc);
+        }
+
+        job_proc_t *proc = nopidfd_list;
+        while (proc)
+        {
+            job_proc_t *next = proc->nopidfd_next;
+            check_proc(proc);
+            proc = next;
+        }
+    }
+}
+
+/*
+ * Wait up to timeout ms (-1 for no limit) for child events and handle them.
+ *
+ * Returns the number of events handled, or -1 if a signal interrupted the wait.
+ */
+static int jobs_poll(int timeout)
+{
+    struct epoll_event events[JOBS_EVENTS_MAX];
+
+    int n = epoll_wait(epoll_fd, events, JOBS_EVENTS_MAX, timeout);
+    for (int i = 0; i < n; i++)
+    {
+        job_proc_t *proc = events[i].data.ptr;
+        if (proc)
+        {
+            check_proc(proc);
+        }
+        else
+        {
+            handle_sigchld();
+        }
+    }
+
+    return n;
+}
+
+/* Collect any child state changes without blocking */
+void jobs_reap(void)
+{
+    if (nwatched == 0 || epoll_fd < 0)
+    {
+        return;
+    }
+
+    while (jobs_poll(0) == JOBS_EVENTS_MAX)
+    {
+        ;
+    }
+}
+
+/*
+ * Wait until none of a job's processes are running any more.
+ *
+ * Returns 0, or -1 if a signal (like ^C at the prompt) interrupted the wait.
+ */
+static int wait_procs(job_t *job)
+{
+    while (job->nrunning > 0)
+    {
+        if (epoll_fd >= 0)
+        {
+            if (jobs_poll(-1) < 0 && errno == EINTR)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        /* No reaper, wait for each process in turn */
+        for (job_proc_t *proc = job->procs; proc; proc = proc->next)
+        {
+            siginfo_t info;
+            timeline_usage_t usage;
+            int want = timeline_wants(proc);
+
+            if (proc->state != PROC_RUNNING)
+            {
+                continue;
+            }
+            if (wait_proc(proc, &info, 0, want ? &usage : NULL) == 0)
+            {
+                update_proc(proc, &info, want ? &usage : NULL);
+            }
+            else if (errno == ECHILD)
+            {
+                proc_done(proc, proc->status);
+            }
+            else if (errno == EINTR)
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Wait for a foreground job to finish or stop, returns 1 if it stopped */
+int job_wait(job_t *job)
+{
+    int tty = job->pgid ? job_tty(job) : -1;
+
+    fg_job = job;
+
+    /* The child takes the terminal too, this covers a child that hasn't yet */
+    if (tty >= 0)
+    {
+        tcsetpgrp(tty, job->pgid);
+    }
+
+    while (wait_procs(job) < 0)
+    {
+        ;
+    }
+
+    fg_job = NULL;
+
+    /* Take the terminal back, remembering the modes a stopped job left */
+    if (tty >= 0)
+    {
+        if (job->nstopped)
+        {
+            job->saved_tmodes = (tcgetattr(tty, &job->tmodes) == 0);
+        }
+        tcsetpgrp(tty, shell_pgid);
+        tcsetattr(tty, TCSADRAIN, &shell_tmodes);
+
+        /* The shell didn't see the ^C, so start the prompt on a fresh line */
+        if (job->last_proc && job->last_proc->status == 128 + SIGINT)
+        {
+            fputc('\n', stderr);
+        }
+    }
+
+    if (job->nstopped == 0)
+    {
+        return 0;
+    }
+
+    /* A stopped job stays in the job table */
+    if (!job->id)
+    {
+        link_job(job);
+    }
+    fprintf(stderr, "\n[%d]+  %-24s%s\n", job->id, "Stopped", job->command);
+    return 1;
+}
+
+/* Resume a stopped job with SIGCONT, returns 1 if it stopped again (fg only) */
+int job_continue(job_t *job, int foreground)
+{
+    job->background = !foreground;
+
+    /* Count the processes as running now, not when SIGCHLD says so */
+    for (job_proc_t *proc = job->procs; proc; proc = proc->next)
+    {
+        if (proc->state == PROC_STOPPED)
+        {
+            proc->state = PROC_RUNNING;
+            job->nstopped--;
+            job->nrunning++;
+        }
+    }
+
+    if (foreground && job->pgid && job->saved_tmodes && job_tty(job) >= 0)
+    {
+        tcsetattr(shell_tty, TCSADRAIN, &job->tmodes);
+    }
+
+    if (job->pgid)
+    {
+        kill(-job->pgid, SIGCONT);
+    }
+    else
+    {
+        for (job_proc_t *proc = job->procs; proc; proc = proc->next)
+        {
+            if (proc->state != PROC_DONE)
+            {
+                kill(proc->pid, SIGCONT);
+            }
+        }
+    }
+
+    return foreground ? job_wait(job) : 0;
+}
+
+/* Free a job and its processes */
+void job_free(job_t *job)
+{
+    if (!job)
+    {
+        return;
+    }
+
+    if (job->id)
+    {
+        unlink_job(job);
+    }
+    if (job->done_queued)
+    {
+        unqueue_done(job);
+    }
+
+    job_proc_t *proc = job->procs;
+    while (proc)
+    {
+        job_proc_t *next = proc->next;
+        if (proc->state != PROC_DONE)
+        {
+            forget_proc(proc);
+        }
+        free(proc);
+        proc = next;
+    }
+
+    free(job->command);
+    free(job);
+}
+
+/* Exit status of a job: that of its last process */
+static int job_status(job_t *job)
+{
+    return job->last_proc ? job->last_proc->status : 0;
+}
+
+/* Describe the state of a job for job messages */
+static void job_state(job_t *job, char *buf, size_t size)
+{
+    if (job->nrunning > 0)
+    {
+        snprintf(buf, size, "Running");
+    }
+    else if (job->nstopped > 0)
+    {
+        snprintf(buf, size, "Stopped");
+    }
+    else if (job_status(job) == 0)
+    {
+        snprintf(buf, size, "Done");
+    }
+    else
+    {
+        snprintf(buf, size, "Exit %d", job_status(job));
+    }
+}
+
+/* '+' for the current job (the newest), '-' for the previous one */
+static char job_mark(job_t *job)
+{
+    if (job == job_list_last)
+    {
+        return '+';
+    }
+    if (job_list_last && job == job_list_last->prev)
+    {
+        return '-';
+    }
+    return ' ';
+}
+
+/* Reap children and report (and forget) finished background jobs */
+void jobs_notify(void)
+{
+    jobs_reap();
+
+    while (done_first)
+    {
+        job_t *job = done_first;
+        char state[32];
+
+        job_state(job, state, sizeof(state));
+        fprintf(stderr, "[%d]%c  %-24s%s\n", job->id, job_mark(job), state, job->command);
+        job_free(job);
+    }
+}
+
+/*
+ * Find the job named by a job spec: %n (job number), %+ or %% (current job),
+ * %- (previous job), %string (command starting with string) or a pid.  No
+ * spec means the current job.  Reports an error if there's no such job.
+ */
+static job_t *find_job(const char *spec, const char *builtin)
+{
+    job_t *job = NULL;
+
+    if (!spec || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 ||
+        strcmp(spec, "%+") == 0)
+    {
+        job = job_list_last;
+    }
+    else if (strcmp(spec, "%-") == 0)
+    {
+        job = job_list_last ? job_list_last->prev : NULL;
+    }
+    else if (spec[0] == '%' && isdigit((unsigned char)spec[1]))
+    {
+        int id = atoi(spec + 1);
+        for (job = job_list; job && job->id != id; job = job->next)
+        {
+            ;
+        }
+    }
+    else if (spec[0] == '%')
+    {
+        size_t len = strlen(spec + 1);
+        for (job_t *j = job_list; j; j = j->next)
+        {
+            if (strncmp(j->command, spec + 1, len) == 0)
+            {
+                job = j;
+            }
+        }
+    }
+    else if (isdigit((unsigned char)spec[0]))
+    {
+        pid_t pid = atoi(spec);
+        for (job_t *j = job_list; j && !job; j = j->next)
+        {
+            for (job_proc_t *proc = j->procs; proc; proc = proc->next)
+            {
+                if (proc->pid == pid)
+                {
+                    job = j;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (!job)
+    {
+        fprintf(stderr, "%s: %s: no such job\n", builtin, spec ? spec : "current");
+    }
+    return job;
+}
+
+/* jobs builtin: list the job table, forgetting the jobs that are done */
+int jobs_builtin(int argc, char **argv)
+{
+    int show_pids = 0, only_pids = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0)
+        {
+            show_pids = 1;
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            only_pids = 1;
+        }
+        else
+        {
+            fprintf(stderr, "jobs: usage: jobs [-l|-p]\n");
+            return 2;
+        }
+    }
+
+    jobs_reap();
+
+    job_t *job = job_list;
+    while (job)
+    {
+        job_t *next = job->next;
+        pid_t pid = job->pgid ? job->pgid : (job->procs ? job->procs->pid : 0);
+        char state[32];
+
+        if (only_pids)
+        {
+            printf("%d\n", pid);
+        }
+        else
+        {
+            job_state(job, state, sizeof(state));
+            if (show_pids)
+            {
+                printf("[%d]%c  %d %-24s%s\n", job->id, job_mark(job), pid, state, job->command);
+            }
+            else
+            {
+                printf("[%d]%c  %-24s%s\n", job->id, job_mark(job), state, job->command);
+            }
+        }
+
+        if (job->nrunning == 0 && job->nstopped == 0)
+        {
+            job_free(job);
+        }
+        job = next;
+    }
+
+    return 0;
+}
+
+/* fg builtin: resume a job in the foreground and wait for it */
+int fg_builtin(int argc, char **argv)
+{
+    jobs_reap();
+
+    job_t *job = find_job(argc > 1 ? argv[1] : NULL, "fg");
+    if (!job)
+    {
+        return 1;
+    }
+
+    printf("%s\n", job->command);
+    fflush(stdout);
+
+    /* It may have finished already */
+    int stopped = 0;
+    if (job->nrunning > 0 || job->nstopped > 0)
+    {
+        stopped = job_continue(job, 1);
+    }
+
+    int status = job_status(job);
+    if (!stopped)
+    {
+        job_free(job);
+    }
+    return status;
+}
+
+/* bg builtin: resume stopped jobs in the background */
+int bg_builtin(int argc, char **argv)
+{
+    int res = 0;
+
+    jobs_reap();
+
+    for (int i = 1; i < argc || i == 1; i++)
+    {
+        job_t *job = find_job(argc > 1 ? argv[i] : NULL, "bg");
+        if (!job)
+        {
+            res = 1;
+            continue;
+        }
+
+        if (job->nstopped == 0)
+        {
+            fprintf(stderr, "bg: job %d already in background\n", job->id);
+            continue;
+        }
+
+        job_continue(job, 0);
+        printf("[%d]%c %s &\n", job->id, job_mark(job), job->command);
+    }
+
+    return res;
+}
+
+/*
+ * Wait for the next job in the table to finish, for wait -n.
+ *
+ * Returns its exit status, 127 if there's nothing to wait for, or 130 if ^C
+ * interrupted the wait.
+ */
+static int wait_next(void)
+{
+    for (;;)
+    {
+        jobs_reap();
+        if (done_first)
+        {
+            job_t *job = done_first;
+            int status = job_status(job);
+            job_free(job);
+            return status;
+        }
+
+        job_t *job = job_list;
+        while (job && job->nrunning == 0)
+        {
+            job = job->next;
+        }
+        if (!job)
+        {
+            return 127;
+        }
+
+        int res = (epoll_fd >= 0) ? jobs_poll(-1) : wait_procs(job);
+        if (res < 0 && errno == EINTR)
+        {
+            return 128 + SIGINT;
+        }
+    }
+}
+
+/* wait builtin: wait [-n] [%job|pid ...] for background jobs to finish */
+int wait_builtin(int argc, char **argv)
+{
+    int status = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-n") == 0)
+    {
+        return wait_next();
+    }
+
+    /* No operands: wait for every running job, then forget the finished ones */
+    if (argc == 1)
+    {
+        for (job_t *job = job_list; job; job = job->next)
+        {
+            if (wait_procs(job) < 0)
+            {
+                return 128 + SIGINT;
+            }
+        }
+
+        job_t *job = job_list;
+        while (job)
+        {
+            job_t *next = job->next;
+            if (job->nrunning == 0 && job->nstopped == 0)
+            {
+                job_free(job);
+            }
+            job = next;
+        }
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        job_t *job = find_job(argv[i], "wait");
+        if (!job)
+        {
+            status = 127;
+            continue;
+        }
+
+        if (wait_procs(job) < 0)
+        {
+            return 128 + SIGINT;
+        }
+
+        status = job_status(job);
+        if (job->nstopped == 0)
+        {
+            job_free(job);
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,102 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <sys/types.h>
+#include <termios.h>
+
+/* Number of buckets in the pid -> process hash table */
+#define JOBS_PID_BUCKETS 64
+
+/*
+ * Most pidfds the reaper holds at once, so a very long pipeline doesn't
+ * use up the fd table; children past that are reaped on SIGCHLD alone
+ */
+#define JOBS_PIDFD_MAX 128
+
+/* Maximum number of child events handled per epoll_wait() call */
+#define JOBS_EVENTS_MAX 64
+
+/* State of a single process (or of a whole job) */
+typedef enum {
+    PROC_RUNNING,
+    PROC_STOPPED,
+    PROC_DONE
+} proc_state_t;
+
+struct job_s;
+
+/* Structure for one process of a job */
+typedef struct job_proc_s {
+    pid_t pid;                      /* Process ID */
+    int pidfd;                      /* pidfd watched by the reaper, or -1 */
+    proc_state_t state;             /* Running, stopped or done */
+    int status;                     /* Exit status ($? style) once stopped/done */
+    struct job_s *job;              /* Job this process belongs to */
+    struct job_proc_s *next;        /* Next process of the same job */
+    struct job_proc_s *hash_next;   /* Next process in the same pid bucket */
+    struct job_proc_s *nopidfd_prev, *nopidfd_next;  /* Neighbours among those with no pidfd */
+} job_proc_t;
+
+/* Structure for a job: a pipeline started by one command */
+typedef struct job_s {
+    int id;                         /* Job number, 0 until it's in the job table */
+    char *command;                  /* Command text, for job messages */
+    int background;                 /* Started with '&' (or resumed with bg) */
+    pid_t pgid;                     /* Process group, 0 if it hasn't got one */
+    struct termios tmodes;          /* Terminal modes saved when it stopped */
+    int saved_tmodes;               /* tmodes is valid */
+    int nprocs;                     /* Number of processes */
+    int nrunning;                   /* Processes still running */
+    int nstopped;                   /* Processes stopped */
+    job_proc_t *procs, *last_proc;  /* Processes, in pipeline order */
+    struct job_s *prev, *next;      /* Neighbours in the job table */
+    struct job_s *done_next;        /* Next finished job waiting to be reported */
+    int done_queued;                /* In the finished jobs queue */
+} job_t;
+
+/* Set up the reaper (signalfd + epoll), called once at startup */
+void jobs_init(void);
+
+/* Turn on job control if stdin is a terminal (interactive shell only) */
+void jobs_enable_control(void);
+
+/* Start over with an empty job table and a reaper of our own in a forked subshell */
+void jobs_subshell(void);
+
+/* Create a job, background jobs go into the job table at once */
+job_t *job_new(const char *command, int background);
+
+/* Add a started child to a job, returns its process entry */
+job_proc_t *job_add_process(job_t *job, pid_t pid);
+
+/* Process group a new process of the job joins: -1 for the shell's, 0 for a new one */
+pid_t job_pgid(job_t *job);
+
+/* Terminal a new process of a foreground job takes over, or -1 */
+int job_tty(job_t *job);
+
+/* Join the job's process group in a forked child (before exec) */
+void job_child_setup(job_t *job);
+
+/* Wait for a foreground job to finish or stop, returns 1 if it stopped */
+int job_wait(job_t *job);
+
+/* Resume a stopped job with SIGCONT, returns 1 if it stopped again (fg only) */
+int job_continue(job_t *job, int foreground);
+
+/* Free a finished foreground job */
+void job_free(job_t *job);
+
+/* Collect any child state changes without blocking */
+void jobs_reap(void);
+
+/* Reap children and report (and forget) finished background jobs */
+void jobs_notify(void);
+
+/* Let a child started with fork() or popen() see SIGCHLD again */
+void jobs_unblock_sigchld(void);
+
+/* Undo jobs_unblock_sigchld() in the shell itself */
+void jobs_block_sigchld(void);
+
+#endif /* JOBS_H */
@@ -1,9 +1,15 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         /* MAP_ANONYMOUS */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "timeline.h"
 
 /* Global timeline instance */
@@ -12,47 +18,81 @@ timeline_t g_timeline = {
     .enabled = 0  /* Timeline disabled by default, use --timeline to enable */
 };
 
-/* Get current time in milliseconds relative to command start */
-static double get_elapsed_ms(void)
+static void drain_ring(int finished);
+
+/* Get the current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t timeline_now(void)
 {
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
     
-    double start_ms = (double)g_timeline.start_time.tv_sec * 1000.0 +
-                      (double)g_timeline.start_time.tv_nsec / 1000000.0;
-    double now_ms = (double)now.tv_sec * 1000.0 +
-                    (double)now.tv_nsec / 1000000.0;
-    
-    return now_ms - start_ms;
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
 }
 
 /* Initialize timeline for a new command */
 void timeline_init(void)
 {
+    /*
+     * A session-wide timeline keeps everything from "timeline on", and
+     * once it's off, what it recorded stays for "timeline --format"
+     */
+    if (g_timeline.session || !g_timeline.enabled)
+    {
+        return;
+    }
+    
     g_timeline.event_count = 0;
-    clock_gettime(CLOCK_MONOTONIC, &g_timeline.start_time);
+    g_timeline.nchildren = 0;
+    g_timeline.gen++;
+    g_timeline.start_ns = timeline_now();
 }
 
 /* Reset/clear the timeline */
 void timeline_reset(void)
 {
-    /* Free any allocated redirect targets */
-    for (int i = 0; i < g_timeline.event_count; i++)
+    if (g_timeline.session)
     {
-        if (g_timeline.events[i].type == EVENT_REDIRECTED &&
-            g_timeline.events[i].data.redirect_info.target)
-        {
-            free(g_timeline.events[i].data.redirect_info.target);
-            g_timeline.events[i].data.redirect_info.target = NULL;
-        }
+        drain_ring(1);
+        return;
+    }
+    if (!g_timeline.enabled)
+    {
+        return;
+    }
+    
+    /* Skip whatever children wrote that wasn't collected */
+    if (g_timeline.ring)
+    {
+        atomic_store(&g_timeline.ring->tail, atomic_load(&g_timeline.ring->head));
+        atomic_store(&g_timeline.ring->dropped, 0);
     }
     g_timeline.event_count = 0;
+    g_timeline.nchildren = 0;
 }
 
 /* Enable/disable timeline tracking */
 void timeline_enable(int enable)
 {
+    /* The ring is set up the first time it's needed, and kept */
+    if (enable && !g_timeline.ring)
+    {
+        void *ring = mmap(NULL, sizeof(timeline_ring_t), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+        {
+            fprintf(stderr, "timeline: cannot map the event ring: %s\n", strerror(errno));
+        }
+        else
+        {
+            /* Anonymous memory comes zeroed, which is an empty ring */
+            g_timeline.ring = ring;
+        }
+    }
     g_timeline.enabled = enable;
+    if (!enable)
+    {
+        g_timeline.session = 0;
+    }
 }
 
 /* Check if timeline is enabled */
@@ -61,23 +101,51 @@ int timeline_is_enabled(void)
     return g_timeline.enabled;
 }
 
+/* Check if a session-wide timeline is recording (timeline on) */
+int timeline_in_session(void)
+{
+    return g_timeline.session;
+}
+
+/* Helper to add an event to the collected events */
+static timeline_event_t *append_event(void)
+{
+    if (g_timeline.event_count == g_timeline.event_size)
+    {
+        int size = g_timeline.event_size ? g_timeline.event_size * 2 : 64;
+        timeline_event_t *events = realloc(g_timeline.events, size * sizeof(timeline_event_t));
+        if (!events)
+        {
+            return NULL;
+        }
+        g_timeline.events = events;
+        g_timeline.event_size = size;
+    }
+    
+    timeline_event_t *event = &g_timeline.events[g_timeline.event_count];
+    event->seq = g_timeline.event_count++;
+    return event;
+}
+
 /* Helper to add a basic event */
-static timeline_event_t *add_event(pid_t pid, timeline_event_type_t type)
+static timeline_event_t *add_event(pid_t pid, timeline_event_type_t type, uint64_t time_ns)
 {
     if (!g_timeline.enabled)
     {
         return NULL;
     }
     
-    if (g_timeline.event_count >= MAX_TIMELINE_EVENTS)
+    /* Collect the children's events as we go, so the ring doesn't fill up */
+    drain_ring(0);
+    
+    timeline_event_t *event = append_event();
+    if (!event)
     {
         return NULL;
     }
-    
-    timeline_event_t *event = &g_timeline.events[g_timeline.event_count++];
     event->pid = pid;
     event->type = type;
-    event->time_ms = get_elapsed_ms();
+    event->time_ns = time_ns ? time_ns : timeline_now();
     
     /* Zero out the union */
     memset(&event->data, 0, sizeof(event->data));
@@ -85,42 +153,61 @@ static timeline_event_t *add_event(pid_t pid, timeline_event_type_t type)
     return event;
 }
 
-/* Record fork event */
-void timeline_record_fork(pid_t pid)
+/* Fill in the command of a fork event */
+static void set_command(timeline_event_t *event, const char *command)
 {
-    add_event(pid, EVENT_FORKED);
+    snprintf(event->data.fork_info.command, TIMELINE_TARGET_MAX, "%s",
+             command ? command : "");
+}
+
+/* Record fork event (the time taken before starting the child) */
+void timeline_record_fork(pid_t pid, uint64_t time_ns, const char *command)
+{
+    timeline_event_t *event = add_event(pid, EVENT_FORKED, time_ns);
+    if (event)
+    {
+        set_command(event, command);
+    }
 }
 
 /* Record execve event */
 void timeline_record_execve(pid_t pid)
 {
-    add_event(pid, EVENT_EXECVE);
+    add_event(pid, EVENT_EXECVE, 0);
 }
 
-/* Record exit event */
-void timeline_record_exit(pid_t pid, int exit_code)
+/* Record exit event, with what the process used (if we know) */
+void timeline_record_exit(pid_t pid, int exit_code, const timeline_usage_t *usage)
 {
-    timeline_event_t *event = add_event(pid, EVENT_EXITED);
+    timeline_event_t *event = add_event(pid, EVENT_EXITED, 0);
     if (event)
     {
         event->data.exit_info.exit_code = exit_code;
+        if (usage)
+        {
+            event->data.exit_info.usage = *usage;
+        }
     }
 }
 
-/* Record signaled event */
-void timeline_record_signaled(pid_t pid, int signal)
+/* Record signaled event, with what the process used (if we know) */
+void timeline_record_signaled(pid_t pid, int signal, const timeline_usage_t *usage)
 {
-    timeline_event_t *event = add_event(pid, EVENT_SIGNALED);
+    timeline_event_t *event = add_event(pid, EVENT_SIGNALED, 0);
     if (event)
     {
         event->data.signal_info.signal = signal;
+        if (usage)
+        {
+            event->data.signal_info.usage = *usage;
+        }
     }
 }
 
 /* Record stopped event */
 void timeline_record_stopped(pid_t pid, int signal)
 {
-    timeline_event_t *event = add_event(pid, EVENT_STOPPED);
+    timeline_event_t *event = add_event(pid, EVENT_STOPPED, 0);
     if (event)
     {
         event->data.signal_info.signal = signal;
@@ -130,31 +217,273 @@ void timeline_record_stopped(pid_t pid, int signal)
 /* Record continued event */
 void timeline_record_continued(pid_t pid)
 {
-    add_event(pid, EVENT_CONTINUED);
+    add_event(pid, EVENT_CONTINUED, 0);
 }
 
 /* Record pipe event */
 void timeline_record_pipe(pid_t from_pid, pid_t to_pid)
 {
-    timeline_event_t *event = add_event(to_pid, EVENT_PIPED);
+    timeline_event_t *event = add_event(to_pid, EVENT_PIPED, 0);
+    if (event)
+    {
+        event->data.pipe_info.from_pid = from_pid;
+        event->data.pipe_info.to_pid = to_pid;
+    }
+}
+
+/* Record what went through an instrumented pipe, when it closed (see relay.h) */
+void timeline_record_pipe_closed(pid_t from_pid, pid_t to_pid, uint64_t time_ns,
+                                 uint64_t bytes, uint64_t full_ns, uint64_t empty_ns)
+{
+    timeline_event_t *event = add_event(to_pid, EVENT_PIPE_CLOSED, time_ns);
     if (event)
     {
         event->data.pipe_info.from_pid = from_pid;
         event->data.pipe_info.to_pid = to_pid;
+        event->data.pipe_info.bytes = bytes;
+        event->data.pipe_info.full_ns = full_ns;
+        event->data.pipe_info.empty_ns = empty_ns;
     }
 }
 
+/* Fill in the target of a redirect event */
+static void set_redirect(timeline_event_t *event, const char *target, int direction)
+{
+    snprintf(event->data.redirect_info.target, TIMELINE_TARGET_MAX, "%s",
+             target ? target : "");
+    event->data.redirect_info.direction = direction;
+}
+
 /* Record redirect event */
-void timeline_record_redirect(pid_t pid, const char *target, int direction)
+void timeline_record_redirect(pid_t pid, const char *target, int direction, uint64_t time_ns)
 {
-    timeline_event_t *event = add_event(pid, EVENT_REDIRECTED);
+    timeline_event_t *event = add_event(pid, EVENT_REDIRECTED, time_ns);
     if (event)
     {
-        event->data.redirect_info.target = target ? strdup(target) : NULL;
-        event->data.redirect_info.direction = direction;
+        set_redirect(event, target, direction);
+    }
+}
+
+/*
+ * Read the I/O counters of a process that has exited but isn't reaped yet.
+ * rchar and wchar count every byte through read() and write(), pipes and
+ * terminals included, which is what tells a stage that moves data from
+ * one that computes.  Without /proc they stay unknown.
+ */
+void timeline_read_io(pid_t pid, timeline_usage_t *usage)
+{
+    char path[32], buf[512];
+    
+    usage->io_read = usage->io_write = -1;
+    
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+    {
+        return;
+    }
+    buf[n] = '\0';
+    
+    for (char *line = buf; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL)
+    {
+        if (strncmp(line, "rchar: ", 7) == 0)
+        {
+            usage->io_read = strtoll(line + 7, NULL, 10);
+        }
+        else if (strncmp(line, "wchar: ", 7) == 0)
+        {
+            usage->io_write = strtoll(line + 7, NULL, 10);
+        }
+    }
+}
+
+/* Fill in the rest of a usage record from wait4()'s rusage */
+void timeline_set_rusage(timeline_usage_t *usage, const struct rusage *ru)
+{
+    usage->valid = 1;
+    usage->utime_us = (uint64_t)ru->ru_utime.tv_sec * 1000000u + ru->ru_utime.tv_usec;
+    usage->stime_us = (uint64_t)ru->ru_stime.tv_sec * 1000000u + ru->ru_stime.tv_usec;
+    usage->maxrss_kb = ru->ru_maxrss;
+    usage->minflt = ru->ru_minflt;
+    usage->majflt = ru->ru_majflt;
+    usage->nvcsw = ru->ru_nvcsw;
+    usage->nivcsw = ru->ru_nivcsw;
+}
+
+/* Give the child about to be forked a number, which it inherits */
+void timeline_fork_prepare(void)
+{
+    if (!g_timeline.enabled || !g_timeline.ring)
+    {
+        return;
+    }
+    drain_ring(0);
+    
+    int n = g_timeline.nchildren + 1;
+    if (n >= g_timeline.child_pids_size)
+    {
+        int size = g_timeline.child_pids_size ? g_timeline.child_pids_size * 2 : 16;
+        pid_t *pids = realloc(g_timeline.child_pids, size * sizeof(pid_t));
+        if (!pids)
+        {
+            return;
+        }
+        g_timeline.child_pids = pids;
+        g_timeline.child_pids_size = size;
+    }
+    g_timeline.nchildren = n;
+    g_timeline.child_pids[n] = 0;
+    g_timeline.child = n;
+}
+
+/* Remember the pid of the child just forked (the child itself keeps its number) */
+void timeline_fork_parent(pid_t pid)
+{
+    if (pid != 0 && g_timeline.child)
+    {
+        g_timeline.child_pids[g_timeline.child] = pid;
+        g_timeline.child = 0;
     }
 }
 
+/* Start an event in the shared ring (in a forked child), NULL if there's no room */
+static timeline_slot_t *ring_claim(timeline_event_type_t type, uint64_t *ticket)
+{
+    timeline_ring_t *ring = g_timeline.ring;
+    
+    if (!g_timeline.enabled || !ring || !g_timeline.child)
+    {
+        return NULL;
+    }
+    
+    /*
+     * Don't overwrite events the shell hasn't read yet.  The ticket is only
+     * taken if there's room for it: one taken and never published would hold
+     * up the shell's drain at it.
+     */
+    uint64_t head = atomic_load(&ring->head);
+    do
+    {
+        if (head - atomic_load(&ring->tail) >= TIMELINE_RING_SLOTS)
+        {
+            atomic_fetch_add(&ring->dropped, 1);
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&ring->head, &head, head + 1));
+    *ticket = head;
+    
+    timeline_slot_t *slot = &ring->slots[*ticket & (TIMELINE_RING_SLOTS - 1)];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    slot->gen = g_timeline.gen;
+    slot->child = g_timeline.child;
+    slot->event.pid = 0;
+    slot->event.type = type;
+    slot->event.time_ns = timeline_now();
+    memset(&slot->event.data, 0, sizeof(slot->event.data));
+    return slot;
+}
+
+/* Finish an event started with ring_claim(), making it visible to the shell */
+static void ring_publish(timeline_slot_t *slot, uint64_t ticket)
+{
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+}
+
+/* Record a forked child starting to run, and the command it's going to run */
+void timeline_child_fork(const char *command)
+{
+    uint64_t ticket;
+    timeline_slot_t *slot = ring_claim(EVENT_FORKED, &ticket);
+    if (slot)
+    {
+        set_command(&slot->event, command);
+        ring_publish(slot, ticket);
+    }
+}
+
+/* Record an event in a forked child, stamped with the child's own clock */
+void timeline_child_record(timeline_event_type_t type)
+{
+    uint64_t ticket;
+    timeline_slot_t *slot = ring_claim(type, &ticket);
+    if (slot)
+    {
+        ring_publish(slot, ticket);
+    }
+}
+
+/* Record a redirection done in a forked child */
+void timeline_child_redirect(const char *target, int direction)
+{
+    uint64_t ticket;
+    timeline_slot_t *slot = ring_claim(EVENT_REDIRECTED, &ticket);
+    if (slot)
+    {
+        set_redirect(&slot->event, target, direction);
+        ring_publish(slot, ticket);
+    }
+}
+
+/*
+ * Move the events children have finished writing from the ring to the
+ * timeline.  Their pid is left as minus the child's number, as the child
+ * may have written before we knew its pid.
+ *
+ * While the command runs we stop at the first event still being written and
+ * leave the tail there, so the next drain picks it up.  Once its children
+ * are done (finished is set), such an event's writer died before it could
+ * finish, and we skip it.
+ */
+static void drain_ring(int finished)
+{
+    timeline_ring_t *ring = g_timeline.ring;
+    if (!ring || g_timeline.child)
+    {
+        return;
+    }
+    
+    uint64_t head = atomic_load(&ring->head);
+    uint64_t ticket = atomic_load(&ring->tail);
+    for ( ; ticket < head; ticket++)
+    {
+        timeline_slot_t *slot = &ring->slots[ticket & (TIMELINE_RING_SLOTS - 1)];
+        
+        /* An event still being written: its gen and child can't be trusted yet */
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ticket + 1)
+        {
+            if (!finished)
+            {
+                break;
+            }
+            continue;
+        }
+        
+        /* Skip events left over from another command, or from no child of ours */
+        if (slot->gen != g_timeline.gen ||
+            slot->child <= 0 || slot->child > g_timeline.nchildren)
+        {
+            continue;
+        }
+        
+        timeline_event_t *event = append_event();
+        if (!event)
+        {
+            break;
+        }
+        unsigned int seq = event->seq;
+        *event = slot->event;
+        event->seq = seq;
+        event->pid = -slot->child;
+    }
+    atomic_store(&ring->tail, ticket);
+}
+
 /* Get event type as string */
 const char *timeline_event_type_str(timeline_event_type_t type)
 {
@@ -168,93 +497,634 @@ const char *timeline_event_type_str(timeline_event_type_t type)
         case EVENT_CONTINUED: return "continued";
         case EVENT_PIPED:     return "piped";
         case EVENT_REDIRECTED: return "redirected";
+        case EVENT_PIPE_CLOSED: return "pipe-closed";
         default:              return "unknown";
     }
 }
 
-/* Compare function for qsort - sort events by time */
+/* Compare function for qsort - sort events by time, then by recording order */
 static int compare_events(const void *a, const void *b)
 {
     const timeline_event_t *ea = (const timeline_event_t *)a;
     const timeline_event_t *eb = (const timeline_event_t *)b;
     
-    if (ea->time_ms < eb->time_ms) return -1;
-    if (ea->time_ms > eb->time_ms) return 1;
+    if (ea->time_ns != eb->time_ns) return (ea->time_ns < eb->time_ns) ? -1 : 1;
+    if (ea->seq != eb->seq) return (ea->seq < eb->seq) ? -1 : 1;
     return 0;
 }
 
-/* Print the timeline in formatted output */
-void timeline_print(void)
+/* Compare function for qsort - sort events by pid, then by time */
+static int compare_pids(const void *a, const void *b)
 {
-    if (!g_timeline.enabled || g_timeline.event_count == 0)
+    const timeline_event_t *ea = (const timeline_event_t *)a;
+    const timeline_event_t *eb = (const timeline_event_t *)b;
+    
+    if (ea->pid != eb->pid) return (ea->pid < eb->pid) ? -1 : 1;
+    return compare_events(a, b);
+}
+
+/* Collect the children's events, give them their pids and sort everything by time */
+static void collect_events(void)
+{
+    drain_ring(1);
+    
+    /* Events from the ring carry the child's number in place of its pid */
+    for (int i = 0; i < g_timeline.event_count; i++)
     {
-        return;
+        timeline_event_t *event = &g_timeline.events[i];
+        if (event->pid < 0)
+        {
+            event->pid = g_timeline.child_pids[-event->pid];
+        }
     }
     
-    /* Sort events chronologically */
     qsort(g_timeline.events, g_timeline.event_count, 
           sizeof(timeline_event_t), compare_events);
+}
+
+/* Time of an event in ms since the start of the timeline */
+static double event_ms(uint64_t time_ns)
+{
+    return (double)(int64_t)(time_ns - g_timeline.start_ns) / 1000000.0;
+}
+
+/* The usage record of an EXITED or SIGNALED event, or an empty one */
+static const timeline_usage_t *event_usage(timeline_event_t *event)
+{
+    static const timeline_usage_t none = { .io_read = -1, .io_write = -1 };
     
-    /* Print header */
-    printf("\n%-6s %-20s %s\n", "PID", "EVENT", "TIME(ms)");
+    switch (event->type)
+    {
+        case EVENT_EXITED:   return &event->data.exit_info.usage;
+        case EVENT_SIGNALED: return &event->data.signal_info.usage;
+        default:             return &none;
+    }
+}
+
+/* Format a byte count as 512B, 4.0K, 1.5M or 2.0G */
+static void format_bytes(int64_t bytes, char *buf, size_t size)
+{
+    static const char units[] = "KMG";
+    double value = (double)bytes;
+    int unit = -1;
     
-    /* Print separator line */
-    printf("------ -------------------- --------\n");
+    while (value >= 1024.0 && unit < 2)
+    {
+        value /= 1024.0;
+        unit++;
+    }
+    if (unit < 0)
+    {
+        snprintf(buf, size, "%lldB", (long long)bytes);
+    }
+    else
+    {
+        snprintf(buf, size, "%.1f%c", value, units[unit]);
+    }
+}
+
+/*
+ * Describe what a process used, like time -v: CPU time (and how much of
+ * its running time it spent on a CPU), peak RSS, page faults, context
+ * switches and I/O.  run_ns is how long it ran, 0 if we don't know.
+ */
+static void usage_str(const timeline_usage_t *usage, uint64_t run_ns, char *buf, size_t size)
+{
+    char rbuf[16], wbuf[16], cpu[16] = "";
     
-    /* Print each event */
-    for (int i = 0; i < g_timeline.event_count; i++)
+    /* Below 10ms the clocks are too coarse for the share to mean anything */
+    if (run_ns >= 10000000)
     {
-        timeline_event_t *event = &g_timeline.events[i];
-        char event_str[64];
+        snprintf(cpu, sizeof(cpu), " (%.0f%%)",
+                 (double)(usage->utime_us + usage->stime_us) * 100000.0 / (double)run_ns);
+    }
+    int len = snprintf(buf, size, "user %.3f sys %.3f%s rss %ldK flt %ld/%ld csw %ld/%ld",
+                       usage->utime_us / 1000.0, usage->stime_us / 1000.0, cpu,
+                       usage->maxrss_kb, usage->minflt, usage->majflt,
+                       usage->nvcsw, usage->nivcsw);
+    
+    if (usage->io_read >= 0 && len >= 0 && (size_t)len < size)
+    {
+        format_bytes(usage->io_read, rbuf, sizeof(rbuf));
+        format_bytes(usage->io_write, wbuf, sizeof(wbuf));
+        snprintf(buf + len, size - len, " io %s/%s", rbuf, wbuf);
+    }
+}
+
+/* Describe an event, like "exited(0)" */
+static void event_name(timeline_event_t *event, char *buf, size_t size)
+{
+    switch (event->type)
+    {
+        case EVENT_PIPED:
+            snprintf(buf, size, "piped(%d→%d)",
+                     event->data.pipe_info.from_pid,
+                     event->data.pipe_info.to_pid);
+            break;
+            
+        case EVENT_PIPE_CLOSED:
+            snprintf(buf, size, "closed(%d→%d)",
+                     event->data.pipe_info.from_pid,
+                     event->data.pipe_info.to_pid);
+            break;
+            
+        case EVENT_EXITED:
+            snprintf(buf, size, "exited(%d)",
+                     event->data.exit_info.exit_code);
+            break;
+            
+        case EVENT_SIGNALED:
+            snprintf(buf, size, "signaled(%d)",
+                     event->data.signal_info.signal);
+            break;
+            
+        case EVENT_STOPPED:
+            snprintf(buf, size, "stopped(%d)",
+                     event->data.signal_info.signal);
+            break;
+            
+        case EVENT_REDIRECTED:
+            {
+                const char *dir_str;
+                switch (event->data.redirect_info.direction)
+                {
+                    case 0:  dir_str = "<"; break;
+                    case 1:  dir_str = ">"; break;
+                    case 2:  dir_str = ">>"; break;
+                    default: dir_str = "?"; break;
+                }
+                snprintf(buf, size, "redirected(%s%s)",
+                         dir_str, event->data.redirect_info.target);
+            }
+            break;
+            
+        default:
+            snprintf(buf, size, "%s", timeline_event_type_str(event->type));
+            break;
+    }
+}
+
+/*
+ * The life of one process, from its events: when it was forked, exec'd
+ * and ended (0 for what didn't happen), for the exports.
+ */
+typedef struct {
+    pid_t pid;
+    char command[TIMELINE_TARGET_MAX];
+    uint64_t fork_ns;
+    uint64_t exec_ns;
+    uint64_t end_ns;
+    timeline_usage_t usage;         /* From its EXITED or SIGNALED event */
+} timeline_proc_t;
+
+/* Gather the (collected) events into processes, sorted by pid */
+static timeline_proc_t *gather_procs(int *nprocs)
+{
+    int n = g_timeline.event_count;
+    timeline_event_t *events = malloc((n ? n : 1) * sizeof(timeline_event_t));
+    timeline_proc_t *procs = malloc((n ? n : 1) * sizeof(timeline_proc_t));
+    
+    *nprocs = 0;
+    if (!events || !procs)
+    {
+        free(events);
+        free(procs);
+        return NULL;
+    }
+    
+    memcpy(events, g_timeline.events, n * sizeof(timeline_event_t));
+    qsort(events, n, sizeof(timeline_event_t), compare_pids);
+    
+    for (int i = 0; i < n; i++)
+    {
+        timeline_event_t *event = &events[i];
+        if (*nprocs == 0 || procs[*nprocs - 1].pid != event->pid)
+        {
+            memset(&procs[*nprocs], 0, sizeof(timeline_proc_t));
+            procs[(*nprocs)++].pid = event->pid;
+        }
         
+        timeline_proc_t *proc = &procs[*nprocs - 1];
         switch (event->type)
         {
-            case EVENT_PIPED:
-                snprintf(event_str, sizeof(event_str), "piped(%d→%d)",
-                         event->data.pipe_info.from_pid,
-                         event->data.pipe_info.to_pid);
+            case EVENT_FORKED:
+                proc->fork_ns = event->time_ns;
+                memcpy(proc->command, event->data.fork_info.command, TIMELINE_TARGET_MAX);
                 break;
                 
-            case EVENT_EXITED:
-                snprintf(event_str, sizeof(event_str), "exited(%d)",
-                         event->data.exit_info.exit_code);
+            case EVENT_EXECVE:
+                proc->exec_ns = event->time_ns;
                 break;
                 
+            case EVENT_EXITED:
             case EVENT_SIGNALED:
-                snprintf(event_str, sizeof(event_str), "signaled(%d)",
-                         event->data.signal_info.signal);
+                proc->end_ns = event->time_ns;
+                proc->usage = *event_usage(event);
                 break;
                 
-            case EVENT_STOPPED:
-                snprintf(event_str, sizeof(event_str), "stopped(%d)",
-                         event->data.signal_info.signal);
+            default:
+                break;
+        }
+    }
+    
+    free(events);
+    return procs;
+}
+
+/* Find a process gathered by gather_procs() */
+static timeline_proc_t *find_proc(timeline_proc_t *procs, int nprocs, pid_t pid)
+{
+    int lo = 0, hi = nprocs - 1;
+    
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (procs[mid].pid == pid)
+        {
+            return &procs[mid];
+        }
+        if (procs[mid].pid < pid)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+/* Print the (collected) events as a table */
+static void print_table(FILE *out)
+{
+    int nprocs;
+    timeline_proc_t *procs = gather_procs(&nprocs);
+    
+    /* Print header */
+    fprintf(out, "\n%-6s %-20s %-10s %s\n", "PID", "EVENT", "TIME(ms)", "USAGE(ms)");
+    
+    /* Print separator line */
+    fprintf(out, "------ -------------------- ---------- ---------\n");
+    
+    /* Print each event, and what the process used next to its exit */
+    for (int i = 0; i < g_timeline.event_count; i++)
+    {
+        timeline_event_t *event = &g_timeline.events[i];
+        const timeline_usage_t *usage = event_usage(event);
+        char event_str[TIMELINE_TARGET_MAX + 32];
+        
+        event_name(event, event_str, sizeof(event_str));
+        if (event->type == EVENT_PIPE_CLOSED)
+        {
+            /* An instrumented pipe: full means its writer was held up */
+            char bytes[16];
+            format_bytes(event->data.pipe_info.bytes, bytes, sizeof(bytes));
+            fprintf(out, "%-6d %-20s %-10.3f moved %s full %.3f empty %.3f\n",
+                    event->pid, event_str, event_ms(event->time_ns), bytes,
+                    event->data.pipe_info.full_ns / 1000000.0,
+                    event->data.pipe_info.empty_ns / 1000000.0);
+            continue;
+        }
+        if (!usage->valid)
+        {
+            fprintf(out, "%-6d %-20s %.3f\n", event->pid, event_str, event_ms(event->time_ns));
+            continue;
+        }
+        
+        /* It ran from its exec (or its fork, if it never exec'd) */
+        timeline_proc_t *proc = find_proc(procs, nprocs, event->pid);
+        uint64_t start_ns = proc ? (proc->exec_ns ? proc->exec_ns : proc->fork_ns) : 0;
+        char usage_buf[160];
+        
+        usage_str(usage, start_ns ? event->time_ns - start_ns : 0, usage_buf, sizeof(usage_buf));
+        fprintf(out, "%-6d %-20s %-10.3f %s\n", event->pid, event_str,
+                event_ms(event->time_ns), usage_buf);
+    }
+    free(procs);
+    
+    uint64_t dropped = g_timeline.ring ? atomic_load(&g_timeline.ring->dropped) : 0;
+    if (dropped)
+    {
+        fprintf(out, "(%llu events lost, the ring was full)\n", (unsigned long long)dropped);
+    }
+    
+    fprintf(out, "\n");
+}
+
+/* Print the timeline in formatted output */
+void timeline_print(void)
+{
+    /* A session-wide timeline is only written out by the timeline builtin */
+    if (!g_timeline.enabled || g_timeline.session)
+    {
+        return;
+    }
+    
+    collect_events();
+    if (g_timeline.event_count > 0)
+    {
+        print_table(stdout);
+    }
+}
+
+/* Write a string as a JSON string */
+static void json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for ( ; *str; str++)
+    {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+        {
+            fprintf(out, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(out, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * Write the (collected) events in Chrome's trace event format, which
+ * Perfetto and chrome://tracing open.  Each process gets a track named
+ * after its command; its fork-to-exec and exec-to-exit times become spans,
+ * and its pipes, redirections, signals and exit zero-length spans on it.
+ * The exit's args hold the process's rusage and I/O counts, and those of
+ * an instrumented pipe's close what went through it.
+ */
+static void export_chrome_trace(FILE *out)
+{
+    int nprocs;
+    timeline_proc_t *procs = gather_procs(&nprocs);
+    uint64_t last_ns = g_timeline.event_count ?
+                       g_timeline.events[g_timeline.event_count - 1].time_ns : g_timeline.start_ns;
+    int first = 1;
+    
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    
+    for (int i = 0; i < nprocs; i++)
+    {
+        char name[TIMELINE_TARGET_MAX + 32];
+        if (procs[i].command[0])
+        {
+            snprintf(name, sizeof(name), "%s (%d)", procs[i].command, procs[i].pid);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%d", procs[i].pid);
+        }
+        
+        fprintf(out, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":",
+                first ? "" : ",", procs[i].pid);
+        json_string(out, name);
+        fprintf(out, "}}");
+        first = 0;
+    }
+    
+    for (int i = 0; i < g_timeline.event_count; i++)
+    {
+        timeline_event_t *event = &g_timeline.events[i];
+        timeline_proc_t *proc = find_proc(procs, nprocs, event->pid);
+        uint64_t end_ns = event->time_ns;
+        char name[TIMELINE_TARGET_MAX + 32];
+        
+        switch (event->type)
+        {
+            case EVENT_FORKED:
+                /* From the fork to the exec, or to the end if it never exec'd */
+                snprintf(name, sizeof(name), "fork");
+                if (proc)
+                {
+                    end_ns = proc->exec_ns ? proc->exec_ns : (proc->end_ns ? proc->end_ns : last_ns);
+                }
                 break;
                 
-            case EVENT_REDIRECTED:
+            case EVENT_EXECVE:
+                snprintf(name, sizeof(name), "%s", (proc && proc->command[0]) ? proc->command : "exec");
+                if (proc)
                 {
-                    const char *dir_str;
-                    switch (event->data.redirect_info.direction)
-                    {
-                        case 0:  dir_str = "<"; break;
-                        case 1:  dir_str = ">"; break;
-                        case 2:  dir_str = ">>"; break;
-                        default: dir_str = "?"; break;
-                    }
-                    snprintf(event_str, sizeof(event_str), "redirected(%s%s)",
-                             dir_str,
-                             event->data.redirect_info.target ? 
-                             event->data.redirect_info.target : "");
+                    end_ns = proc->end_ns ? proc->end_ns : last_ns;
                 }
                 break;
                 
             default:
-                snprintf(event_str, sizeof(event_str), "%s",
-                         timeline_event_type_str(event->type));
+                event_name(event, name, sizeof(name));
                 break;
         }
         
-        printf("%-6d %-20s %.0f\n", event->pid, event_str, event->time_ms);
+        fprintf(out, "%s\n{\"name\":", first ? "" : ",");
+        json_string(out, name);
+        fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                timeline_event_type_str(event->type), event->pid, event->pid,
+                event_ms(event->time_ns) * 1000.0,
+                (double)(end_ns - event->time_ns) / 1000.0);
+        
+        /* The exit carries what the process used, shown when it's selected */
+        const timeline_usage_t *usage = event_usage(event);
+        if (usage->valid)
+        {
+            fprintf(out, ",\"args\":{\"user_ms\":%.3f,\"sys_ms\":%.3f,\"maxrss_kb\":%ld,"
+                    "\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld",
+                    usage->utime_us / 1000.0, usage->stime_us / 1000.0, usage->maxrss_kb,
+                    usage->minflt, usage->majflt, usage->nvcsw, usage->nivcsw);
+            if (usage->io_read >= 0)
+            {
+                fprintf(out, ",\"read_bytes\":%lld,\"write_bytes\":%lld",
+                        (long long)usage->io_read, (long long)usage->io_write);
+            }
+            fprintf(out, "}");
+        }
+        else if (event->type == EVENT_PIPE_CLOSED)
+        {
+            fprintf(out, ",\"args\":{\"bytes\":%llu,\"full_ms\":%.3f,\"empty_ms\":%.3f}",
+                    (unsigned long long)event->data.pipe_info.bytes,
+                    event->data.pipe_info.full_ns / 1000000.0,
+                    event->data.pipe_info.empty_ns / 1000000.0);
+        }
+        fprintf(out, "}");
+        first = 0;
+    }
+    
+    fprintf(out, "\n]}\n");
+    free(procs);
+}
+
+/*
+ * Write the processes in the folded stack format flamegraph.pl and
+ * speedscope read: "mshX;command;fork N" for the microseconds from fork to
+ * exec, "mshX;command;user N" and "mshX;command;sys N" for the CPU time
+ * it used after that, and "mshX;command N" for the rest of its run.  The tools add
+ * up identical stacks, so a script's time shows up per command.
+ */
+static void export_folded(FILE *out)
+{
+    int nprocs;
+    timeline_proc_t *procs = gather_procs(&nprocs);
+    uint64_t last_ns = g_timeline.event_count ?
+                       g_timeline.events[g_timeline.event_count - 1].time_ns : g_timeline.start_ns;
+    
+    for (int i = 0; i < nprocs; i++)
+    {
+        timeline_proc_t *proc = &procs[i];
+        char name[TIMELINE_TARGET_MAX + 16];
+        uint64_t end_ns = proc->end_ns ? proc->end_ns : last_ns;
+        
+        if (!proc->fork_ns && !proc->exec_ns)
+        {
+            continue;
+        }
+        
+        /* ';' separates the frames, so it can't be in a name */
+        if (proc->command[0])
+        {
+            snprintf(name, sizeof(name), "%s", proc->command);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "pid %d", proc->pid);
+        }
+        for (char *p = name; *p; p++)
+        {
+            if (*p == ';' || *p == ' ')
+            {
+                *p = '_';
+            }
+        }
+        
+        if (proc->fork_ns)
+        {
+            uint64_t startup_ns = (proc->exec_ns ? proc->exec_ns : end_ns) - proc->fork_ns;
+            if (startup_ns >= 1000)
+            {
+                fprintf(out, "mshX;%s;fork %llu\n", name, (unsigned long long)(startup_ns / 1000));
+            }
+        }
+        if (!proc->exec_ns)
+        {
+            continue;
+        }
+        
+        /*
+         * Split the time it ran into user and system CPU time, when we have
+         * them, and the rest (waiting on I/O, pipes or the scheduler)
+         */
+        uint64_t run_us = (end_ns - proc->exec_ns) / 1000;
+        if (proc->usage.valid)
+        {
+            uint64_t user_us = proc->usage.utime_us, sys_us = proc->usage.stime_us;
+            
+            /* rusage counts its children too, and the clocks tick differently */
+            if (user_us > run_us)
+            {
+                user_us = run_us;
+            }
+            if (sys_us > run_us - user_us)
+            {
+                sys_us = run_us - user_us;
+            }
+            if (user_us)
+            {
+                fprintf(out, "mshX;%s;user %llu\n", name, (unsigned long long)user_us);
+            }
+            if (sys_us)
+            {
+                fprintf(out, "mshX;%s;sys %llu\n", name, (unsigned long long)sys_us);
+            }
+            run_us -= user_us + sys_us;
+        }
+        if (run_us)
+        {
+            fprintf(out, "mshX;%s %llu\n", name, (unsigned long long)run_us);
+        }
+    }
+    
+    free(procs);
+}
+
+/*
+ * timeline builtin command.
+ *
+ *   timeline on                        record every command from now on
+ *   timeline off                       stop recording
+ *   timeline --format=FORMAT [FILE]    write what was recorded to FILE
+ *                                      (default stdout), FORMAT is table,
+ *                                      chrome-trace or folded
+ *
+ * "timeline command" (the prefix form) is handled before a line is parsed.
+ */
+int timeline_builtin(int argc, char **argv)
+{
+    if (argc == 2 && strcmp(argv[1], "on") == 0)
+    {
+        timeline_enable(1);
+        g_timeline.session = 1;
+        g_timeline.event_count = 0;
+        g_timeline.nchildren = 0;
+        g_timeline.gen++;
+        g_timeline.start_ns = timeline_now();
+        if (g_timeline.ring)
+        {
+            atomic_store(&g_timeline.ring->tail, atomic_load(&g_timeline.ring->head));
+            atomic_store(&g_timeline.ring->dropped, 0);
+        }
+        return 0;
+    }
+    
+    if (argc == 2 && strcmp(argv[1], "off") == 0)
+    {
+        /* Keep the events for --format */
+        drain_ring(1);
+        timeline_enable(0);
+        return 0;
+    }
+    
+    if ((argc == 2 || argc == 3) && strncmp(argv[1], "--format=", 9) == 0)
+    {
+        const char *format = argv[1] + 9;
+        void (*export)(FILE *out);
+        
+        if (strcmp(format, "table") == 0)
+        {
+            export = print_table;
+        }
+        else if (strcmp(format, "chrome-trace") == 0)
+        {
+            export = export_chrome_trace;
+        }
+        else if (strcmp(format, "folded") == 0)
+        {
+            export = export_folded;
+        }
+        else
+        {
+            fprintf(stderr, "timeline: unknown format: %s (use table, chrome-trace or folded)\n", format);
+            return 2;
+        }
+        
+        FILE *out = stdout;
+        if (argc == 3 && strcmp(argv[2], "-") != 0 && !(out = fopen(argv[2], "w")))
+        {
+            fprintf(stderr, "timeline: cannot open %s: %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        
+        collect_events();
+        export(out);
+        
+        if (out != stdout)
+        {
+            fclose(out);
+        }
+        return 0;
     }
     
-    printf("\n");
+    fprintf(stderr, "timeline: usage: timeline on|off|--format=table|chrome-trace|folded [FILE]\n");
+    return 2;
 }
@@ -2,10 +2,15 @@
 #define TIMELINE_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/resource.h>
 
-/* Maximum number of timeline events we can track */
-#define MAX_TIMELINE_EVENTS 256
+/* Slots in the ring forked children write their events to (a power of 2) */
+#define TIMELINE_RING_SLOTS 4096
+
+/* Longest command name or redirection target kept in an event (longer ones are cut short) */
+#define TIMELINE_TARGET_MAX 48
 
 /* Event types for command execution timeline */
 typedef enum {
@@ -16,40 +21,99 @@ typedef enum {
     EVENT_STOPPED,
     EVENT_CONTINUED,
     EVENT_PIPED,
-    EVENT_REDIRECTED
+    EVENT_REDIRECTED,
+    EVENT_PIPE_CLOSED
 } timeline_event_type_t;
 
+/*
+ * What a process used, from wait4()'s rusage and (when it could be read
+ * before the process was reaped) /proc/<pid>/io.  Attached to its
+ * EXITED or SIGNALED event.
+ */
+typedef struct timeline_usage_s {
+    int valid;                      /* The rusage fields are filled in */
+    uint64_t utime_us;              /* User CPU time */
+    uint64_t stime_us;              /* System CPU time */
+    long maxrss_kb;                 /* Peak resident set size */
+    long minflt, majflt;            /* Page faults without and with I/O */
+    long nvcsw, nivcsw;             /* Voluntary and involuntary context switches */
+    int64_t io_read, io_write;      /* Bytes read and written (rchar, wchar), -1 if unknown */
+} timeline_usage_t;
+
 /* Structure for a single timeline event */
 typedef struct timeline_event_s {
     pid_t pid;                      /* Process ID or job identifier */
     timeline_event_type_t type;     /* Event type */
-    double time_ms;                 /* Time in milliseconds relative to command start */
+    uint64_t time_ns;               /* CLOCK_MONOTONIC time of the event */
+    unsigned int seq;               /* Order it was recorded in, for equal times */
     
     /* Additional data for specific event types */
     union {
         struct {
-            pid_t from_pid;         /* For PIPED: source PID */
-            pid_t to_pid;           /* For PIPED: destination PID */
+            char command[TIMELINE_TARGET_MAX];  /* For FORKED: the command's name */
+        } fork_info;
+        struct {
+            pid_t from_pid;         /* For PIPED/PIPE_CLOSED: source PID */
+            pid_t to_pid;           /* For PIPED/PIPE_CLOSED: destination PID */
+            uint64_t bytes;         /* For PIPE_CLOSED: bytes that went through */
+            uint64_t full_ns;       /* For PIPE_CLOSED: time the reader wasn't keeping up */
+            uint64_t empty_ns;      /* For PIPE_CLOSED: time the reader waited for data */
         } pipe_info;
         struct {
             int exit_code;          /* For EXITED: exit status */
+            timeline_usage_t usage; /* What the process used */
         } exit_info;
         struct {
             int signal;             /* For SIGNALED/STOPPED: signal number */
+            timeline_usage_t usage; /* For SIGNALED: what the process used */
         } signal_info;
         struct {
-            char *target;           /* For REDIRECTED: target file/fd */
             int direction;          /* 0=input, 1=output, 2=append */
+            char target[TIMELINE_TARGET_MAX];  /* For REDIRECTED: target file */
         } redirect_info;
     } data;
 } timeline_event_t;
 
+/*
+ * One slot of the shared ring.  A child takes a ticket from the ring's
+ * head, clears seq, fills in the event and then sets seq to the ticket + 1,
+ * so the shell can tell a finished event from one still being written (or
+ * from one that was overwritten after the ring wrapped around).
+ */
+typedef struct timeline_slot_s {
+    _Atomic uint64_t seq;           /* Ticket + 1 once the event is complete */
+    unsigned int gen;               /* Command the event belongs to */
+    int child;                      /* Child that wrote it (see timeline_fork_prepare) */
+    timeline_event_t event;
+} timeline_slot_t;
+
+/*
+ * Ring buffer in MAP_SHARED memory, so forked children can stamp their own
+ * events (when they really start, redirect and exec) without any syscall
+ * other than the vDSO clock_gettime().  Any number of children write to it
+ * at once with nothing but an atomic add; only the shell reads it.
+ */
+typedef struct timeline_ring_s {
+    _Atomic uint64_t head;          /* Next ticket to hand out */
+    _Atomic uint64_t tail;          /* Next ticket the shell will read */
+    _Atomic uint64_t dropped;       /* Events lost because the ring was full */
+    timeline_slot_t slots[TIMELINE_RING_SLOTS];
+} timeline_ring_t;
+
 /* Timeline context structure */
 typedef struct timeline_s {
-    struct timespec start_time;     /* Command start time */
-    timeline_event_t events[MAX_TIMELINE_EVENTS];
+    uint64_t start_ns;              /* Command (or session) start time */
+    timeline_event_t *events;       /* Events collected so far (grows as needed) */
     int event_count;
+    int event_size;                 /* Room in events */
     int enabled;                    /* Whether timeline tracking is enabled */
+    int session;                    /* Keep recording across commands (timeline on) */
+    unsigned int gen;               /* Counts commands, to spot stale ring events */
+    timeline_ring_t *ring;          /* Shared with forked children */
+    int child;                      /* In a forked child: its number, else 0 */
+    int nchildren;                  /* Children forked for this command */
+    pid_t *child_pids;              /* Their pids, by number */
+    int child_pids_size;
 } timeline_t;
 
 /* Global timeline context */
@@ -67,15 +131,42 @@ void timeline_enable(int enable);
 /* Check if timeline is enabled */
 int timeline_is_enabled(void);
 
+/* Check if a session-wide timeline is recording (timeline on) */
+int timeline_in_session(void);
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t timeline_now(void);
+
 /* Record events */
-void timeline_record_fork(pid_t pid);
+void timeline_record_fork(pid_t pid, uint64_t time_ns, const char *command);
 void timeline_record_execve(pid_t pid);
-void timeline_record_exit(pid_t pid, int exit_code);
-void timeline_record_signaled(pid_t pid, int signal);
+void timeline_record_exit(pid_t pid, int exit_code, const timeline_usage_t *usage);
+void timeline_record_signaled(pid_t pid, int signal, const timeline_usage_t *usage);
 void timeline_record_stopped(pid_t pid, int signal);
 void timeline_record_continued(pid_t pid);
 void timeline_record_pipe(pid_t from_pid, pid_t to_pid);
-void timeline_record_redirect(pid_t pid, const char *target, int direction);
+void timeline_record_pipe_closed(pid_t from_pid, pid_t to_pid, uint64_t time_ns,
+                                 uint64_t bytes, uint64_t full_ns, uint64_t empty_ns);
+void timeline_record_redirect(pid_t pid, const char *target, int direction, uint64_t time_ns);
+
+/*
+ * Forked children stamp their own events: the shell calls
+ * timeline_fork_prepare() before fork() and timeline_fork_parent() with the
+ * child's pid after it, and the child records with timeline_child_*().
+ */
+void timeline_fork_prepare(void);
+void timeline_fork_parent(pid_t pid);
+void timeline_child_fork(const char *command);
+void timeline_child_record(timeline_event_type_t type);
+void timeline_child_redirect(const char *target, int direction);
+
+/*
+ * Fill in a usage record: timeline_read_io() while the process is still a
+ * zombie (its /proc entry goes away when it's reaped), then
+ * timeline_set_rusage() with what wait4() returned.
+ */
+void timeline_read_io(pid_t pid, timeline_usage_t *usage);
+void timeline_set_rusage(timeline_usage_t *usage, const struct rusage *ru);
 
 /* Print the timeline in formatted output */
 void timeline_print(void);
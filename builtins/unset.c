@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include "../mshX.h"
+#include "../symtab/symtab.h"
+
+/*
+ * unset builtin command - remove variables
+ *
+ * Usage:
+ *   unset name...       - remove the variables (an exported one leaves the
+ *                         environment of the commands we run, too)
+ */
+int unset_builtin(int argc, char **argv)
+{
+    struct symtab_stack_s *stack = get_symtab_stack();
+    int res = 0;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(!is_valid_name(argv[i], -1))
+        {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", argv[i]);
+            res = 1;
+            continue;
+        }
+
+        /* remove the innermost definition, the one $name expands to */
+        for(int j = stack->symtab_count-1; j >= 0; j--)
+        {
+            struct symtab_s *symtab = stack->symtab_list[j];
+            struct symtab_entry_s *entry = do_lookup(argv[i], symtab);
+
+            if(entry)
+            {
+                rem_from_symtab(entry, symtab);
+                break;
+            }
+        }
+    }
+
+    return res;
+}
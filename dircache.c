@@ -0,0 +1,294 @@
+#define _GNU_SOURCE         /* getdents64() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dircache.h"
+
+/* The cached directories, hashed by (dev, ino); the table grows as they come */
+static struct dircache_dir_s **dir_table = NULL;
+static size_t table_size = 0;
+static size_t table_count = 0;
+
+/* Nesting depth of dircache_begin() */
+static int cache_depth = 0;
+
+/* Guards dir_table, as the glob threads look directories up at once */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static size_t dir_bucket(dev_t dev, ino_t ino, size_t size)
+{
+    return (size_t)((ino * 31) ^ dev) % size;
+}
+
+
+static void free_dir(struct dircache_dir_s *dir)
+{
+    free(dir->entries);
+    free(dir->names);
+    free(dir);
+}
+
+
+void dircache_begin(void)
+{
+    cache_depth++;
+}
+
+
+void dircache_end(void)
+{
+    if(cache_depth == 0 || --cache_depth > 0)
+    {
+        return;
+    }
+
+    for(size_t i = 0; i < table_size; i++)
+    {
+        struct dircache_dir_s *dir = dir_table[i];
+        while(dir)
+        {
+            struct dircache_dir_s *next = dir->next;
+            free_dir(dir);
+            dir = next;
+        }
+    }
+    free(dir_table);
+    dir_table = NULL;
+    table_size = table_count = 0;
+}
+
+
+/* find a cached directory that hasn't changed since it was read (with cache_lock held) */
+static struct dircache_dir_s *find_dir(struct stat *st)
+{
+    if(!dir_table)
+    {
+        return NULL;
+    }
+
+    struct dircache_dir_s *dir = dir_table[dir_bucket(st->st_dev, st->st_ino, table_size)];
+
+    for( ; dir; dir = dir->next)
+    {
+        if(dir->dev == st->st_dev && dir->ino == st->st_ino &&
+           dir->mtime.tv_sec == st->st_mtim.tv_sec &&
+           dir->mtime.tv_nsec == st->st_mtim.tv_nsec)
+        {
+            return dir;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * add a directory to the table (with cache_lock held), doubling the table
+ * when it averages two directories a bucket, as a recursive glob can read
+ * a great many. returns 0 if there's no table to add it to.
+ */
+static int insert_dir(struct dircache_dir_s *dir)
+{
+    if(!dir_table || table_count >= 2 * table_size)
+    {
+        size_t size = dir_table ? 2 * table_size : DIRCACHE_BUCKETS;
+        struct dircache_dir_s **table = calloc(size, sizeof(struct dircache_dir_s *));
+        if(!table)
+        {
+            if(!dir_table)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            for(size_t i = 0; i < table_size; i++)
+            {
+                struct dircache_dir_s *d = dir_table[i], *next;
+                for( ; d; d = next)
+                {
+                    size_t bucket = dir_bucket(d->dev, d->ino, size);
+                    next = d->next;
+                    d->next = table[bucket];
+                    table[bucket] = d;
+                }
+            }
+            free(dir_table);
+            dir_table = table;
+            table_size = size;
+        }
+    }
+
+    size_t bucket = dir_bucket(dir->dev, dir->ino, table_size);
+    dir->next = dir_table[bucket];
+    dir_table[bucket] = dir;
+    table_count++;
+    return 1;
+}
+
+
+/*
+ * read a directory with getdents64(), a big buffer at a time. the names go
+ * into one growing block, and the entries only get pointers into it at the
+ * end, once it has stopped moving.
+ */
+static struct dircache_dir_s *read_dir(int fd, struct stat *st)
+{
+    struct dircache_dir_s *dir = calloc(1, sizeof(struct dircache_dir_s));
+    size_t names_len = 0, names_size = 4096, entries_size = 64;
+    char *names = malloc(names_size);
+    struct dircache_entry_s *entries = malloc(entries_size * sizeof(struct dircache_entry_s));
+    char *buf = malloc(DIRCACHE_GETDENTS_BUF);
+    ssize_t nread;
+
+    if(!dir || !names || !entries || !buf || lseek(fd, 0, SEEK_SET) < 0)
+    {
+        goto fail;
+    }
+
+    while((nread = getdents64(fd, buf, DIRCACHE_GETDENTS_BUF)) > 0)
+    {
+        for(ssize_t off = 0; off < nread; )
+        {
+            struct dirent64 *ent = (struct dirent64 *)(buf + off);
+            char *name = ent->d_name;
+            off += ent->d_reclen;
+            if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+
+            size_t len = strlen(name) + 1;
+            if(names_len + len > names_size)
+            {
+                while(names_len + len > names_size)
+                {
+                    names_size *= 2;
+                }
+                char *names2 = realloc(names, names_size);
+                if(!names2)
+                {
+                    goto fail;
+                }
+                names = names2;
+            }
+            if(dir->count == entries_size)
+            {
+                struct dircache_entry_s *entries2 = realloc(entries, 2 * entries_size * sizeof(struct dircache_entry_s));
+                if(!entries2)
+                {
+                    goto fail;
+                }
+                entries = entries2;
+                entries_size *= 2;
+            }
+
+            memcpy(names + names_len, name, len);
+            entries[dir->count].name = (char *)names_len;    /* an offset, for now */
+            entries[dir->count].type = ent->d_type;
+            dir->count++;
+            names_len += len;
+        }
+    }
+    if(nread < 0)
+    {
+        goto fail;
+    }
+    free(buf);
+
+    for(size_t i = 0; i < dir->count; i++)
+    {
+        entries[i].name = names + (size_t)entries[i].name;
+    }
+    dir->entries = entries;
+    dir->names = names;
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    dir->mtime = st->st_mtim;
+    return dir;
+
+fail:
+    free(buf);
+    free(entries);
+    free(names);
+    free(dir);
+    return NULL;
+}
+
+
+struct dircache_dir_s *dircache_get(const char *path)
+{
+    struct stat st;
+    struct dircache_dir_s *dir;
+
+    if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    dir = find_dir(&st);
+    pthread_mutex_unlock(&cache_lock);
+    if(dir)
+    {
+        return dir;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    dir = dircache_get_fd(fd);
+    close(fd);
+    return dir;
+}
+
+
+struct dircache_dir_s *dircache_get_fd(int fd)
+{
+    struct stat st;
+    struct dircache_dir_s *dir;
+
+    /* key it by what we actually opened, in case it was swapped under a path */
+    if(fstat(fd, &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    dir = find_dir(&st);
+    pthread_mutex_unlock(&cache_lock);
+    if(dir)
+    {
+        return dir;
+    }
+
+    struct dircache_dir_s *new_dir = read_dir(fd, &st);
+    if(!new_dir)
+    {
+        return NULL;
+    }
+
+    /* another thread may have read it meanwhile: keep the first one */
+    pthread_mutex_lock(&cache_lock);
+    dir = find_dir(&st);
+    if(dir || !insert_dir(new_dir))
+    {
+        free_dir(new_dir);
+    }
+    else
+    {
+        dir = new_dir;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return dir;
+}
@@ -0,0 +1,55 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * The directory cache lets pathname expansion read each directory once per
+ * command: copying src's .c and .h files to dst with two patterns lists
+ * src once and matches both patterns against the cached entries.  Directories are keyed by (dev, ino,
+ * mtime), so the same directory reached by another path (src, ./src, a
+ * symlink) is shared, and one that changed since it was read is read
+ * again.  The cache lives from dircache_begin() to the matching
+ * dircache_end(); executor.c brackets the expansion of each command with
+ * them.  Lookups can come from several threads at once.
+ */
+
+/* Number of buckets the directory hash table starts with */
+#define DIRCACHE_BUCKETS    64
+
+/* Size of the buffer directories are read into with getdents64() */
+#define DIRCACHE_GETDENTS_BUF   (64 * 1024)
+
+/* One directory entry */
+struct dircache_entry_s
+{
+    char *name;
+    unsigned char type;         /* d_type: DT_DIR, DT_REG, DT_LNK, DT_UNKNOWN... */
+};
+
+/* A directory's entries (but . and ..), as read by dircache_get() */
+struct dircache_dir_s
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    size_t count;
+    struct dircache_entry_s *entries;
+    char *names;                /* the names, one block */
+    struct dircache_dir_s *next;    /* next directory in the same bucket */
+};
+
+/* Start (or nest) a cache scope */
+void dircache_begin(void);
+
+/* End a cache scope, the outermost one drops everything that was read */
+void dircache_end(void);
+
+/* Get the entries of a directory, NULL if it can't be read */
+struct dircache_dir_s *dircache_get(const char *path);
+
+/* The same for a directory that is open already (the fd stays open) */
+struct dircache_dir_s *dircache_get_fd(int fd);
+
+#endif
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "dirwalk.h"
+#include "dircache.h"
+#include "workpool.h"
+
+/* One thread's directories to list, and the paths it has found */
+struct walk_queue_s
+{
+    pthread_mutex_t lock;
+    char **dirs;                /* the owner takes from the tail, thieves from the head */
+    size_t head, tail, size;
+    char **found;               /* only the owner touches these */
+    size_t nfound, found_size;
+};
+
+/* A walk in progress */
+struct walk_s
+{
+    int flags;
+    int nqueues;
+    struct walk_queue_s *queues;
+    atomic_long pending;        /* directories queued or being listed */
+    atomic_int idle;            /* threads waiting for work */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;   /* work was queued, or the walk is over */
+};
+
+
+/* make dir followed by name, and a '/' if slash is set */
+static char *make_path(char *dir, size_t dirlen, char *name, int slash)
+{
+    size_t len = strlen(name);
+    char *path = malloc(dirlen + len + 2);
+    if(!path)
+    {
+        return NULL;
+    }
+    memcpy(path, dir, dirlen);
+    memcpy(path + dirlen, name, len);
+    if(slash)
+    {
+        path[dirlen + len++] = '/';
+    }
+    path[dirlen + len] = '\0';
+    return path;
+}
+
+
+static void add_found(struct walk_queue_s *q, char *path)
+{
+    if(!path)
+    {
+        return;
+    }
+    if(q->nfound == q->found_size)
+    {
+        size_t size = q->found_size ? q->found_size * 2 : DIRWALK_QUEUE_SIZE;
+        char **found = realloc(q->found, size * sizeof(char *));
+        if(!found)
+        {
+            free(path);
+            return;
+        }
+        q->found = found;
+        q->found_size = size;
+    }
+    q->found[q->nfound++] = path;
+}
+
+
+static int push_dir(struct walk_queue_s *q, char *dir)
+{
+    pthread_mutex_lock(&q->lock);
+    if(q->tail == q->size)
+    {
+        if(q->head > 0 && q->head >= q->size / 2)
+        {
+            /* thieves took the first half: slide the rest down */
+            memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(char *));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        else
+        {
+            size_t size = q->size ? q->size * 2 : DIRWALK_QUEUE_SIZE;
+            char **dirs = realloc(q->dirs, size * sizeof(char *));
+            if(!dirs)
+            {
+                pthread_mutex_unlock(&q->lock);
+                return 0;
+            }
+            q->dirs = dirs;
+            q->size = size;
+        }
+    }
+    q->dirs[q->tail++] = dir;
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+
+/* take a directory off the tail of our own queue, or the head of somebody else's */
+static char *take_dir(struct walk_s *walk, int i)
+{
+    for(int k = 0; k < walk->nqueues; k++)
+    {
+        struct walk_queue_s *q = &walk->queues[(i + k) % walk->nqueues];
+        char *dir = NULL;
+
+        pthread_mutex_lock(&q->lock);
+        if(q->head < q->tail)
+        {
+            dir = (k == 0) ? q->dirs[--q->tail] : q->dirs[q->head++];
+            if(q->head == q->tail)
+            {
+                q->head = q->tail = 0;
+            }
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if(dir)
+        {
+            return dir;
+        }
+    }
+    return NULL;
+}
+
+
+static int have_work(struct walk_s *walk)
+{
+    for(int i = 0; i < walk->nqueues; i++)
+    {
+        struct walk_queue_s *q = &walk->queues[i];
+        pthread_mutex_lock(&q->lock);
+        int res = (q->head < q->tail);
+        pthread_mutex_unlock(&q->lock);
+        if(res)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void wake_idle(struct walk_s *walk)
+{
+    /* pairs with the fence in walk_main(): either we see it idle or it sees our work */
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load(&walk->idle))
+    {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_broadcast(&walk->idle_cond);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+}
+
+
+/*
+ * list a directory for the i-th thread, queueing its subdirectories and
+ * noting the paths the walk wants. frees path.
+ */
+static void list_dir(struct walk_s *walk, int i, char *path)
+{
+    struct walk_queue_s *q = &walk->queues[i];
+    size_t len = strlen(path);
+    int want_files = !(walk->flags & DIRWALK_DIRS);
+    int fd = open(len ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct dircache_dir_s *dir = (fd >= 0) ? dircache_get_fd(fd) : NULL;
+    struct stat st;
+
+    for(size_t j = 0; dir && j < dir->count; j++)
+    {
+        struct dircache_entry_s *ent = &dir->entries[j];
+        if(ent->name[0] == '.')
+        {
+            continue;
+        }
+
+        unsigned char type = ent->type;
+        if(type == DT_UNKNOWN && fstatat(fd, ent->name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+        if(type != DT_DIR)
+        {
+            if(want_files)
+            {
+                add_found(q, make_path(path, len, ent->name, 0));
+            }
+            else if(type == DT_LNK && (walk->flags & DIRWALK_LINKS) &&
+                    fstatat(fd, ent->name, &st, 0) == 0 && S_ISDIR(st.st_mode))
+            {
+                add_found(q, make_path(path, len, ent->name, 1));
+            }
+            continue;
+        }
+
+        char *child = make_path(path, len, ent->name, 1);
+        if(!child)
+        {
+            continue;
+        }
+        add_found(q, want_files ? make_path(path, len, ent->name, 0) : strdup(child));
+
+        atomic_fetch_add(&walk->pending, 1);
+        if(!push_dir(q, child))
+        {
+            free(child);
+            atomic_fetch_sub(&walk->pending, 1);
+            continue;
+        }
+        wake_idle(walk);
+    }
+
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    free(path);
+}
+
+
+/* one of the walk's threads: list directories until there are none left anywhere */
+static void walk_main(void *arg, int i)
+{
+    struct walk_s *walk = arg;
+
+    for(;;)
+    {
+        char *dir = take_dir(walk, i);
+        if(dir)
+        {
+            list_dir(walk, i, dir);
+            if(atomic_fetch_sub(&walk->pending, 1) == 1)
+            {
+                /* that was the last one: let the idle threads go */
+                pthread_mutex_lock(&walk->idle_lock);
+                pthread_cond_broadcast(&walk->idle_cond);
+                pthread_mutex_unlock(&walk->idle_lock);
+            }
+            continue;
+        }
+
+        /* nothing to take: wait for another thread to queue some, or for the end */
+        pthread_mutex_lock(&walk->idle_lock);
+        atomic_fetch_add(&walk->idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while(atomic_load(&walk->pending) > 0 && !have_work(walk))
+        {
+            pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+        }
+        atomic_fetch_sub(&walk->idle, 1);
+        int done = (atomic_load(&walk->pending) == 0);
+        pthread_mutex_unlock(&walk->idle_lock);
+
+        if(done)
+        {
+            return;
+        }
+    }
+}
+
+
+char **dirwalk(char **bases, size_t nbases, int flags, size_t *count)
+{
+    struct walk_s walk;
+    char **res = NULL;
+    size_t total = 0;
+
+    *count = 0;
+    walk.flags = flags;
+    walk.nqueues = workpool_threads() + 1;
+    walk.queues = calloc(walk.nqueues, sizeof(struct walk_queue_s));
+    if(!walk.queues)
+    {
+        return NULL;
+    }
+    atomic_init(&walk.pending, 0);
+    atomic_init(&walk.idle, 0);
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.idle_cond, NULL);
+    for(int i = 0; i < walk.nqueues; i++)
+    {
+        pthread_mutex_init(&walk.queues[i].lock, NULL);
+    }
+
+    /* deal the starting directories out between the queues */
+    for(size_t i = 0; i < nbases; i++)
+    {
+        struct walk_queue_s *q = &walk.queues[i % walk.nqueues];
+        char *base = strdup(bases[i]);
+        if(!base)
+        {
+            continue;
+        }
+        if(flags & DIRWALK_BASES)
+        {
+            add_found(&walk.queues[0], strdup(base));
+        }
+        if(!push_dir(q, base))
+        {
+            free(base);
+            continue;
+        }
+        atomic_fetch_add(&walk.pending, 1);
+    }
+
+    workpool_for(walk.nqueues, walk_main, &walk);
+
+    for(int i = 0; i < walk.nqueues; i++)
+    {
+        total += walk.queues[i].nfound;
+    }
+    if(total)
+    {
+        res = malloc((total + 1) * sizeof(char *));
+    }
+
+    for(int i = 0; i < walk.nqueues; i++)
+    {
+        struct walk_queue_s *q = &walk.queues[i];
+        for(size_t j = 0; j < q->nfound; j++)
+        {
+            if(res)
+            {
+                res[(*count)++] = q->found[j];
+            }
+            else
+            {
+                free(q->found[j]);
+            }
+        }
+        free(q->found);
+        free(q->dirs);
+        pthread_mutex_destroy(&q->lock);
+    }
+    if(res)
+    {
+        res[*count] = NULL;
+    }
+
+    free(walk.queues);
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.idle_cond);
+    return res;
+}
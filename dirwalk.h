@@ -0,0 +1,33 @@
+#ifndef DIRWALK_H
+#define DIRWALK_H
+
+#include <stddef.h>
+
+/*
+ * The directory walker behind the ** of a recursive glob (with $GLOBSTAR
+ * set): it lists the whole tree below one or more directories, sharing the
+ * directories out between the work pool's threads.  Each thread has a
+ * queue of directories to list, puts the subdirectories it finds on its own
+ * queue and, when that runs dry, steals from the others.  As in bash, names
+ * starting with a dot are skipped and symlinks aren't followed.  The
+ * directories are read through the directory cache, so the rest of the
+ * pattern (the *.log after the **) finds them there.
+ */
+
+/* What dirwalk() returns */
+#define DIRWALK_DIRS        1   /* only directories, with a trailing '/' (else everything, no '/') */
+#define DIRWALK_BASES       2   /* and the directories the walk started from */
+#define DIRWALK_LINKS       4   /* with DIRWALK_DIRS, symlinks to directories too (not walked) */
+
+/* Number of directories a thread's queue starts with room for */
+#define DIRWALK_QUEUE_SIZE  64
+
+/*
+ * Walk the trees below bases (each "" for . or ending in '/').  Returns a
+ * NULL-terminated, unsorted list of malloc'd paths, each starting with the
+ * base it was found under, or NULL if nothing was found.  The number of
+ * paths is stored in *count.
+ */
+char **dirwalk(char **bases, size_t nbases, int flags, size_t *count);
+
+#endif
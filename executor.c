@@ -1,17 +1,25 @@
+#define _GNU_SOURCE         /* posix_spawn_file_actions_addtcsetpgrp_np() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
-#include <glob.h>
 #include <signal.h>
+#include <spawn.h>
 #include "mshX.h"
-#include "node.h"
 #include "executor.h"
+#include "arena.h"
+#include "relay.h"
+#include "dircache.h"
 #include "builtins/timeline.h"
+#include "builtins/hash.h"
+#include "builtins/jobs.h"
+#include "symtab/symtab.h"
 
 /* extern declaration for exit status (defined in wordexp.c) */
 extern int exit_status;
@@ -22,15 +30,23 @@ static void reset_signals_for_child(void)
     signal(SIGINT, SIG_DFL);
     signal(SIGTSTP, SIG_DFL);
     signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    jobs_unblock_sigchld();
 }
 
+/*
+ * Capacity given to the pipes we make (see set_pipe_size()), 0 for the
+ * kernel's default.  pipe_size_warned stops us complaining about every
+ * pipe when the kernel won't have it.
+ */
+static int pipe_size = 0;
+static int pipe_size_warned = 0;
+
 /* Current execution mode - defaults to real execution */
 enum exec_mode current_exec_mode = EXEC_REAL;
 
-/* Redirection types */
-#define REDIRECT_INPUT    0   /* < */
-#define REDIRECT_OUTPUT   1   /* > */
-#define REDIRECT_APPEND   2   /* >> */
+/* Exec the next external command in place of the shell (see executor.h) */
+int exec_last_command = 0;
 
 /* Redirection structure */
 struct redirect_s
@@ -42,25 +58,8 @@ struct redirect_s
 
 // Forward declarations
 struct word_s *word_expand(char *str);
-void free_all_words(struct word_s *words);
-int check_buffer_bounds(int *argc, int *targc, char ***argv);
 int has_glob_chars(char *str, size_t len);
-char **get_filename_matches(char *pattern, glob_t *matches);
-
-/* Free redirection list */
-static void free_redirects(struct redirect_s *redirects)
-{
-    while(redirects)
-    {
-        struct redirect_s *next = redirects->next;
-        if(redirects->filename)
-        {
-            free(redirects->filename);
-        }
-        free(redirects);
-        redirects = next;
-    }
-}
+static char *search_path_again(char *file);
 
 /*
  * Dry-run print functions
@@ -185,9 +184,225 @@ static int apply_redirects(struct redirect_s *redirects)
     return 0;
 }
 
-char *search_path(char *file)
+/*
+ * Launch an external command with posix_spawn() instead of fork()+exec().
+ *
+ * glibc implements posix_spawn() with clone(CLONE_VM|CLONE_VFORK), so the
+ * shell's address space is never copied and the cost of starting a command
+ * doesn't grow with the shell's memory footprint.  Redirection targets are
+ * opened here in the parent (so errors are reported the same way as in the
+ * forked path) and handed to the child as dup2 file actions.
+ *
+ * fd_in/fd_out are pipe ends to connect to stdin/stdout (-1 for none); the
+ * pipe fds are close-on-exec, so the child inherits no others.  pgid is the
+ * process group the child joins (0 for a new one, -1 to stay in the shell's)
+ * and tty_fd, if not -1, the terminal it takes over as a foreground job.
+ *
+ * returns the child's pid, 0 if a redirection target couldn't be opened (the
+ * error has already been reported), or -1 if the command couldn't be executed
+ * (with errno set).
+ */
+static pid_t spawn_command(char *path, char **argv, struct redirect_s *redirects,
+                           int fd_in, int fd_out, pid_t pgid, int tty_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault, sigmask;
+    int nredirects = 0;
+    int nredirect_fds = 0;
+    pid_t pid = 0;
+    int res;
+
+    for(struct redirect_s *r = redirects; r; r = r->next)
+    {
+        nredirects++;
+    }
+    int *redirect_fds = arena_alloc((nredirects + 1) * sizeof(int));
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    /* Reset the signals the shell handles, like reset_signals_for_child() */
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGINT);
+    sigaddset(&sigdefault, SIGTSTP);
+    sigaddset(&sigdefault, SIGTTOU);
+    sigaddset(&sigdefault, SIGTTIN);
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if(pgid >= 0)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    /*
+     * Take the terminal in the child before exec (signals are still blocked
+     * there, so there's no SIGTTOU), before fd 0 is redirected.  Elsewhere
+     * job_wait() hands it over from the parent side alone.
+     */
+    if(tty_fd >= 0)
+    {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, tty_fd);
+    }
+#else
+    (void)tty_fd;
+#endif
+
+    /* Connect the pipeline ends first, redirections override them */
+    if(fd_in >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO);
+    }
+    if(fd_out >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO);
+    }
+
+    for(struct redirect_s *r = redirects; r; r = r->next)
+    {
+        int fd, target;
+        switch(r->type)
+        {
+            case REDIRECT_INPUT:
+                fd = open(r->filename, O_RDONLY | O_CLOEXEC);
+                target = STDIN_FILENO;
+                break;
+
+            case REDIRECT_OUTPUT:
+                fd = open(r->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                target = STDOUT_FILENO;
+                break;
+
+            default:
+                fd = open(r->filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                target = STDOUT_FILENO;
+                break;
+        }
+        if(fd < 0)
+        {
+            fprintf(stderr, "error: cannot open %s: %s\n",
+                    r->filename, strerror(errno));
+            goto fin;
+        }
+        redirect_fds[nredirect_fds++] = fd;
+        posix_spawn_file_actions_adddup2(&actions, fd, target);
+    }
+
+    uint64_t spawn_ns = timeline_is_enabled() ? timeline_now() : 0;
+    res = posix_spawn(&pid, path, &actions, &attr, argv, get_envp());
+    if(res == ENOENT && !strchr(argv[0], '/'))
+    {
+        /* the remembered path went stale, search $PATH once more */
+        char *new_path = search_path_again(argv[0]);
+        if(new_path)
+        {
+            res = posix_spawn(&pid, new_path, &actions, &attr, argv, get_envp());
+            free(new_path);
+        }
+    }
+    if(res != 0)
+    {
+        errno = res;
+        pid = -1;
+    }
+    else if(timeline_is_enabled())
+    {
+        /*
+         * the child runs none of our code, but posix_spawn() only returns
+         * once it has exec'd: it started (and redirected) after spawn_ns,
+         * and exec'd by now.
+         */
+        timeline_record_fork(pid, spawn_ns, argv[0]);
+        for(struct redirect_s *r = redirects; r; r = r->next)
+        {
+            timeline_record_redirect(pid, r->filename, r->type, spawn_ns);
+        }
+        timeline_record_execve(pid);
+    }
+
+fin:
+    res = errno;
+    while(nredirect_fds--)
+    {
+        close(redirect_fds[nredirect_fds]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    errno = res;
+    return pid;
+}
+
+/*
+ * take a new $PIPESIZE: a byte count with an optional k or m suffix, like
+ * 1m.  NULL, "" or 0 go back to the kernel's default (64K on Linux).
+ */
+void set_pipe_size(const char *val)
 {
-    char *PATH = getenv("PATH");
+    pipe_size = 0;
+    pipe_size_warned = 0;
+    if(!val || !*val)
+    {
+        return;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long size = strtoul(val, &end, 10);
+    unsigned long unit = 1;
+    switch(*end)
+    {
+        case 'k': case 'K': unit = 1024UL; end++; break;
+        case 'm': case 'M': unit = 1024UL * 1024UL; end++; break;
+    }
+    /* check the count against the unit first, so the product can't wrap */
+    if(errno || *end || end == val || size > INT_MAX / unit)
+    {
+        fprintf(stderr, "warning: invalid PIPESIZE: %s (using the default)\n", val);
+        return;
+    }
+    pipe_size = (int)(size * unit);
+}
+
+/*
+ * make a pipe (flags are pipe2()'s, like O_CLOEXEC) with the capacity
+ * $PIPESIZE asks for. the kernel rounds it
+ * up to a power of 2 pages, and an unprivileged user can't go past
+ * /proc/sys/fs/pipe-max-size: then we say so (once) and go on with the
+ * pipe as it is.
+ */
+int make_pipe(int fds[2], int flags)
+{
+    if(pipe2(fds, flags) < 0)
+    {
+        return -1;
+    }
+
+#ifdef F_SETPIPE_SZ
+    if(pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) < 0 && !pipe_size_warned)
+    {
+        fprintf(stderr, "warning: cannot set the pipe size to %d: %s\n",
+                pipe_size, strerror(errno));
+        pipe_size_warned = 1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * search the directories in $PATH for the given file.
+ *
+ * returns the malloc'd full path of the file, or NULL if it is not found.
+ */
+static char *search_path_dirs(char *file)
+{
+    struct symtab_entry_s *entry = get_symtab_entry("PATH");
+    char *PATH = entry ? entry->val : getenv("PATH");
     char *p = PATH;
     char *p2;
 
@@ -256,11 +471,45 @@ char *search_path(char *file)
     return NULL;
 }
 
+/*
+ * find the full path of a command, consulting the command hash table first
+ * so that repeated commands don't stat() every $PATH directory again.
+ *
+ * returns the malloc'd full path, or NULL if the command is not found.
+ */
+char *search_path(char *file)
+{
+    char *path = hash_lookup(file);
+    if (path)
+    {
+        return strdup(path);
+    }
+
+    path = search_path_dirs(file);
+    if (path)
+    {
+        hash_add(file, path);
+    }
+    return path;
+}
+
+/*
+ * forget the remembered path of a command that wasn't there any more, and
+ * search $PATH for it again, remembering what we find.
+ *
+ * returns the malloc'd full path, or NULL if the command is not found.
+ */
+static char *search_path_again(char *file)
+{
+    hash_remove(file);
+    return search_path(file);
+}
+
 int do_exec_cmd(int argc __attribute__((unused)), char **argv)
 {
     if (strchr(argv[0], '/'))
     {
-        execv(argv[0], argv);
+        execve(argv[0], argv, get_envp());
     }
     else
     {
@@ -269,206 +518,321 @@ int do_exec_cmd(int argc __attribute__((unused)), char **argv)
         {
             return 0;
         }
-        execv(path, argv);
+        execve(path, argv, get_envp());
         free(path);
+
+        /* the remembered path went stale, search $PATH once more */
+        if (errno == ENOENT && (path = search_path_again(argv[0])))
+        {
+            execve(path, argv, get_envp());
+            free(path);
+        }
     }
     return 0;
 }
 
-static inline void free_argv(int argc, char **argv)
+/*
+ * return the index of the named builtin utility in builtins[], or -1.
+ */
+static int find_builtin(char *name)
 {
-    if (!argc || !argv)
+    for(int i = 0; i < builtins_count; i++)
     {
-        return;
+        if(strcmp(name, builtins[i].name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * run builtins[b] inside the shell, with its stdin/stdout moved to the given
+ * fds (-1 to leave one alone) and its redirections applied on top, and put
+ * the shell's own stdin/stdout back afterwards.
+ *
+ * returns the builtin's exit status.
+ */
+static int run_builtin(int b, int argc, char **argv, struct redirect_s *redirects,
+                       int fd_in, int fd_out)
+{
+    struct sigaction sa, old_sa;
+    int status;
+
+    if(fd_in < 0 && fd_out < 0 && !redirects)
+    {
+        return builtins[b].func(argc, argv);
     }
 
-    while (argc--)
+    /* what we printed so far goes to our own stdout */
+    fflush(stdout);
+    int saved_stdin = dup(STDIN_FILENO);
+    int saved_stdout = dup(STDOUT_FILENO);
+
+    if(fd_in >= 0)
     {
-        free(argv[argc]);
+        dup2(fd_in, STDIN_FILENO);
     }
-    
-    free(argv);
+    if(fd_out >= 0)
+    {
+        /* a reader that quits early gets us EPIPE, not a dead shell */
+        dup2(fd_out, STDOUT_FILENO);
+        sa.sa_handler = SIG_IGN;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sigaction(SIGPIPE, &sa, &old_sa);
+    }
+
+    if(apply_redirects(redirects) == 0)
+    {
+        status = builtins[b].func(argc, argv);
+    }
+    else
+    {
+        status = 1;
+    }
+
+    fflush(stdout);
+    clearerr(stdout);
+    if(fd_out >= 0)
+    {
+        sigaction(SIGPIPE, &old_sa, NULL);
+    }
+
+    dup2(saved_stdin, STDIN_FILENO);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdin);
+    close(saved_stdout);
+    return status;
 }
 
-int do_simple_command(struct node_s *node)
+/*
+ * expand one word of a compiled command. literal words (those needing no
+ * expansion at all) skip word_expand() altogether.
+ *
+ * returns the list of fields, or NULL if the word expanded to nothing.
+ */
+static struct word_s *expand_plan_word(struct plan_word_s *word)
 {
-    if (!node)
+    if(!word->flags)
     {
-        return 0;
+        return make_word(word->text);
     }
+    return word_expand(word->text);
+}
 
-    struct node_s *child = node->first_child;
-    if (!child)
+/*
+ * expand the redirection targets of a compiled command.
+ *
+ * returns the list of redirections, in the order they were given.
+ */
+static struct redirect_s *expand_redirects(struct plan_cmd_s *cmd)
+{
+    struct redirect_s *redirects = NULL;
+    struct redirect_s *last_redir = NULL;
+    
+    for(int i = 0; i < cmd->nredirects; i++)
     {
-        return 0;
+        struct word_s *fw = expand_plan_word(&cmd->redirects[i].target);
+        if(fw && fw->data)
+        {
+            struct redirect_s *redir = arena_alloc(sizeof(struct redirect_s));
+            redir->type = cmd->redirects[i].type;
+            redir->filename = fw->data;
+            redir->next = NULL;
+            if(last_redir)
+                last_redir->next = redir;
+            else
+                redirects = redir;
+            last_redir = redir;
+        }
     }
+    
+    return redirects;
+}
 
+/*
+ * build a NULL-terminated argv array pointing at the text of a list of
+ * expanded fields.
+ *
+ * returns the array (alloc'd in the command arena) and stores the number of
+ * arguments in *pargc.
+ */
+static char **make_argv(struct word_s *words, int *pargc)
+{
     int argc = 0;
-    int targc = 0;
-    char **argv = NULL;
-    char *str;
-    struct redirect_s *redirects = NULL;
-    struct redirect_s *last_redirect = NULL;
-    int expect_filename = 0;
-    int redirect_type = 0;
+    struct word_s *w;
 
-    /* For dry-run mode: track glob patterns */
-    char *glob_patterns[64];
-    char *glob_expansions[64];
-    int glob_count = 0;
+    for(w = words; w; w = w->next)
+    {
+        argc++;
+    }
 
-    while(child)
+    char **argv = arena_alloc((argc+1) * sizeof(char *));
+    argc = 0;
+    for(w = words; w; w = w->next)
     {
-        str = child->val.str;
-        
-        /* Check for redirection operators */
-        if(strcmp(str, ">") == 0)
+        argv[argc++] = w->data;
+    }
+    argv[argc] = NULL;
+
+    *pargc = argc;
+    return argv;
+}
+
+/*
+ * build the text shown for a job in job messages, like "ls -l | wc -l",
+ * from the words of its commands as they were typed.
+ *
+ * returns the text, alloc'd in the command arena.
+ */
+static char *job_text(struct plan_cmd_s *cmds, int n)
+{
+    size_t len = 1;
+
+    for(int i = 0; i < n; i++)
+    {
+        for(int j = 0; j < cmds[i].nwords; j++)
         {
-            expect_filename = 1;
-            redirect_type = REDIRECT_OUTPUT;
-            child = child->next_sibling;
-            continue;
+            len += strlen(cmds[i].words[j].text)+1;
         }
-        else if(strcmp(str, ">>") == 0)
+        len += 2;
+    }
+
+    char *text = arena_alloc(len);
+    char *p = text;
+    for(int i = 0; i < n; i++)
+    {
+        if(i > 0)
         {
-            expect_filename = 1;
-            redirect_type = REDIRECT_APPEND;
-            child = child->next_sibling;
-            continue;
+            p = stpcpy(p, "| ");
         }
-        else if(strcmp(str, "<") == 0)
+        for(int j = 0; j < cmds[i].nwords; j++)
         {
-            expect_filename = 1;
-            redirect_type = REDIRECT_INPUT;
-            child = child->next_sibling;
-            continue;
+            p = stpcpy(p, cmds[i].words[j].text);
+            *p++ = ' ';
         }
-        
-        /* If we're expecting a filename for redirection */
-        if(expect_filename)
+    }
+    /* drop the last space */
+    if(p > text)
+    {
+        p--;
+    }
+    *p = '\0';
+
+    return text;
+}
+
+/*
+ * expand the words of a compiled command into a NULL-terminated argv array
+ * and collect its redirections.
+ *
+ * returns the number of arguments (0 if the command expanded to nothing).
+ */
+static int expand_command(struct plan_cmd_s *cmd, char ***pargv, struct redirect_s **predirects)
+{
+    struct word_s *words = NULL, *last = NULL;
+    int argc;
+    
+    /* the command's words and redirections share one directory cache */
+    dircache_begin();
+    for(int i = 0; i < cmd->nwords; i++)
+    {
+        struct word_s *w = expand_plan_word(&cmd->words[i]);
+        if(!w)
         {
-            struct word_s *w = word_expand(str);
-            if(w && w->data)
-            {
-                struct redirect_s *redir = malloc(sizeof(struct redirect_s));
-                if(redir)
-                {
-                    redir->type = redirect_type;
-                    redir->filename = malloc(strlen(w->data) + 1);
-                    if(redir->filename)
-                    {
-                        strcpy(redir->filename, w->data);
-                    }
-                    redir->next = NULL;
-                    
-                    if(last_redirect)
-                    {
-                        last_redirect->next = redir;
-                    }
-                    else
-                    {
-                        redirects = redir;
-                    }
-                    last_redirect = redir;
-                }
-                free_all_words(w);
-            }
-            expect_filename = 0;
-            child = child->next_sibling;
             continue;
         }
-        
-        /* For dry-run mode: check for glob patterns before expansion */
-        int is_glob = 0;
-        char *pattern_copy = NULL;
-        if(current_exec_mode == EXEC_DRY && has_glob_chars(str, strlen(str)))
+        if(last)
+            last->next = w;
+        else
+            words = w;
+        for(last = w; last->next; last = last->next)
         {
-            is_glob = 1;
-            pattern_copy = strdup(str);
+            ;
         }
+    }
+    
+    *pargv = make_argv(words, &argc);
+    *predirects = expand_redirects(cmd);
+    dircache_end();
+    return argc;
+}
+
+int do_simple_command(struct plan_cmd_s *cmd)
+{
+    if (!cmd || cmd->nwords == 0)
+    {
+        return 0;
+    }
+
+    int argc = 0;
+    char **argv;
+    char *str;
+    struct word_s *words = NULL, *last = NULL;
+    dircache_begin();
+    struct redirect_s *redirects = expand_redirects(cmd);
+
+    /* For dry-run mode: track glob patterns */
+    char *glob_patterns[64];
+    char *glob_expansions[64];
+    int glob_count = 0;
+
+    for(int i = 0; i < cmd->nwords; i++)
+    {
+        str = cmd->words[i].text;
         
-        struct word_s *w = word_expand(str);
+        struct word_s *w = expand_plan_word(&cmd->words[i]);
         
         if(!w)
         {
-            if(pattern_copy) free(pattern_copy);
-            child = child->next_sibling;
             continue;
         }
 
         /* For dry-run mode: track glob expansion */
-        if(current_exec_mode == EXEC_DRY && is_glob && glob_count < 64)
+        if(current_exec_mode == EXEC_DRY && (cmd->words[i].flags & WORD_GLOB) &&
+           glob_count < 64)
         {
             /* Count expanded words */
-            int word_count = 0;
             struct word_s *wc = w;
             size_t total_len = 0;
             while(wc)
             {
-                word_count++;
                 total_len += strlen(wc->data) + 1;
                 wc = wc->next;
             }
             
             /* Build expansion string */
-            char *expansion = malloc(total_len + 1);
-            if(expansion)
+            char *expansion = arena_alloc(total_len + 1);
+            expansion[0] = '\0';
+            wc = w;
+            while(wc)
             {
-                expansion[0] = '\0';
-                wc = w;
-                while(wc)
-                {
-                    if(expansion[0]) strcat(expansion, " ");
-                    strcat(expansion, wc->data);
-                    wc = wc->next;
-                }
-                glob_patterns[glob_count] = pattern_copy;
-                glob_expansions[glob_count] = expansion;
-                glob_count++;
-                pattern_copy = NULL; /* Don't free, it's stored */
+                if(expansion[0]) strcat(expansion, " ");
+                strcat(expansion, wc->data);
+                wc = wc->next;
             }
+            glob_patterns[glob_count] = str;
+            glob_expansions[glob_count] = expansion;
+            glob_count++;
         }
-        if(pattern_copy) free(pattern_copy);
 
-        struct word_s *w2 = w;
-        while(w2)
+        if(last)
+            last->next = w;
+        else
+            words = w;
+        for(last = w; last->next; last = last->next)
         {
-            if(check_buffer_bounds(&argc, &targc, &argv))
-            {
-                str = malloc(strlen(w2->data)+1);
-                if(str)
-                {
-                    strcpy(str, w2->data);
-                    argv[argc++] = str;
-                }
-            }
-            w2 = w2->next;
+            ;
         }
-        
-        free_all_words(w);
-        
-        child = child->next_sibling;
     }
+    dircache_end();
 
-    if(check_buffer_bounds(&argc, &targc, &argv))
-    {
-        argv[argc] = NULL;
-    }
+    argv = make_argv(words, &argc);
     
     // Check if we have any arguments after expansion
-    if(argc == 0 || !argv || !argv[0])
+    if(argc == 0)
     {
-        if(argv)
-        {
-            free_argv(argc, argv);
-        }
-        free_redirects(redirects);
-        /* Free glob tracking data */
-        for(int g = 0; g < glob_count; g++)
-        {
-            free(glob_patterns[g]);
-            free(glob_expansions[g]);
-        }
         return 0;
     }
     
@@ -479,8 +843,6 @@ int do_simple_command(struct node_s *node)
         for(int g = 0; g < glob_count; g++)
         {
             printf("GLOB: %s -> %s\n", glob_patterns[g], glob_expansions[g]);
-            free(glob_patterns[g]);
-            free(glob_expansions[g]);
         }
         
         /* Print EXEC line */
@@ -508,8 +870,6 @@ int do_simple_command(struct node_s *node)
             r = r->next;
         }
         
-        free_argv(argc, argv);
-        free_redirects(redirects);
         return 1;
     }
     
@@ -519,44 +879,79 @@ int do_simple_command(struct node_s *node)
     {
         if (strcmp(argv[0], builtins[i].name) == 0)
         {
-            /* For builtins with redirection, we need to handle it specially */
-            if(redirects)
-            {
-                /* Save original file descriptors */
-                int saved_stdin = dup(STDIN_FILENO);
-                int saved_stdout = dup(STDOUT_FILENO);
-                
-                if(apply_redirects(redirects) == 0)
-                {
-                    exit_status = builtins[i].func(argc, argv);
-                }
-                else
-                {
-                    exit_status = 1;
-                }
-                
-                /* Restore original file descriptors */
-                dup2(saved_stdin, STDIN_FILENO);
-                dup2(saved_stdout, STDOUT_FILENO);
-                close(saved_stdin);
-                close(saved_stdout);
-            }
-            else
-            {
-                exit_status = builtins[i].func(argc, argv);
-            }
-            free_argv(argc, argv);
-            free_redirects(redirects);
+            exit_status = run_builtin(i, argc, argv, redirects, -1, -1);
             return 1;
         }
     }
-    /* Initialize timeline for this command */
-    timeline_init();
-    
+    /* Find the command in the shell so the lookup is remembered */
+    char *path = strchr(argv[0], '/') ? strdup(argv[0]) : search_path(argv[0]);
+
+    /*
+     * A subshell has nothing left to do after its last command, so it
+     * becomes that command rather than spawning it and waiting.
+     */
+    if(exec_last_command && path)
+    {
+        fflush(stdout);
+        reset_signals_for_child();
+        if(apply_redirects(redirects) < 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        execve(path, argv, get_envp());
+        if(errno == ENOENT && !strchr(argv[0], '/') && (path = search_path_again(argv[0])))
+        {
+            execve(path, argv, get_envp());
+        }
+        fprintf(stderr, "error: failed to execute command: %s\n", strerror(errno));
+        _exit((errno == ENOENT) ? 127 : 126);
+    }
+
+    /* Initialize timeline for this command */
+    timeline_init();
+    
+    /* The job exists first, so the child knows which process group to join */
+    job_t *job = job_new(job_text(cmd, 1), 0);
     pid_t child_pid = 0;
-    if ((child_pid = fork()) == 0)  
+    if (path)
     {
-        /* Reset signals to default in child process so it can receive SIGINT/SIGTSTP */
+        /* Fast path: spawn the command without copying the shell */
+        child_pid = spawn_command(path, argv, redirects, -1, -1,
+                                  job_pgid(job), job_tty(job));
+        free(path);
+        if (child_pid <= 0)
+        {
+            if (child_pid < 0)
+            {
+                fprintf(stderr, "error: failed to execute command: %s\n", strerror(errno));
+                exit_status = (errno == ENOENT) ? 127 : 126;
+            }
+            else
+            {
+                exit_status = 1;
+            }
+            job_free(job);
+            timeline_reset();
+            return 1;
+        }
+    }
+    else
+    {
+        /* Flush our output, so the child doesn't write it out again */
+        fflush(stdout);
+        
+        /* The child stamps its own events in the timeline */
+        timeline_fork_prepare();
+        child_pid = fork();
+        timeline_fork_parent(child_pid);
+    }
+    
+    if (child_pid == 0)
+    {
+        timeline_child_fork(argv[0]);
+        
+        /* Join the job's process group, then reset signals to default */
+        job_child_setup(job);
         reset_signals_for_child();
         
         /* Apply redirections in child process */
@@ -564,9 +959,12 @@ int do_simple_command(struct node_s *node)
         {
             exit(EXIT_FAILURE);
         }
+        for(struct redirect_s *r = redirects; r; r = r->next)
+        {
+            timeline_child_redirect(r->filename, r->type);
+        }
         
-        /* Note: execve event is recorded by parent after fork returns */
-        
+        timeline_child_record(EVENT_EXECVE);
         do_exec_cmd(argc, argv);
         fprintf(stderr, "error: failed to execute command: %s\n", strerror(errno));
         if (errno == ENOEXEC)
@@ -585,677 +983,497 @@ int do_simple_command(struct node_s *node)
     else if (child_pid < 0)
     {
         fprintf(stderr, "error: failed to fork command: %s\n", strerror(errno));
-        free_argv(argc, argv);
-        free_redirects(redirects);
+        job_free(job);
         return 0;
     }
     
-    /* Record fork and execve events in timeline */
-    timeline_record_fork(child_pid);
-    
-    /* Record redirections in timeline with the child's PID */
-    if(timeline_is_enabled() && redirects)
+    /*
+     * wait for the child (or for ^Z to stop it). the reaper records its exit
+     * in the timeline when it happens, and keeps a stopped job in the job
+     * table.
+     */
+    job_proc_t *proc = job ? job_add_process(job, child_pid) : NULL;
+    if(proc)
     {
-        struct redirect_s *r = redirects;
-        while(r)
+        int stopped = job_wait(job);
+        exit_status = proc->status;
+        if(!stopped)
         {
-            timeline_record_redirect(child_pid, r->filename, r->type);
-            r = r->next;
+            job_free(job);
         }
     }
-    
-    timeline_record_execve(child_pid);
-
-    int status = 0;
-    /* Use WUNTRACED to detect stopped processes (Ctrl+Z) */
-    waitpid(child_pid, &status, WUNTRACED);
-    
-    /* Set the exit status for $? and record timeline events */
-    if(WIFEXITED(status))
-    {
-        exit_status = WEXITSTATUS(status);
-        timeline_record_exit(child_pid, WEXITSTATUS(status));
-    }
-    else if(WIFSIGNALED(status))
-    {
-        exit_status = 128 + WTERMSIG(status);
-        timeline_record_signaled(child_pid, WTERMSIG(status));
-    }
-    else if(WIFSTOPPED(status))
+    else
     {
-        /* Process was stopped (Ctrl+Z) */
-        exit_status = 128 + WSTOPSIG(status);
-        timeline_record_stopped(child_pid, WSTOPSIG(status));
-        fprintf(stderr, "\n[%d]+ Stopped\n", child_pid);
+        int status = 0;
+        job_free(job);
+        waitpid(child_pid, &status, 0);
+        exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
     }
     
     /* Print the execution timeline */
     timeline_print();
     timeline_reset();
-    
-    free_argv(argc, argv);
-    free_redirects(redirects);
 
     return 1;
 }
 
 /*
- * Helper function to get the first command word from a node (for dry-run PIPE output)
+ * Helper function to get the first command word of a command (for dry-run PIPE output)
  */
-static char *get_first_command_word(struct node_s *node)
+static char *get_first_command_word(struct plan_cmd_s *cmd)
 {
-    if(!node || !node->first_child)
+    if(!cmd || cmd->nwords == 0)
     {
         return NULL;
     }
     
-    struct node_s *child = node->first_child;
-    while(child)
+    return cmd->words[0].text;
+}
+
+/*
+ * Close up to three fds, skipping the ones that are -1.
+ */
+static void close_fds(int fd1, int fd2, int fd3)
+{
+    int fds[3] = { fd1, fd2, fd3 };
+    
+    for(int i = 0; i < 3; i++)
     {
-        char *str = child->val.str;
-        /* Skip redirection operators and their targets */
-        if(strcmp(str, ">") == 0 || strcmp(str, ">>") == 0 || strcmp(str, "<") == 0)
+        if(fds[i] >= 0)
         {
-            child = child->next_sibling;
-            if(child) child = child->next_sibling;
-            continue;
+            close(fds[i]);
         }
-        return str;
     }
-    return NULL;
 }
 
 /*
- * Execute a pipeline of commands.
- * commands: array of node_s pointers (each is a simple command)
- * num_commands: number of commands in the pipeline
+ * Start the stages of a pipeline as one job, each a direct child of the
+ * shell, and wait for it unless it's a background job.  Either way a
+ * pipeline of n commands costs n spawns (or forks).
  */
-int do_pipeline(struct node_s **commands, int num_commands)
+static int run_pipeline(struct plan_cmd_s *commands, int num_commands, int background)
 {
-    if(num_commands == 0 || !commands)
-    {
-        return 0;
-    }
+    /*
+     * Expand every stage here in the shell, so the stages that run external
+     * commands can be spawned without forking.  The per-stage arrays come
+     * from the command arena, so a pipeline can be as long as it likes.
+     */
+    int *argcs = arena_alloc(num_commands * sizeof(int));
+    char ***argvs = arena_alloc(num_commands * sizeof(char **));
+    struct redirect_s **redirs = arena_alloc(num_commands * sizeof(struct redirect_s *));
     
-    /* Single command - no pipe needed */
-    if(num_commands == 1)
+    for(int i = 0; i < num_commands; i++)
     {
-        return do_simple_command(commands[0]);
+        argcs[i] = expand_command(&commands[i], &argvs[i], &redirs[i]);
     }
     
-    /* DRY-RUN MODE: Print pipe information without actually piping */
-    if(current_exec_mode == EXEC_DRY)
+    /* Initialize timeline for pipeline */
+    timeline_init();
+    
+    /*
+     * With $TIMELINE_PIPES set, a timed pipeline gets instrumented pipes:
+     * each edge is two pipes with a relay thread in between (see relay.h).
+     */
+    struct relay_s *relay = NULL;
+    if(timeline_is_enabled() && !background && num_commands > 1)
     {
-        /* Print PIPE information for each pair */
-        for(int i = 0; i < num_commands - 1; i++)
+        struct symtab_entry_s *entry = get_symtab_entry("TIMELINE_PIPES");
+        if(entry && entry->val && *entry->val && strcmp(entry->val, "0") != 0)
         {
-            char *cmd1 = get_first_command_word(commands[i]);
-            char *cmd2 = get_first_command_word(commands[i + 1]);
-            if(cmd1 && cmd2)
-            {
-                dry_print_pipe(cmd1, cmd2);
-            }
+            relay = relay_new(num_commands - 1);
         }
-        
-        /* Execute each command in dry-run mode (which just prints EXEC) */
-        for(int i = 0; i < num_commands; i++)
-        {
-            do_simple_command(commands[i]);
-        }
-        
-        return 1;
     }
     
-    /* REAL EXECUTION MODE */
-    
-    /* Initialize timeline for pipeline */
-    timeline_init();
-    
-    int pipefds[2 * (num_commands - 1)];
-    pid_t pids[num_commands];
+    pid_t *pids = arena_alloc(num_commands * sizeof(pid_t));
+    job_proc_t **procs = arena_alloc(num_commands * sizeof(job_proc_t *));
+    int *codes = arena_alloc(num_commands * sizeof(int));
+    int res = 1;
+    int stopped = 0;
+    job_t *job = job_new(job_text(commands, num_commands), background);
     
-    /* Create all pipes */
-    for(int i = 0; i < num_commands - 1; i++)
+    /*
+     * A builtin in the last stage (like ksh's lastpipe), or else in the
+     * first, runs in the shell itself once the other stages are started,
+     * instead of in a forked copy of the shell.  Only one stage can: two of
+     * them in the shell would have to run at the same time.  Background
+     * pipelines mustn't hold up the shell, so they still fork.
+     */
+    int inproc = -1;
+    int inproc_builtin = -1;
+    int inproc_in = -1, inproc_out = -1;    /* its pipe ends, kept until it runs */
+    if(!background)
     {
-        if(pipe(pipefds + i * 2) < 0)
+        int last = num_commands - 1;
+        if(argcs[last] > 0 && (inproc_builtin = find_builtin(argvs[last][0])) >= 0)
         {
-            fprintf(stderr, "error: failed to create pipe: %s\n", strerror(errno));
-            return 0;
+            inproc = last;
+        }
+        else if(argcs[0] > 0 && (inproc_builtin = find_builtin(argvs[0][0])) >= 0)
+        {
+            inproc = 0;
         }
     }
     
-    /* Fork and execute each command */
+    /* Flush our output, so forked stages don't write it out again */
+    fflush(stdout);
+    
+    /*
+     * Start each command.  The pipe to the next stage is made just before
+     * the stage that writes to it, and the shell closes its ends as soon as
+     * both stages have them, so a pipeline of any length only ever has a
+     * few pipe fds open in the shell.  The pipes are close-on-exec: a
+     * spawned stage keeps just the ends dup'd to its stdin and stdout.
+     */
+    int prev_read = -1;     /* read end of the pipe from the previous stage */
     for(int i = 0; i < num_commands; i++)
     {
-        pids[i] = fork();
+        int fd_in  = prev_read;
+        int fd_out = -1;
+        int next_read = -1;
+        char *path = NULL;
+        
+        codes[i] = EXIT_FAILURE;
+        procs[i] = NULL;
+        pids[i] = 0;
+        prev_read = -1;
         
-        if(pids[i] == 0)
+        if(i < num_commands - 1)
         {
-            /* Child process */
+            int fds[2], relay_fds[2];
             
-            /* Reset signals to default so child can receive SIGINT/SIGTSTP */
-            reset_signals_for_child();
-            
-            /* Set up input from previous pipe (if not first command) */
-            if(i > 0)
+            /* With a relay, the next stage reads from a pipe of its own */
+            int err = (make_pipe(fds, O_CLOEXEC) < 0);
+            if(!err && relay && make_pipe(relay_fds, O_CLOEXEC) < 0)
             {
-                dup2(pipefds[(i - 1) * 2], STDIN_FILENO);
+                close_fds(fds[0], fds[1], -1);
+                err = 1;
             }
-            
-            /* Set up output to next pipe (if not last command) */
-            if(i < num_commands - 1)
+            if(err)
             {
-                dup2(pipefds[i * 2 + 1], STDOUT_FILENO);
+                fprintf(stderr, "error: failed to create pipe: %s\n", strerror(errno));
+                close_fds(fd_in, -1, -1);
+                res = 0;
+                goto fin;
             }
-            
-            /* Close all pipe fds in child */
-            for(int j = 0; j < 2 * (num_commands - 1); j++)
+            fd_out = fds[1];
+            next_read = fds[0];
+            if(relay)
             {
-                close(pipefds[j]);
+                relay->edges[i].in  = fds[0];
+                relay->edges[i].out = relay_fds[1];
+                next_read = relay_fds[0];
             }
+        }
+        
+        if(i == inproc)
+        {
+            /* Started below, when the rest of the pipeline is running */
+            inproc_in = fd_in;
+            inproc_out = fd_out;
+            prev_read = next_read;
+            continue;
+        }
+        
+        if(argcs[i] > 0 && find_builtin(argvs[i][0]) < 0)
+        {
+            path = strchr(argvs[i][0], '/') ? strdup(argvs[i][0]) : search_path(argvs[i][0]);
+        }
+        
+        if(path)
+        {
+            /* Fast path: spawn the command without copying the shell */
+            pids[i] = spawn_command(path, argvs[i], redirs[i], fd_in, fd_out,
+                                    job_pgid(job), job_tty(job));
+            free(path);
+            if(pids[i] < 0)
+            {
+                fprintf(stderr, "error: failed to execute command: %s\n", strerror(errno));
+                codes[i] = (errno == ENOENT) ? 127 : 126;
+            }
+        }
+        else
+        {
+            /* Builtins and unknown commands still need a forked child */
+            timeline_fork_prepare();
+            pids[i] = fork();
+            timeline_fork_parent(pids[i]);
             
-            /* Execute the command - need to build argv from node and handle redirections */
-            struct node_s *node = commands[i];
-            struct node_s *child = node->first_child;
-            
-            int argc = 0;
-            int targc = 0;
-            char **argv = NULL;
-            char *str;
-            
-            /* Collect redirections for this pipeline command */
-            struct redirect_s *cmd_redirects = NULL;
-            struct redirect_s *last_redir = NULL;
-            
-            while(child)
+            if(pids[i] == 0)
             {
-                str = child->val.str;
+                timeline_child_fork(argcs[i] > 0 ? argvs[i][0] : NULL);
                 
-                /* Check for redirection operators */
-                if(strcmp(str, ">") == 0 || strcmp(str, ">>") == 0 || strcmp(str, "<") == 0)
-                {
-                    int redir_type;
-                    if(strcmp(str, "<") == 0)
-                        redir_type = REDIRECT_INPUT;
-                    else if(strcmp(str, ">") == 0)
-                        redir_type = REDIRECT_OUTPUT;
-                    else
-                        redir_type = REDIRECT_APPEND;
-                    
-                    child = child->next_sibling;
-                    if(child)
-                    {
-                        /* Get the filename */
-                        struct word_s *fw = word_expand(child->val.str);
-                        if(fw && fw->data)
-                        {
-                            struct redirect_s *redir = malloc(sizeof(struct redirect_s));
-                            if(redir)
-                            {
-                                redir->type = redir_type;
-                                redir->filename = strdup(fw->data);
-                                redir->next = NULL;
-                                if(last_redir)
-                                    last_redir->next = redir;
-                                else
-                                    cmd_redirects = redir;
-                                last_redir = redir;
-                            }
-                            free_all_words(fw);
-                        }
-                        child = child->next_sibling;
-                    }
-                    continue;
-                }
-                
-                struct word_s *w = word_expand(str);
+                /* Join the job's process group, then reset signals to default */
+                job_child_setup(job);
+                reset_signals_for_child();
                 
-                if(!w)
+                if(fd_in >= 0)
                 {
-                    child = child->next_sibling;
-                    continue;
+                    dup2(fd_in, STDIN_FILENO);
+                    close(fd_in);
                 }
-
-                struct word_s *w2 = w;
-                while(w2)
+                if(fd_out >= 0)
                 {
-                    if(check_buffer_bounds(&argc, &targc, &argv))
-                    {
-                        str = malloc(strlen(w2->data)+1);
-                        if(str)
-                        {
-                            strcpy(str, w2->data);
-                            argv[argc++] = str;
-                        }
-                    }
-                    w2 = w2->next;
+                    dup2(fd_out, STDOUT_FILENO);
+                    close(fd_out);
                 }
                 
-                free_all_words(w);
-                child = child->next_sibling;
-            }
-            
-            if(argc > 0 && argv)
-            {
-                if(check_buffer_bounds(&argc, &targc, &argv))
+                /*
+                 * A builtin doesn't exec, so close the pipe ends we don't
+                 * use here rather than rely on close-on-exec
+                 */
+                close_fds(next_read, inproc_in, inproc_out);
+                if(relay)
                 {
-                    argv[argc] = NULL;
+                    relay_close_fds(relay);
                 }
                 
-                /* Apply redirections before exec */
-                if(cmd_redirects && apply_redirects(cmd_redirects) < 0)
+                if(argcs[i] > 0)
                 {
-                    exit(EXIT_FAILURE);
+                    /* Apply redirections before exec */
+                    if(redirs[i] && apply_redirects(redirs[i]) < 0)
+                    {
+                        exit(EXIT_FAILURE);
+                    }
+                    for(struct redirect_s *r = redirs[i]; r; r = r->next)
+                    {
+                        timeline_child_redirect(r->filename, r->type);
+                    }
+                    
+                    int b = find_builtin(argvs[i][0]);
+                    if(b >= 0)
+                    {
+                        int status = builtins[b].func(argcs[i], argvs[i]);
+                        fflush(stdout);
+                        exit(status);
+                    }
+                    
+                    timeline_child_record(EVENT_EXECVE);
+                    do_exec_cmd(argcs[i], argvs[i]);
+                    fprintf(stderr, "error: failed to execute command: %s\n", strerror(errno));
                 }
-                
-                do_exec_cmd(argc, argv);
-                fprintf(stderr, "error: failed to execute command: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
             }
-            exit(EXIT_FAILURE);
-        }
-        else if(pids[i] < 0)
-        {
-            fprintf(stderr, "error: failed to fork: %s\n", strerror(errno));
-            /* Close pipes and return */
-            for(int j = 0; j < 2 * (num_commands - 1); j++)
+            else if(pids[i] < 0)
             {
-                close(pipefds[j]);
+                fprintf(stderr, "error: failed to fork: %s\n", strerror(errno));
+                /* Close pipes and return */
+                close_fds(fd_in, fd_out, next_read);
+                res = 0;
+                goto fin;
             }
-            return 0;
         }
         
-        /* Record timeline events in parent after fork */
-        timeline_record_fork(pids[i]);
+        /* The stage has its ends now (or failed to start), we're done with them */
+        close_fds(fd_in, fd_out, -1);
+        prev_read = next_read;
+        
+        if(pids[i] <= 0)
+        {
+            continue;
+        }
+        
+        if(job)
+        {
+            procs[i] = job_add_process(job, pids[i]);
+        }
         
         /* Record pipe event (connection between this command and previous) */
-        if(i > 0)
+        if(i > 0 && pids[i - 1] > 0)
         {
             timeline_record_pipe(pids[i-1], pids[i]);
         }
-        
-        /* Record execve event */
-        timeline_record_execve(pids[i]);
     }
     
-    /* Parent: close all pipe fds */
-    for(int j = 0; j < 2 * (num_commands - 1); j++)
+    if(relay)
     {
-        close(pipefds[j]);
+        relay_start(relay);
     }
     
-    /* Wait for all children and record their exit events */
-    int status;
-    int statuses[num_commands];
-    for(int i = 0; i < num_commands; i++)
+    if(inproc >= 0)
     {
-        waitpid(pids[i], &statuses[i], WUNTRACED);
+        codes[inproc] = run_builtin(inproc_builtin, argcs[inproc], argvs[inproc],
+                                    redirs[inproc], inproc_in, inproc_out);
         
-        /* Record timeline events for each process */
-        if(WIFEXITED(statuses[i]))
+        /* Closing its pipe end gives the next stage EOF */
+        close_fds(inproc_in, inproc_out, -1);
+        inproc_in = inproc_out = -1;
+    }
+    
+    if(background)
+    {
+        /* Print the job number and the pid of the last stage, and move on */
+        pid_t last_pid = 0;
+        for(int i = 0; i < num_commands; i++)
         {
-            timeline_record_exit(pids[i], WEXITSTATUS(statuses[i]));
+            if(pids[i] > 0)
+            {
+                last_pid = pids[i];
+            }
         }
-        else if(WIFSIGNALED(statuses[i]))
+        printf("[%d] %d\n", job ? job->id : 0, last_pid);
+        exit_status = 0;
+        
+        /* The timeline shows the launch only, we don't wait for the exits */
+        timeline_print();
+        goto fin;
+    }
+    
+    /*
+     * wait for the whole pipeline. the reaper collects the children in the
+     * order they finish (not in pipeline order), recording each exit in the
+     * timeline as it happens.
+     */
+    if(job)
+    {
+        stopped = job_wait(job);
+    }
+    for(int i = 0; i < num_commands; i++)
+    {
+        if(procs[i])
         {
-            timeline_record_signaled(pids[i], WTERMSIG(statuses[i]));
+            codes[i] = procs[i]->status;
         }
-        else if(WIFSTOPPED(statuses[i]))
+        else if(pids[i] > 0)
         {
-            timeline_record_stopped(pids[i], WSTOPSIG(statuses[i]));
+            /* we couldn't track this one, wait for it directly */
+            int status = 0;
+            waitpid(pids[i], &status, 0);
+            codes[i] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
         }
     }
     
-    /* Use last command's status */
-    status = statuses[num_commands - 1];
-    
     /* Set exit status from last command in pipeline */
-    if(WIFEXITED(status))
-    {
-        exit_status = WEXITSTATUS(status);
-    }
-    else if(WIFSIGNALED(status))
-    {
-        exit_status = 128 + WTERMSIG(status);
-    }
-    else if(WIFSTOPPED(status))
+    exit_status = codes[num_commands - 1];
+    
+    /*
+     * The relay is done once every writer is, unless the job stopped: then
+     * it carries on by itself, and we never hear from it again.
+     */
+    if(relay)
     {
-        /* Pipeline was stopped (Ctrl+Z) */
-        exit_status = 128 + WSTOPSIG(status);
-        fprintf(stderr, "\n[Stopped]\n");
+        if(stopped)
+        {
+            relay_abandon(relay);
+        }
+        else
+        {
+            relay_finish(relay);
+            for(int e = 0; e < num_commands - 1; e++)
+            {
+                struct relay_edge_s *edge = &relay->edges[e];
+                timeline_record_pipe_closed(pids[e] > 0 ? pids[e] : getpid(),
+                                            pids[e + 1] > 0 ? pids[e + 1] : getpid(),
+                                            edge->end_ns, edge->bytes,
+                                            edge->full_ns, edge->empty_ns);
+            }
+            relay_free(relay);
+        }
+        relay = NULL;
     }
     
     /* Print the execution timeline */
     timeline_print();
+    
+fin:
+    /* A pipeline that failed to start never ran its in-shell stage or its relay */
+    close_fds(inproc_in, inproc_out, -1);
+    if(relay)
+    {
+        relay_cancel(relay);
+    }
     timeline_reset();
     
-    return 1;
+    /* A background job stays in the job table until it's reported */
+    if(background ? (job && job->nprocs == 0) : !stopped)
+    {
+        job_free(job);
+    }
+    
+    return res;
 }
 
 /*
- * Execute a pipeline in the background.
- * Similar to do_pipeline but doesn't wait for children.
+ * Execute a pipeline of commands.
+ * commands: array of compiled simple commands
+ * num_commands: number of commands in the pipeline
  */
-int do_pipeline_background(struct node_s **commands, int num_commands)
+int do_pipeline(struct plan_cmd_s *commands, int num_commands)
 {
     if(num_commands == 0 || !commands)
     {
         return 0;
     }
     
-    /* DRY-RUN MODE: Print background information without actually forking */
+    /* Single command - no pipe needed */
+    if(num_commands == 1)
+    {
+        return do_simple_command(&commands[0]);
+    }
+    
+    /* DRY-RUN MODE: Print pipe information without actually piping */
     if(current_exec_mode == EXEC_DRY)
     {
-        dry_print_background();
-        
-        /* Print pipe information if multiple commands */
-        if(num_commands > 1)
+        /* Print PIPE information for each pair */
+        for(int i = 0; i < num_commands - 1; i++)
         {
-            for(int i = 0; i < num_commands - 1; i++)
+            char *cmd1 = get_first_command_word(&commands[i]);
+            char *cmd2 = get_first_command_word(&commands[i + 1]);
+            if(cmd1 && cmd2)
             {
-                char *cmd1 = get_first_command_word(commands[i]);
-                char *cmd2 = get_first_command_word(commands[i + 1]);
-                if(cmd1 && cmd2)
-                {
-                    dry_print_pipe(cmd1, cmd2);
-                }
+                dry_print_pipe(cmd1, cmd2);
             }
         }
         
         /* Execute each command in dry-run mode (which just prints EXEC) */
         for(int i = 0; i < num_commands; i++)
         {
-            do_simple_command(commands[i]);
+            do_simple_command(&commands[i]);
         }
         
         return 1;
     }
     
-    /* REAL EXECUTION MODE */
-    
-    /* Initialize timeline for background job */
-    timeline_init();
-    
-    /* Fork a subshell to handle the entire pipeline in background */
-    pid_t bg_pid = fork();
+    return run_pipeline(commands, num_commands, 0);
+}
+
+/*
+ * Execute a pipeline in the background.
+ * Similar to do_pipeline but doesn't wait for children.
+ */
+int do_pipeline_background(struct plan_cmd_s *commands, int num_commands)
+{
+    if(num_commands == 0 || !commands)
+    {
+        return 0;
+    }
     
-    if(bg_pid == 0)
+    /* DRY-RUN MODE: Print background information without actually forking */
+    if(current_exec_mode == EXEC_DRY)
     {
-        /* Child: this becomes the background job leader */
-        /* Reset signals to default for background processes */
-        reset_signals_for_child();
-        
-        /* Detach from terminal's process group */
-        setpgid(0, 0);
-        
-        if(num_commands == 1)
-        {
-            /* Single command - execute directly */
-            struct node_s *node = commands[0];
-            struct node_s *child = node->first_child;
-            
-            int argc = 0;
-            int targc = 0;
-            char **argv = NULL;
-            char *str;
-            
-            /* Collect redirections */
-            struct redirect_s *cmd_redirects = NULL;
-            struct redirect_s *last_redir = NULL;
-            
-            while(child)
-            {
-                str = child->val.str;
-                
-                /* Check for redirection operators */
-                if(strcmp(str, ">") == 0 || strcmp(str, ">>") == 0 || strcmp(str, "<") == 0)
-                {
-                    int redir_type;
-                    if(strcmp(str, "<") == 0)
-                        redir_type = REDIRECT_INPUT;
-                    else if(strcmp(str, ">") == 0)
-                        redir_type = REDIRECT_OUTPUT;
-                    else
-                        redir_type = REDIRECT_APPEND;
-                    
-                    child = child->next_sibling;
-                    if(child)
-                    {
-                        struct word_s *fw = word_expand(child->val.str);
-                        if(fw && fw->data)
-                        {
-                            struct redirect_s *redir = malloc(sizeof(struct redirect_s));
-                            if(redir)
-                            {
-                                redir->type = redir_type;
-                                redir->filename = strdup(fw->data);
-                                redir->next = NULL;
-                                if(last_redir)
-                                    last_redir->next = redir;
-                                else
-                                    cmd_redirects = redir;
-                                last_redir = redir;
-                            }
-                            free_all_words(fw);
-                        }
-                        child = child->next_sibling;
-                    }
-                    continue;
-                }
-                
-                struct word_s *w = word_expand(str);
-                
-                if(!w)
-                {
-                    child = child->next_sibling;
-                    continue;
-                }
-
-                struct word_s *w2 = w;
-                while(w2)
-                {
-                    if(check_buffer_bounds(&argc, &targc, &argv))
-                    {
-                        str = malloc(strlen(w2->data)+1);
-                        if(str)
-                        {
-                            strcpy(str, w2->data);
-                            argv[argc++] = str;
-                        }
-                    }
-                    w2 = w2->next;
-                }
-                
-                free_all_words(w);
-                child = child->next_sibling;
-            }
-            
-            if(argc > 0 && argv)
-            {
-                if(check_buffer_bounds(&argc, &targc, &argv))
-                {
-                    argv[argc] = NULL;
-                }
-                
-                /* Apply redirections before exec */
-                if(cmd_redirects && apply_redirects(cmd_redirects) < 0)
-                {
-                    exit(EXIT_FAILURE);
-                }
-                
-                do_exec_cmd(argc, argv);
-            }
-            exit(EXIT_FAILURE);
-        }
-        
-        /* Multiple commands - set up pipeline */
-        int pipefds[2 * (num_commands - 1)];
-        pid_t pids[num_commands];
-        
-        for(int i = 0; i < num_commands - 1; i++)
-        {
-            if(pipe(pipefds + i * 2) < 0)
-            {
-                exit(EXIT_FAILURE);
-            }
-        }
+        dry_print_background();
         
-        for(int i = 0; i < num_commands; i++)
+        /* Print pipe information if multiple commands */
+        if(num_commands > 1)
         {
-            pids[i] = fork();
-            
-            if(pids[i] == 0)
+            for(int i = 0; i < num_commands - 1; i++)
             {
-                if(i > 0)
-                {
-                    dup2(pipefds[(i - 1) * 2], STDIN_FILENO);
-                }
-                
-                if(i < num_commands - 1)
-                {
-                    dup2(pipefds[i * 2 + 1], STDOUT_FILENO);
-                }
-                
-                for(int j = 0; j < 2 * (num_commands - 1); j++)
-                {
-                    close(pipefds[j]);
-                }
-                
-                struct node_s *node = commands[i];
-                struct node_s *child = node->first_child;
-                
-                int argc = 0;
-                int targc = 0;
-                char **argv = NULL;
-                char *str;
-                
-                /* Collect redirections */
-                struct redirect_s *cmd_redirects = NULL;
-                struct redirect_s *last_redir = NULL;
-                
-                while(child)
-                {
-                    str = child->val.str;
-                    
-                    /* Check for redirection operators */
-                    if(strcmp(str, ">") == 0 || strcmp(str, ">>") == 0 || strcmp(str, "<") == 0)
-                    {
-                        int redir_type;
-                        if(strcmp(str, "<") == 0)
-                            redir_type = REDIRECT_INPUT;
-                        else if(strcmp(str, ">") == 0)
-                            redir_type = REDIRECT_OUTPUT;
-                        else
-                            redir_type = REDIRECT_APPEND;
-                        
-                        child = child->next_sibling;
-                        if(child)
-                        {
-                            struct word_s *fw = word_expand(child->val.str);
-                            if(fw && fw->data)
-                            {
-                                struct redirect_s *redir = malloc(sizeof(struct redirect_s));
-                                if(redir)
-                                {
-                                    redir->type = redir_type;
-                                    redir->filename = strdup(fw->data);
-                                    redir->next = NULL;
-                                    if(last_redir)
-                                        last_redir->next = redir;
-                                    else
-                                        cmd_redirects = redir;
-                                    last_redir = redir;
-                                }
-                                free_all_words(fw);
-                            }
-                            child = child->next_sibling;
-                        }
-                        continue;
-                    }
-                    
-                    struct word_s *w = word_expand(str);
-                    
-                    if(!w)
-                    {
-                        child = child->next_sibling;
-                        continue;
-                    }
-
-                    struct word_s *w2 = w;
-                    while(w2)
-                    {
-                        if(check_buffer_bounds(&argc, &targc, &argv))
-                        {
-                            str = malloc(strlen(w2->data)+1);
-                            if(str)
-                            {
-                                strcpy(str, w2->data);
-                                argv[argc++] = str;
-                            }
-                        }
-                        w2 = w2->next;
-                    }
-                    
-                    free_all_words(w);
-                    child = child->next_sibling;
-                }
-                
-                if(argc > 0 && argv)
+                char *cmd1 = get_first_command_word(&commands[i]);
+                char *cmd2 = get_first_command_word(&commands[i + 1]);
+                if(cmd1 && cmd2)
                 {
-                    if(check_buffer_bounds(&argc, &targc, &argv))
-                    {
-                        argv[argc] = NULL;
-                    }
-                    
-                    /* Apply redirections before exec */
-                    if(cmd_redirects && apply_redirects(cmd_redirects) < 0)
-                    {
-                        exit(EXIT_FAILURE);
-                    }
-                    
-                    do_exec_cmd(argc, argv);
+                    dry_print_pipe(cmd1, cmd2);
                 }
-                exit(EXIT_FAILURE);
-            }
-            else if(pids[i] < 0)
-            {
-                exit(EXIT_FAILURE);
             }
         }
         
-        for(int j = 0; j < 2 * (num_commands - 1); j++)
-        {
-            close(pipefds[j]);
-        }
-        
-        int status;
+        /* Execute each command in dry-run mode (which just prints EXEC) */
         for(int i = 0; i < num_commands; i++)
         {
-            waitpid(pids[i], &status, 0);
+            do_simple_command(&commands[i]);
         }
         
-        if(WIFEXITED(status))
-        {
-            exit(WEXITSTATUS(status));
-        }
-        exit(EXIT_FAILURE);
-    }
-    else if(bg_pid < 0)
-    {
-        fprintf(stderr, "error: failed to fork background job: %s\n", strerror(errno));
-        return 0;
+        return 1;
     }
     
-    /* Record fork event for background job */
-    timeline_record_fork(bg_pid);
-    timeline_record_execve(bg_pid);
-    
-    /* Parent: print background job info and continue */
-    printf("[%d] %d\n", 1, bg_pid);
-    exit_status = 0;
-    
-    /* Print timeline for background job launch (it won't show exit since we don't wait) */
-    timeline_print();
-    timeline_reset();
-    
-    return 1;
+    return run_pipeline(commands, num_commands, 1);
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 #ifndef BACKEND_H
 #define BACKEND_H
 
-#include "node.h"
+#include "plan.h"
 
 /* Execution mode enum for real vs dry-run execution */
 enum exec_mode { EXEC_REAL, EXEC_DRY };
@@ -9,11 +9,21 @@ enum exec_mode { EXEC_REAL, EXEC_DRY };
 /* Current execution mode (default is EXEC_REAL) */
 extern enum exec_mode current_exec_mode;
 
+/* Set in a subshell about to run its last command: exec it instead of spawning */
+extern int exec_last_command;
+
 char *search_path(char *file);
+
+/* Make a pipe (flags as for pipe2()), with the capacity $PIPESIZE asks for */
+int make_pipe(int fds[2], int flags);
+
+/* Take a new value of $PIPESIZE (NULL when it's unset) */
+void set_pipe_size(const char *val);
+
 int do_exec_cmd(int argc, char **argv);
-int do_simple_command(struct node_s *node);
-int do_pipeline(struct node_s **commands, int num_commands);
-int do_pipeline_background(struct node_s **commands, int num_commands);
+int do_simple_command(struct plan_cmd_s *cmd);
+int do_pipeline(struct plan_cmd_s *commands, int num_commands);
+int do_pipeline_background(struct plan_cmd_s *commands, int num_commands);
 
 /* Dry-run execution functions */
 int dry_run_command(const char *cmd_line);
@@ -0,0 +1,436 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "globmatch.h"
+
+/* The compiled patterns, hashed by their text (one per slot, the newest wins) */
+static struct globmatch_s *cache[GLOBMATCH_CACHE_SIZE];
+
+/* An atom of a pattern, while we compile it */
+struct atom_s
+{
+    int star;                   /* it's a *, which takes any number of bytes */
+    int literal;                /* it's a plain (maybe escaped) character */
+    unsigned char set[32];      /* else the bytes it takes, as a bitmap */
+};
+
+
+static void set_add(unsigned char *set, int c)
+{
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+
+static int set_has(unsigned char *set, int c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+
+/* add the members of a [:class:], returns 0 if there's no such class */
+static int add_class(unsigned char *set, char *name, size_t len)
+{
+    static const struct
+    {
+        char *name;
+        int (*test)(int);
+    } classes[] =
+    {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+        { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+        { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+        { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+    };
+
+    for(size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+    {
+        if(strlen(classes[i].name) == len && strncmp(classes[i].name, name, len) == 0)
+        {
+            for(int c = 1; c < 256; c++)
+            {
+                if(classes[i].test(c))
+                {
+                    set_add(set, c);
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * parse a bracket expression, p being just past its '['. returns what
+ * follows the closing ']', or NULL if there is none (and the '[' is just a
+ * '['). sets *bad if it has something fnmatch() would fail on.
+ */
+static char *parse_bracket(char *p, unsigned char *set, int *bad)
+{
+    unsigned char chars[32];
+    int negate = 0;
+
+    memset(chars, 0, sizeof(chars));
+    if(*p == '!' || *p == '^')
+    {
+        negate = 1;
+        p++;
+    }
+
+    for(int first = 1; ; first = 0)
+    {
+        int lo, hi;
+
+        if(*p == '\0')
+        {
+            return NULL;
+        }
+        if(*p == ']' && !first)
+        {
+            break;
+        }
+
+        /* [:class:], [=c=] or [.c.] */
+        char *end = NULL;
+        if(*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.'))
+        {
+            for(end = p+2; *end && !(end[0] == p[1] && end[1] == ']'); end++)
+            {
+                ;
+            }
+            if(!*end)
+            {
+                end = NULL;
+            }
+        }
+
+        if(end)
+        {
+            size_t len = end - (p+2);
+            if(p[1] == ':')
+            {
+                if(!add_class(chars, p+2, len))
+                {
+                    *bad = 1;
+                }
+                p = end+2;
+                continue;
+            }
+            /* the C locale has no multi-character collating elements */
+            if(len != 1)
+            {
+                *bad = 1;
+                p = end+2;
+                continue;
+            }
+            lo = (unsigned char)p[2];
+            p = end+2;
+        }
+        else
+        {
+            if(*p == '\\' && p[1])
+            {
+                p++;
+            }
+            lo = (unsigned char)*p++;
+        }
+
+        /* a range, unless the '-' is the last thing before the ']' */
+        if(*p == '-' && p[1] && p[1] != ']')
+        {
+            p++;
+            if(*p == '\\' && p[1])
+            {
+                p++;
+            }
+            hi = (unsigned char)*p++;
+            for(int c = lo; c <= hi; c++)
+            {
+                set_add(chars, c);
+            }
+        }
+        else
+        {
+            set_add(chars, lo);
+        }
+    }
+
+    for(int i = 0; i < 32; i++)
+    {
+        set[i] = negate ? ~chars[i] : chars[i];
+    }
+    return p+1;
+}
+
+
+/* fill in one direction's tables from the atoms (taken backwards if backward is set) */
+static int build_dir(struct globmatch_dir_s *dir, struct atom_s *atoms, int natoms,
+                     int nwords, int backward)
+{
+    dir->accepts = calloc(256 * (size_t)nwords, sizeof(uint64_t));
+    dir->stars = calloc(nwords, sizeof(uint64_t));
+    if(!dir->accepts || !dir->stars)
+    {
+        return 0;
+    }
+
+    for(int j = 0; j < natoms; j++)
+    {
+        struct atom_s *atom = &atoms[backward ? natoms-1-j : j];
+        uint64_t bit = (uint64_t)1 << (j & 63);
+        int w = j >> 6;
+
+        if(atom->star)
+        {
+            dir->stars[w] |= bit;
+            continue;
+        }
+        for(int c = 1; c < 256; c++)
+        {
+            if(set_has(atom->set, c))
+            {
+                dir->accepts[c * nwords + w] |= bit;
+            }
+        }
+    }
+    return 1;
+}
+
+
+static void free_matcher(struct globmatch_s *m)
+{
+    if(!m)
+    {
+        return;
+    }
+    free(m->forward.accepts);
+    free(m->forward.stars);
+    free(m->backward.accepts);
+    free(m->backward.stars);
+    free(m->pattern);
+    free(m);
+}
+
+
+static struct globmatch_s *compile(char *pattern)
+{
+    struct globmatch_s *m = calloc(1, sizeof(struct globmatch_s));
+    size_t size = strlen(pattern) + 1;
+    struct atom_s *atoms = malloc(size * sizeof(struct atom_s));
+    int natoms = 0;
+
+    if(!m || !atoms || !(m->pattern = strdup(pattern)))
+    {
+        free(atoms);
+        free_matcher(m);
+        return NULL;
+    }
+
+    /* there are never more atoms than characters */
+    char *p = pattern;
+    while(*p)
+    {
+        struct atom_s *atom = &atoms[natoms];
+        memset(atom, 0, sizeof(struct atom_s));
+
+        switch(*p)
+        {
+            case '*':
+                p++;
+                /* a run of *s is one * */
+                if(natoms && atoms[natoms-1].star)
+                {
+                    continue;
+                }
+                atom->star = 1;
+                break;
+
+            case '?':
+                memset(atom->set, 0xff, sizeof(atom->set));
+                p++;
+                break;
+
+            case '[':
+            {
+                char *next = parse_bracket(p+1, atom->set, &m->never);
+                if(next)
+                {
+                    p = next;
+                    break;
+                }
+                set_add(atom->set, '[');
+                atom->literal = 1;
+                p++;
+                break;
+            }
+
+            case '\\':
+                /* as for fnmatch(), a pattern can't end in a lone backslash */
+                if(!p[1])
+                {
+                    m->never = 1;
+                }
+                else
+                {
+                    p++;
+                }
+                /* fall through */
+
+            default:
+                set_add(atom->set, (unsigned char)*p++);
+                atom->literal = 1;
+                break;
+        }
+        natoms++;
+    }
+
+    m->natoms = natoms;
+    m->nwords = natoms / 64 + 1;
+    m->lead_dot = natoms && atoms[0].literal && set_has(atoms[0].set, '.');
+    if(!build_dir(&m->forward, atoms, natoms, m->nwords, 0) ||
+       !build_dir(&m->backward, atoms, natoms, m->nwords, 1))
+    {
+        free(atoms);
+        free_matcher(m);
+        return NULL;
+    }
+    free(atoms);
+    return m;
+}
+
+
+struct globmatch_s *globmatch_get(char *pattern)
+{
+    unsigned int h = 5381;
+    for(char *p = pattern; *p; p++)
+    {
+        h = h * 33 + (unsigned char)*p;
+    }
+    h %= GLOBMATCH_CACHE_SIZE;
+
+    if(cache[h] && strcmp(cache[h]->pattern, pattern) == 0)
+    {
+        return cache[h];
+    }
+
+    struct globmatch_s *m = compile(pattern);
+    if(m)
+    {
+        free_matcher(cache[h]);
+        cache[h] = m;
+    }
+    return m;
+}
+
+
+/*
+ * move the states in d over byte c: an atom that takes c passes its state
+ * on to the next one, and a * keeps its own. then a * that was reached can
+ * also match nothing, so the state after it is reached too (and as *s
+ * never come in runs, one shift does it). returns 0 if no state is left.
+ */
+static int step(const struct globmatch_dir_s *dir, uint64_t *d, int nwords, unsigned char c)
+{
+    const uint64_t *accepts = dir->accepts + (size_t)c * nwords;
+    uint64_t carry = 0, star_carry = 0, any = 0;
+
+    for(int w = 0; w < nwords; w++)
+    {
+        uint64_t moved = d[w] & accepts[w];
+        uint64_t next = (moved << 1) | carry | (d[w] & dir->stars[w]);
+        uint64_t stars = next & dir->stars[w];
+
+        carry = moved >> 63;
+        next |= (stars << 1) | star_carry;
+        star_carry = stars >> 63;
+        d[w] = next;
+        any |= next;
+    }
+    return any != 0;
+}
+
+
+/*
+ * run an automaton over str, from the front or back from the end. returns
+ * the number of bytes taken when the final state was reached first (or
+ * last, if longest is set), or -1 if it never was.
+ */
+static long run(struct globmatch_s *m, char *str, size_t len, int backward, int longest, int period)
+{
+    const struct globmatch_dir_s *dir = backward ? &m->backward : &m->forward;
+    uint64_t local[4];
+    uint64_t *d = local;
+    int nwords = m->nwords;
+    int final_word = m->natoms >> 6;
+    uint64_t final_bit = (uint64_t)1 << (m->natoms & 63);
+    long found = -1;
+
+    if(m->never)
+    {
+        return -1;
+    }
+    if(nwords > 4 && !(d = malloc(nwords * sizeof(uint64_t))))
+    {
+        return -1;
+    }
+
+    /* start in state 0, and past it if it's a * */
+    memset(d, 0, nwords * sizeof(uint64_t));
+    d[0] = 1;
+    if(dir->stars[0] & 1)
+    {
+        d[0] |= 2;
+    }
+
+    for(size_t i = 0; ; i++)
+    {
+        if(d[final_word] & final_bit)
+        {
+            found = i;
+            if(!longest)
+            {
+                break;
+            }
+        }
+        if(i == len)
+        {
+            break;
+        }
+
+        unsigned char c = backward ? str[len-1-i] : str[i];
+        /* only a literal '.' may take a leading '.' */
+        if(period && i == 0 && c == '.' && !m->lead_dot)
+        {
+            break;
+        }
+        if(!step(dir, d, nwords, c))
+        {
+            break;
+        }
+    }
+
+    if(d != local)
+    {
+        free(d);
+    }
+    return found;
+}
+
+
+int globmatch_match(struct globmatch_s *m, char *str, int flags)
+{
+    size_t len = strlen(str);
+    return run(m, str, len, 0, 1, flags & GLOBMATCH_PERIOD) == (long)len;
+}
+
+
+long globmatch_prefix(struct globmatch_s *m, char *str, size_t len, int longest)
+{
+    return run(m, str, len, 0, longest, 0);
+}
+
+
+long globmatch_suffix(struct globmatch_s *m, char *str, size_t len, int longest)
+{
+    return run(m, str, len, 1, longest, 0);
+}
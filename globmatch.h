@@ -0,0 +1,65 @@
+#ifndef GLOBMATCH_H
+#define GLOBMATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Glob patterns compiled to automata.  A pattern is a row of atoms (a byte
+ * set for a literal, ? or [...], or a *), and the automaton's states are
+ * the positions between them: state j means the first j atoms have been
+ * matched.  The states we could be in are kept as a bit set, and a byte
+ * moves them all at once with a few shifts and masks, so matching takes one
+ * pass over the string, however many ways a run of *s could split it.
+ * Stepping through a string and checking for the final state after each
+ * byte finds its shortest or longest matching prefix in that same pass,
+ * and the pattern compiled backwards does the same for suffixes.
+ *
+ * The patterns mean what they do to fnmatch() in the C locale (the shell
+ * never calls setlocale()): backslash escapes, [!...] and [^...], ranges,
+ * [:class:], [=c=] and [.c.].  A pattern with a class we don't know, or
+ * ending in a lone backslash, matches nothing.
+ */
+
+/* Number of compiled patterns kept by globmatch_get() */
+#define GLOBMATCH_CACHE_SIZE    64
+
+/* Flags for globmatch_match() */
+#define GLOBMATCH_PERIOD        1   /* a leading '.' must be matched by a literal '.' (FNM_PERIOD) */
+
+/* An automaton, run one way */
+struct globmatch_dir_s
+{
+    uint64_t *accepts;          /* per byte: states whose atom takes it (256 rows of nwords) */
+    uint64_t *stars;            /* states whose atom is a * */
+};
+
+/* A compiled pattern */
+struct globmatch_s
+{
+    char *pattern;              /* the pattern, as given */
+    int natoms;                 /* the final state is natoms */
+    int nwords;                 /* 64-bit words in a state set */
+    int never;                  /* a bad pattern, which matches nothing */
+    int lead_dot;               /* the first atom is a literal '.' */
+    struct globmatch_dir_s forward;
+    struct globmatch_dir_s backward;    /* the atoms in reverse, for suffixes */
+};
+
+/*
+ * Get a compiled pattern, from the cache or compiled now.  The result stays
+ * good until the next call (which may push it out of the cache), and can
+ * be matched from any thread meanwhile.  NULL if we're out of memory.
+ */
+struct globmatch_s *globmatch_get(char *pattern);
+
+/* Does the whole of str match?  flags is 0 or GLOBMATCH_PERIOD */
+int globmatch_match(struct globmatch_s *m, char *str, int flags);
+
+/* Length of the shortest or longest prefix of str that matches, -1 if none */
+long globmatch_prefix(struct globmatch_s *m, char *str, size_t len, int longest);
+
+/* Length of the shortest or longest suffix of str that matches, -1 if none */
+long globmatch_suffix(struct globmatch_s *m, char *str, size_t len, int longest);
+
+#endif
@@ -7,6 +7,7 @@
 #include "mshX.h"
 #include "symtab/symtab.h"
 #include "builtins/history.h"
+#include "builtins/jobs.h"
 
 extern char **environ;
 
@@ -59,6 +60,9 @@ void initsh(void)
     /* Setup signal handlers - shell ignores SIGINT and SIGTSTP */
     setup_signals();
     
+    /* Start the child reaper (SIGCHLD is blocked from here on) */
+    jobs_init();
+    
     /* Initialize shell PID for $$ */
     shell_pid = getpid();
 
@@ -80,7 +84,7 @@ void initsh(void)
             if(entry)
             {
                 symtab_entry_setval(entry, eq+1);
-                entry->flags |= FLAG_EXPORT;
+                symtab_entry_export(entry, 1);
             }
         }
         else
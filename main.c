@@ -1,380 +1,300 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <string.h>
-#include "mshX.h"
-#include "source.h"
-#include "parser.h"
-#include "executor.h"
-#include "builtins/timeline.h"
-#include "builtins/history.h"
-
-/* extern declaration for exit status */
-extern int exit_status;
-
-/* Check if command starts with timeline and strip it */
-static char *check_timeline_flag(char *cmd, int *timeline_requested)
-{
-    *timeline_requested = 0;
-    
-    /* Skip leading whitespace */
-    char *p = cmd;
-    while(*p == ' ' || *p == '\t')
-        p++;
-    
-    /* Check for timeline flag */
-    if(strncmp(p, "timeline", 8) == 0 && 
-       (p[8] == ' ' || p[8] == '\t'))
-    {
-        *timeline_requested = 1;
-        p += 8;
-        
-        /* Skip whitespace after timeline */
-        while(*p == ' ' || *p == '\t')
-            p++;
-        
-        /* Create new command string without timeline */
-        char *new_cmd = malloc(strlen(p) + 1);
-        if(new_cmd)
-        {
-            strcpy(new_cmd, p);
-            free(cmd);
-            return new_cmd;
-        }
-    }
-    
-    return cmd;
-}
-
-
-int main(int argc, char **argv)
-{
-    char *cmd;
-
-    initsh();
-    
-    do
-    {
-        print_prompt1();
-        cmd = read_cmd();
-        if(!cmd)
-        {
-            /* Check if this was EOF or an error */
-            if(feof(stdin))
-            {
-                printf("\n");  /* Print newline before exit on Ctrl+D */
-                exit(EXIT_SUCCESS);
-            }
-            /* Clear any error state and continue (e.g., after signal) */
-            clearerr(stdin);
-            continue;
-        }
-        if(cmd[0] == '\0' || strcmp(cmd, "\n") == 0)
-        {
-            free(cmd);
-            continue;
-        }
-        if(strcmp(cmd, "exit\n") == 0)
-        {
-            free(cmd);
-            break;
-        }
-        
-        /* Expand history references (!! and !n) */
-        char *expanded = history_expand(cmd);
-        if(expanded)
-        {
-            free(cmd);
-            cmd = expanded;
-            /* If expansion resulted in empty string, skip execution */
-            if(cmd[0] == '\0')
-            {
-                free(cmd);
-                continue;
-            }
-        }
-        
-        /* Add command to history (before processing) */
-        history_add(cmd);
-        
-        /* Check for timeline flag */
-        int timeline_requested = 0;
-        cmd = check_timeline_flag(cmd, &timeline_requested);
-        
-        /* Enable timeline if requested */
-        if(timeline_requested)
-        {
-            timeline_enable(1);
-        }
-        
-	struct source_s src;
-        src.buffer   = cmd;
-        src.buffer_size  = strlen(cmd);
-        src.current_pos   = INIT_SRC_POS;
-        parse_and_execute(&src);
-        
-        /* Disable timeline after execution */
-        if(timeline_requested)
-        {
-            timeline_enable(0);
-        }
-        
-        free(cmd);
-    } while(1);
-    exit(EXIT_SUCCESS);
-}
-
-
-char *read_cmd(void)
-{
-    char buf[1024];
-    char *ptr = NULL;
-    char ptrlen = 0;
-    while(fgets(buf, 1024, stdin))
-    {
-        int buflen = strlen(buf);
-        if(!ptr)
-        {
-            ptr = malloc(buflen+1);
-        }
-        else
-        {
-            char *ptr2 = realloc(ptr, ptrlen+buflen+1);
-            if(ptr2)
-            {
-                ptr = ptr2;
-            }
-            else
-            {
-                free(ptr);
-                ptr = NULL;
-            }
-        }
-        if(!ptr)
-        {
-            fprintf(stderr, "error: failed to alloc buffer: %s\n", strerror(errno));
-            return NULL;
-        }
-        strcpy(ptr+ptrlen, buf);
-        if(buf[buflen-1] == '\n')
-        {
-            if(buflen == 1 || buf[buflen-2] != '\\')
-            {
-                return ptr;
-            }
-            ptr[ptrlen+buflen-2] = '\0';
-            buflen -= 2;
-            print_prompt2();
-        }
-        ptrlen += buflen;
-    }
-    return ptr;
-}
-
-
-int parse_and_execute(struct source_s *src)
-{
-    skip_white_spaces(src);
-
-    /* For dry-run mode: check if we have multiple commands (sequence) */
-    int has_sequence = 0;
-    
-    /* First pass for dry-run: check if there's a sequence operator */
-    if(current_exec_mode == EXEC_DRY)
-    {
-        /* Save position BEFORE tokenizing */
-        long saved_pos = src->current_pos;
-        
-        /* Count commands and check for sequence */
-        struct token_s *check_tok = tokenize(src);
-        while(check_tok && check_tok != &eof_token)
-        {
-            if(strcmp(check_tok->text, ";") == 0)
-            {
-                has_sequence = 1;
-            }
-            free_token(check_tok);
-            skip_white_spaces(src);
-            check_tok = tokenize(src);
-        }
-        
-        /* Reset position for actual parsing */
-        src->current_pos = saved_pos;
-        
-        if(has_sequence)
-        {
-            dry_print_sequence();
-        }
-    }
-
-    struct token_s *tok = tokenize(src);
-
-    if(tok == &eof_token)
-    {
-        return 0;
-    }
-
-    while(tok && tok != &eof_token)
-    {
-        /* Collect commands for pipeline */
-        struct node_s *pipeline[64];  /* max 64 commands in a pipeline */
-        int num_cmds = 0;
-        
-        /* Parse first command */
-        struct node_s *cmd = parse_simple_command(tok);
-        if(cmd && cmd->first_child)
-        {
-            pipeline[num_cmds++] = cmd;
-        }
-        else if(cmd)
-        {
-            free_node_tree(cmd);
-        }
-        
-        /* Check for pipes and collect all commands in pipeline */
-        skip_white_spaces(src);
-        tok = tokenize(src);
-        
-        while(tok && tok != &eof_token && strcmp(tok->text, "|") == 0)
-        {
-            free_token(tok);
-            skip_white_spaces(src);
-            tok = tokenize(src);
-            
-            if(tok == &eof_token)
-            {
-                fprintf(stderr, "error: expected command after pipe\n");
-                break;
-            }
-            
-            cmd = parse_simple_command(tok);
-            if(cmd && cmd->first_child && num_cmds < 64)
-            {
-                pipeline[num_cmds++] = cmd;
-            }
-            else if(cmd)
-            {
-                free_node_tree(cmd);
-            }
-            
-            skip_white_spaces(src);
-            tok = tokenize(src);
-        }
-        
-        /* Check if this is a background job */
-        int run_in_background = 0;
-        if(tok && tok != &eof_token && strcmp(tok->text, "&") == 0)
-        {
-            run_in_background = 1;
-        }
-        
-        /* Execute the pipeline */
-        if(num_cmds > 0)
-        {
-            if(run_in_background)
-            {
-                do_pipeline_background(pipeline, num_cmds);
-            }
-            else
-            {
-                do_pipeline(pipeline, num_cmds);
-            }
-            
-            /* Free all command nodes */
-            for(int i = 0; i < num_cmds; i++)
-            {
-                free_node_tree(pipeline[i]);
-            }
-        }
-        
-        if(tok == &eof_token)
-        {
-            break;
-        }
-        
-        /* Handle logical operators */
-        if(strcmp(tok->text, "&&") == 0)
-        {
-            free_token(tok);
-            /* AND operator: execute next command only if previous succeeded (exit_status == 0) */
-            if(exit_status != 0)
-            {
-                /* Skip remaining commands in this AND chain until we hit || or end */
-                skip_white_spaces(src);
-                tok = tokenize(src);
-                while(tok && tok != &eof_token)
-                {
-                    if(strcmp(tok->text, "||") == 0)
-                    {
-                        free_token(tok);
-                        break;
-                    }
-                    if(tok->text[0] == '\n')
-                    {
-                        free_token(tok);
-                        return 1;
-                    }
-                    free_token(tok);
-                    tok = tokenize(src);
-                }
-                if(tok == &eof_token)
-                {
-                    return 1;
-                }
-            }
-            skip_white_spaces(src);
-            tok = tokenize(src);
-            continue;
-        }
-        else if(strcmp(tok->text, "||") == 0)
-        {
-            free_token(tok);
-            /* OR operator: execute next command only if previous failed (exit_status != 0) */
-            if(exit_status == 0)
-            {
-                /* Skip remaining commands in this OR chain until we hit && or end */
-                skip_white_spaces(src);
-                tok = tokenize(src);
-                while(tok && tok != &eof_token)
-                {
-                    if(strcmp(tok->text, "&&") == 0)
-                    {
-                        free_token(tok);
-                        break;
-                    }
-                    if(tok->text[0] == '\n')
-                    {
-                        free_token(tok);
-                        return 1;
-                    }
-                    free_token(tok);
-                    tok = tokenize(src);
-                }
-                if(tok == &eof_token)
-                {
-                    return 1;
-                }
-            }
-            skip_white_spaces(src);
-            tok = tokenize(src);
-            continue;
-        }
-        else if(strcmp(tok->text, ";") == 0)
-        {
-            /* Command separator: just continue to next command unconditionally */
-            free_token(tok);
-            skip_white_spaces(src);
-            tok = tokenize(src);
-            continue;
-        }
-        else if(strcmp(tok->text, "&") == 0)
-        {
-            /* Background operator: command already executed, just continue */
-            free_token(tok);
-            skip_white_spaces(src);
-            tok = tokenize(src);
-            continue;
-        }
-    }
-    return 1;
-}
\ No newline at end of file
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include "mshX.h"
+#include "source.h"
+#include "parser.h"
+#include "executor.h"
+#include "plan.h"
+#include "arena.h"
+#include "builtins/timeline.h"
+#include "builtins/history.h"
+#include "builtins/jobs.h"
+#include "symtab/symtab.h"
+
+/* extern declaration for exit status */
+extern int exit_status;
+
+/* Check if command starts with timeline and strip it */
+static char *check_timeline_flag(char *cmd, int *timeline_requested)
+{
+    *timeline_requested = 0;
+    
+    /* Skip leading whitespace */
+    char *p = cmd;
+    while(*p == ' ' || *p == '\t')
+        p++;
+    
+    /* Check for timeline flag */
+    if(strncmp(p, "timeline", 8) == 0 && 
+       (p[8] == ' ' || p[8] == '\t'))
+    {
+        p += 8;
+        
+        /* Skip whitespace after timeline */
+        while(*p == ' ' || *p == '\t')
+            p++;
+        
+        /* timeline on/off/--format=... are for the timeline builtin */
+        size_t len = strcspn(p, " \t\n");
+        if(*p == '-' || (len == 2 && strncmp(p, "on", 2) == 0) ||
+           (len == 3 && strncmp(p, "off", 3) == 0))
+        {
+            return cmd;
+        }
+        *timeline_requested = 1;
+        
+        /* Create new command string without timeline */
+        char *new_cmd = malloc(strlen(p) + 1);
+        if(new_cmd)
+        {
+            strcpy(new_cmd, p);
+            free(cmd);
+            return new_cmd;
+        }
+    }
+    
+    return cmd;
+}
+
+
+/*
+ * set the positional parameters $0, $1, ... for a script or a -c string.
+ */
+static void set_positional_params(char *name, int argc, char **argv)
+{
+    struct symtab_entry_s *entry = add_to_symtab("0");
+    symtab_entry_setval(entry, name);
+
+    for(int i = 0; i < argc; i++)
+    {
+        char buf[16];
+        sprintf(buf, "%d", i+1);
+        entry = add_to_symtab(buf);
+        symtab_entry_setval(entry, argv[i]);
+    }
+}
+
+
+/*
+ * run a script, or a -c command string, without prompts or history.
+ *
+ * the script file is mmap'd rather than read, and parse_and_execute() runs
+ * each line as soon as it's parsed, so a big script starts running at once.
+ *
+ * returns the exit status of the last command.
+ */
+static int run_noninteractive(int argc, char **argv)
+{
+    struct source_s src;
+
+    /* a script, unlike the interactive shell, can be stopped with ^C or ^Z */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+
+    if(strcmp(argv[1], "-c") == 0)
+    {
+        if(argc < 3)
+        {
+            fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+            return 2;
+        }
+
+        /* mshX -c 'cmds' [name [args...]] */
+        set_positional_params(argc > 3 ? argv[3] : argv[0],
+                              argc > 4 ? argc-4 : 0, argv+4);
+        src.buffer      = argv[2];
+        src.buffer_size = strlen(argv[2]);
+        src.current_pos = INIT_SRC_POS;
+        src.flags       = 0;
+        parse_and_execute(&src);
+        return exit_status;
+    }
+
+    /* mshX script [args...] */
+    if(!source_open_file(&src, argv[1]))
+    {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+        return (errno == ENOENT) ? 127 : 126;
+    }
+
+    set_positional_params(argv[1], argc-2, argv+2);
+    parse_and_execute(&src);
+    source_close(&src);
+    return exit_status;
+}
+
+
+int main(int argc, char **argv)
+{
+    char *cmd;
+
+    initsh();
+
+    if(argc > 1)
+    {
+        exit(run_noninteractive(argc, argv));
+    }
+
+    /* Run jobs in process groups of their own and hand them the terminal */
+    jobs_enable_control();
+
+    /* Pick up the saved history and keep adding to it */
+    history_load();
+    
+    do
+    {
+        /* Report background jobs that finished since the last prompt */
+        jobs_notify();
+        print_prompt1();
+        cmd = read_cmd();
+        if(!cmd)
+        {
+            /* Check if this was EOF or an error */
+            if(feof(stdin))
+            {
+                printf("\n");  /* Print newline before exit on Ctrl+D */
+                exit(EXIT_SUCCESS);
+            }
+            /* Clear any error state and continue (e.g., after signal) */
+            clearerr(stdin);
+            continue;
+        }
+        if(cmd[0] == '\0' || strcmp(cmd, "\n") == 0)
+        {
+            free(cmd);
+            continue;
+        }
+        if(strcmp(cmd, "exit\n") == 0)
+        {
+            free(cmd);
+            break;
+        }
+        
+        /* Expand history references (!! and !n) */
+        char *expanded = history_expand(cmd);
+        if(expanded)
+        {
+            free(cmd);
+            cmd = expanded;
+            /* If expansion resulted in empty string, skip execution */
+            if(cmd[0] == '\0')
+            {
+                free(cmd);
+                continue;
+            }
+        }
+        
+        /* Add command to history (before processing) */
+        history_add(cmd);
+        
+        /* Check for timeline flag (a session-wide timeline is on already) */
+        int timeline_requested = 0;
+        cmd = check_timeline_flag(cmd, &timeline_requested);
+        if(timeline_is_enabled())
+        {
+            timeline_requested = 0;
+        }
+        
+        /* Enable timeline if requested */
+        if(timeline_requested)
+        {
+            timeline_enable(1);
+        }
+        
+	struct source_s src;
+        src.buffer   = cmd;
+        src.buffer_size  = strlen(cmd);
+        src.current_pos   = INIT_SRC_POS;
+        src.flags         = 0;
+        parse_and_execute(&src);
+        
+        /* Disable timeline after execution */
+        if(timeline_requested)
+        {
+            timeline_enable(0);
+        }
+        
+        free(cmd);
+    } while(1);
+    exit(EXIT_SUCCESS);
+}
+
+
+char *read_cmd(void)
+{
+    char *buf = NULL;
+    size_t bufsize = 0;
+    char *ptr = NULL;
+    size_t ptrlen = 0;
+    ssize_t buflen;
+
+    while((buflen = getline(&buf, &bufsize, stdin)) > 0)
+    {
+        if(!ptr)
+        {
+            /* the first line is used as it is */
+            ptr = buf;
+            buf = NULL;
+            bufsize = 0;
+        }
+        else
+        {
+            char *ptr2 = realloc(ptr, ptrlen+buflen+1);
+            if(!ptr2)
+            {
+                fprintf(stderr, "error: failed to alloc buffer: %s\n", strerror(errno));
+                free(ptr);
+                free(buf);
+                return NULL;
+            }
+            ptr = ptr2;
+            memcpy(ptr+ptrlen, buf, buflen+1);
+        }
+
+        if(ptr[ptrlen+buflen-1] == '\n')
+        {
+            if(buflen == 1 || ptr[ptrlen+buflen-2] != '\\')
+            {
+                free(buf);
+                return ptr;
+            }
+            ptr[ptrlen+buflen-2] = '\0';
+            buflen -= 2;
+            print_prompt2();
+        }
+        ptrlen += buflen;
+    }
+    free(buf);
+    return ptr;
+}
+
+
+/*
+ * run every line of src.
+ *
+ * each line is compiled into a plan (or fetched from the plan cache, if the
+ * same text has been run before) and the plan is executed before the next
+ * line is looked at. the tokens, nodes, words and argv arrays used for the
+ * line all come from the command arena, and are freed in one go when the
+ * line is done.
+ */
+int parse_and_execute(struct source_s *src)
+{
+    struct arena_mark_s mark = arena_mark();
+    struct plan_s *plan;
+
+    while((plan = plan_get(src)))
+    {
+        plan_execute(plan);
+        plan_release(plan);
+        arena_release(mark);
+
+        /* don't let finished background jobs linger as zombies */
+        jobs_reap();
+    }
+    arena_release(mark);
+    return 1;
+}
@@ -12,7 +12,19 @@ void initsh(void);
 int dump(int argc, char **argv);
 int cd(int argc, char **argv);
 int dry(int argc, char **argv);
+int exit_builtin(int argc, char **argv);
 int history_builtin(int argc, char **argv);
+int hash_builtin(int argc, char **argv);
+int jobs_builtin(int argc, char **argv);
+int fg_builtin(int argc, char **argv);
+int bg_builtin(int argc, char **argv);
+int wait_builtin(int argc, char **argv);
+int export_builtin(int argc, char **argv);
+int unset_builtin(int argc, char **argv);
+int timeline_builtin(int argc, char **argv);
+
+/* check if str (its first len chars, unless len is -1) is a valid variable name */
+int is_valid_name(const char *str, int len);
 
 /* struct for builtin utilities */
 struct builtin_s
@@ -34,6 +46,7 @@ struct word_s   //working with words in the shell
 };
 struct word_s *make_word(char *str);
 
-void free_all_words(struct word_s *first);
+/* $IFS was set or unset: the field splitter must rebuild its tables */
+void ifs_changed(void);
 
 #endif
\ No newline at end of file
@@ -5,17 +5,13 @@
 #include "mshX.h"
 #include "node.h"
 #include "parser.h"
+#include "arena.h"
 
 
 struct node_s *new_node(enum node_type_e type)
 {
-    struct node_s *node = malloc(sizeof(struct node_s));
+    struct node_s *node = arena_alloc(sizeof(struct node_s));
 
-    if(!node)
-    {
-        return NULL;
-    }
-    
     memset(node, 0, sizeof(struct node_s));
     node->type = type;
     
@@ -60,43 +56,17 @@ void set_node_val_str(struct node_s *node, char *val)
     }
     else
     {
-        char *val2 = malloc(strlen(val)+1);
-    
-    	if(!val2)
-        {
-            node->val.str = NULL;
-        }
-        else
-        {
-            strcpy(val2, val);
-            node->val.str = val2;
-        }
+        node->val.str = arena_strdup(val);
     }
 }
 
 
-void free_node_tree(struct node_s *node)
+/*
+ * point a node's value at a piece of the input text, without copying it.
+ */
+void set_node_val_slice(struct node_s *node, char *text, long len)
 {
-    if(!node)
-    {
-        return;
-    }
-
-    struct node_s *child = node->first_child;
-    
-    while(child)
-    {
-        struct node_s *next = child->next_sibling;
-        free_node_tree(child);
-        child = next;
-    }
-    
-    if(node->val_type == VAL_STR)
-    {
-        if(node->val.str)
-        {
-            free(node->val.str);
-        }
-    }
-    free(node);
-}
\ No newline at end of file
+    node->val_type = VAL_SLICE;
+    node->val.slice.text = text;
+    node->val.slice.len  = len;
+}
@@ -5,8 +5,16 @@ enum node_type_e
 {
     NODE_COMMAND,           /* simple command */
     NODE_VAR,               /* variable name (or simply, a word) */
+    NODE_PIPELINE,          /* commands joined by '|' */
+    NODE_LIST,              /* pipelines joined by ';', '&', '&&' or '||' */
 };
 
+/* values for the val.sint field of NODE_PIPELINE nodes */
+#define PIPELINE_BACKGROUND (1 << 0)    /* the pipeline ends with '&' */
+#define PIPELINE_AND        (1 << 1)    /* the pipeline is followed by '&&' */
+#define PIPELINE_OR         (1 << 2)    /* the pipeline is followed by '||' */
+#define PIPELINE_SEQUENCE   (1 << 3)    /* the pipeline is followed by ';' */
+
 enum val_type_e
 {
     VAL_SINT = 1,       /* signed int */
@@ -17,6 +25,7 @@ enum val_type_e
     VAL_LDOUBLE,        /* long double */
     VAL_CHR,            /* char */
     VAL_STR,            /* str (char pointer) */
+    VAL_SLICE,          /* slice of the input text (not NUL-terminated) */
 };
 
 union symval_u
@@ -29,6 +38,11 @@ union symval_u
     long double        ldouble;
     char               chr;
     char              *str;
+    struct
+    {
+        char *text;
+        long  len;
+    } slice;
 };
 
 struct node_s
@@ -46,7 +60,7 @@ struct node_s
 
 struct  node_s *new_node(enum node_type_e type);
 void    add_child_node(struct node_s *parent, struct node_s *child);
-void    free_node_tree(struct node_s *node);
 void    set_node_val_str(struct node_s *node, char *val);
+void    set_node_val_slice(struct node_s *node, char *text, long len);
 
 #endif
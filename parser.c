@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <string.h>
+#include <stdio.h>
 #include "mshX.h"
 #include "parser.h"
 #include "scanner.h"
@@ -15,11 +16,6 @@ struct node_s *parse_simple_command(struct token_s *tok)
     }
     
     struct node_s *cmd = new_node(NODE_COMMAND);
-    if(!cmd)
-    {
-        free_token(tok);
-        return NULL;
-    }
     
     struct source_s *src = tok->src;
     
@@ -27,41 +23,126 @@ struct node_s *parse_simple_command(struct token_s *tok)
     {
         if(tok->text[0] == '\n')
         {
-            free_token(tok);
             break;
         }
 
         /* Check for logical operators and command separator - stop parsing current command */
-        if(strcmp(tok->text, "&&") == 0 || strcmp(tok->text, "||") == 0)
+        if(token_is(tok, "&&") || token_is(tok, "||"))
         {
             /* Put the operator back for the caller to handle */
             unget_char(src);
             unget_char(src);
-            free_token(tok);
             break;
         }
         
-        if(strcmp(tok->text, ";") == 0 || strcmp(tok->text, "|") == 0 || strcmp(tok->text, "&") == 0)
+        if(token_is(tok, ";") || token_is(tok, "|") || token_is(tok, "&"))
         {
             /* Put the separator/pipe/background back for the caller to handle */
             unget_char(src);
-            free_token(tok);
             break;
         }
 
         struct node_s *word = new_node(NODE_VAR);
-        if(!word)
+        set_node_val_slice(word, tok->text, tok->text_len);
+        add_child_node(cmd, word);
+    } while((tok = tokenize(src)) != &eof_token);
+
+    return cmd;
+}
+
+
+/*
+ * parse one line of input (up to and including the next unquoted newline)
+ * into a NODE_LIST tree of NODE_PIPELINE nodes, each holding the
+ * NODE_COMMAND nodes of its stages.
+ *
+ * returns the list (with no children for a blank line), or NULL at the end
+ * of input.
+ */
+struct node_s *parse_line(struct source_s *src)
+{
+    struct token_s *tok = tokenize(src);
+
+    if(tok == &eof_token)
+    {
+        return NULL;
+    }
+
+    struct node_s *list = new_node(NODE_LIST);
+    struct node_s *pipeline = NULL;
+
+    while(tok != &eof_token)
+    {
+        if(tok->text[0] == '\n')
         {
-            free_node_tree(cmd);
-            free_token(tok);
-            return NULL;
+            break;
+        }
+
+        int flags = 0;
+        if(token_is(tok, "|"))
+        {
+            /* the next command joins the current pipeline */
+            tok = tokenize(src);
+            if(tok == &eof_token || tok->text[0] == '\n' || !pipeline)
+            {
+                fprintf(stderr, "error: expected command after pipe\n");
+                pipeline = NULL;
+            }
+            continue;
+        }
+        else if(token_is(tok, "&&"))
+        {
+            flags = PIPELINE_AND;
+        }
+        else if(token_is(tok, "||"))
+        {
+            flags = PIPELINE_OR;
+        }
+        else if(token_is(tok, ";"))
+        {
+            flags = PIPELINE_SEQUENCE;
+        }
+        else if(token_is(tok, "&"))
+        {
+            flags = PIPELINE_BACKGROUND;
         }
-        set_node_val_str(word, tok->text);
-        add_child_node(cmd, word);
 
-        free_token(tok);
+        if(flags)
+        {
+            /* the operator ends the current pipeline */
+            if(pipeline)
+            {
+                pipeline->val.sint |= flags;
+                pipeline = NULL;
+            }
+            tok = tokenize(src);
+            continue;
+        }
 
-    } while((tok = tokenize(src)) != &eof_token);
+        /*
+         * a command word. parse_simple_command() stops at (and puts back) the
+         * next operator, or consumes the newline that ends the line.
+         */
+        struct node_s *cmd = parse_simple_command(tok);
+        if(cmd && cmd->first_child)
+        {
+            if(!pipeline)
+            {
+                pipeline = new_node(NODE_PIPELINE);
+                pipeline->val_type = VAL_SINT;
+                add_child_node(list, pipeline);
+            }
+            add_child_node(pipeline, cmd);
+        }
 
-    return cmd;
+        /* did the command end with the newline? */
+        if(src->current_pos >= 0 && src->current_pos < src->buffer_size &&
+           src->buffer[src->current_pos] == '\n')
+        {
+            break;
+        }
+        tok = tokenize(src);
+    }
+
+    return list;
 }
\ No newline at end of file
@@ -5,5 +5,6 @@
 #include "source.h"     /* struct source_s */
 
 struct node_s *parse_simple_command(struct token_s *tok);
+struct node_s *parse_line(struct source_s *src);
 
 #endif
\ No newline at end of file
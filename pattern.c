@@ -10,9 +10,13 @@
 #include <regex.h>
 #include <fnmatch.h>
 #include <locale.h>
-#include <glob.h>
 #include <sys/stat.h>
 #include "mshX.h"
+#include "symtab/symtab.h"
+#include "dircache.h"
+#include "globmatch.h"
+#include "dirwalk.h"
+#include "workpool.h"
 
 
 /*
@@ -53,49 +57,22 @@ int has_glob_chars(char *p, size_t len)
 /*
  * find the shortest or longest prefix of str that matches
  * pattern, depending on the value of longest.
- * return value is the index of 1 after the last character
- * in the prefix, i.e. where you should put a '\0' to get 
- * the prefix.
+ * return value is the length of the prefix (which can be 0,
+ * if the pattern matches the empty string), or -1 if no
+ * prefix matches.
  */
 int match_prefix(char *pattern, char *str, int longest)
 {
     if(!pattern || !str)
     {
-        return 0;
-    }
-    char *s = str+1;
-    char  c = *s;
-    char *smatch = NULL;
-    char *lmatch = NULL;
-    while(c)
-    {
-        *s = '\0';
-        if(fnmatch(pattern, str, 0) == 0)
-        {
-            if(!smatch)
-            {
-                if(!longest)
-                {
-                    *s = c;
-                    return s-str; 
-                }
-                smatch = s;  
-            }
-            lmatch = s;   
-        }
-        *s = c;
-        c = *(++s);
+        return -1;
     }
-    /* check the result of the comparison */
-    if(lmatch)
+    struct globmatch_s *m = globmatch_get(pattern);
+    if(!m)
     {
-        return lmatch-str;
+        return -1;
     }
-    if(smatch)
-    {
-        return smatch-str;
-    }
-    return 0;
+    return globmatch_prefix(m, str, strlen(str), longest);
 }
 
 
@@ -103,73 +80,355 @@ int match_prefix(char *pattern, char *str, int longest)
  * find the shortest or longest suffix of str that matches
  * pattern, depending on the value of longest.
  * return value is the index of the first character in the
- * matched suffix.
+ * matched suffix (the length of str if the empty suffix
+ * matched), or -1 if no suffix matches.
  */
 int match_suffix(char *pattern, char *str, int longest)
 {
     if(!pattern || !str)
+    {
+        return -1;
+    }
+    struct globmatch_s *m = globmatch_get(pattern);
+    if(!m)
+    {
+        return -1;
+    }
+    size_t len = strlen(str);
+    long res = globmatch_suffix(m, str, len, longest);
+    return (res < 0) ? -1 : (int)(len - res);
+}
+
+
+/* A growing list of paths, always with room for a NULL at the end */
+struct path_list_s
+{
+    char **paths;
+    size_t count, size;
+};
+
+/* One step of get_filename_matches(): a pattern component matched in a set of directories */
+struct glob_step_s
+{
+    char *comp;                 /* the component (unescaped if literal) */
+    struct globmatch_s *matcher;    /* the component compiled, if it isn't literal */
+    int literal;                /* it has no glob characters */
+    int last;                   /* it is the last component of the pattern */
+    int dirs_only;              /* the pattern ended in '/' */
+    char **bases;               /* the directories, each "" (for .) or ending in '/' */
+    struct path_list_s *out;    /* what matched in each of bases */
+};
+
+
+static int add_path(struct path_list_s *list, char *path)
+{
+    if(!path)
     {
         return 0;
     }
-    char *s = str+strlen(str)-1;
-    char *smatch = NULL;
-    char *lmatch = NULL;
-    while(s > str)
+    if(list->count + 1 >= list->size)
     {
-        if(fnmatch(pattern, str, 0) == 0)
+        size_t size = list->size ? list->size * 2 : 16;
+        char **paths = realloc(list->paths, size * sizeof(char *));
+        if(!paths)
         {
-            if(!smatch)
-            {
-                if(!longest)
-                {
-                    return s-str;
-                }
-                smatch = s;
-            }
-            lmatch = s;
+            free(path);
+            return 0;
+        }
+        list->paths = paths;
+        list->size = size;
+    }
+    list->paths[list->count++] = path;
+    list->paths[list->count] = NULL;
+    return 1;
+}
+
+
+static void free_paths(struct path_list_s *list)
+{
+    for(size_t i = 0; i < list->count; i++)
+    {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = list->size = 0;
+}
+
+
+/* make dir followed by name, and a '/' if slash is set */
+static char *join_path(char *dir, size_t dirlen, char *name, int slash)
+{
+    size_t len = strlen(name);
+    char *path = malloc(dirlen + len + 2);
+    if(!path)
+    {
+        return NULL;
+    }
+    memcpy(path, dir, dirlen);
+    memcpy(path + dirlen, name, len);
+    if(slash)
+    {
+        path[dirlen + len++] = '/';
+    }
+    path[dirlen + len] = '\0';
+    return path;
+}
+
+
+/* remove the backslashes from a pattern component that has no glob characters */
+static void unescape_comp(char *comp)
+{
+    char *p = comp;
+    while(*comp)
+    {
+        if(*comp == '\\' && comp[1])
+        {
+            comp++;
         }
-        s--;
+        *p++ = *comp++;
     }
-    /* check the result of the comparison */
-    if(lmatch)
+    *p = '\0';
+}
+
+
+/*
+ * match a step's component in its i-th directory. this runs on the work
+ * pool's threads, so it sticks to malloc() and the (locked) dircache.
+ */
+static void match_in_dir(void *arg, int i)
+{
+    struct glob_step_s *step = arg;
+    char *base = step->bases[i];
+    size_t baselen = strlen(base);
+    int want_dir = !step->last || step->dirs_only;
+    struct stat st;
+
+    if(step->literal)
     {
-        return lmatch-str;
+        /* only the last component is checked: a missing directory on the way fails that too */
+        char *path = join_path(base, baselen, step->comp, want_dir);
+        if(step->last &&
+           (step->dirs_only ? stat(path, &st) : lstat(path, &st)) < 0)
+        {
+            free(path);
+            return;
+        }
+        add_path(&step->out[i], path);
+        return;
     }
-    if(smatch)
+
+    struct dircache_dir_s *dir = dircache_get(baselen ? base : ".");
+    if(!dir)
     {
-        return smatch-str;
+        return;
+    }
+
+    for(size_t j = 0; j < dir->count; j++)
+    {
+        struct dircache_entry_s *ent = &dir->entries[j];
+        if(step->matcher ? !globmatch_match(step->matcher, ent->name, GLOBMATCH_PERIOD)
+                         : fnmatch(step->comp, ent->name, FNM_PERIOD) != 0)
+        {
+            continue;
+        }
+
+        char *path = join_path(base, baselen, ent->name, want_dir);
+        if(!path)
+        {
+            continue;
+        }
+
+        /* d_type says what it is, unless it's a symlink or the filesystem won't tell */
+        if(want_dir && ent->type != DT_DIR &&
+           ((ent->type != DT_LNK && ent->type != DT_UNKNOWN) ||
+            stat(path, &st) < 0 || !S_ISDIR(st.st_mode)))
+        {
+            free(path);
+            continue;
+        }
+        add_path(&step->out[i], path);
     }
-    return 0;
+}
+
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcoll(*(char * const *)a, *(char * const *)b);
 }
 
 
 /*
- * perform pathname (or filename) expansion, matching files in the given *dir to the
- * given *path, which is treated as a regex pattern that specifies which filename(s)
- * we should match.
+ * perform pathname (or filename) expansion, matching the given *pattern one
+ * component at a time: each directory reached so far is listed (through the
+ * directory cache) and its entries matched against the next component, with
+ * the directories shared out between the work pool's threads.  Leading dots
+ * have to be matched explicitly, and . and .. are never matched.  With
+ * $GLOBSTAR set, a component that is just ** matches any number of
+ * directories (none included), and the trees below are walked by dirwalk().
  *
- * returns a char ** pointer to the list of matched filenames, or NULL if nothing matched.
+ * returns a NULL-terminated, sorted list of the matched paths, which the
+ * caller frees with free_filename_matches(), or NULL if nothing matched.
+ * the number of matches is stored in *count.
  */
-char **get_filename_matches(char *pattern, glob_t *matches)
+char **get_filename_matches(char *pattern, size_t *count)
 {
-    /* to guard our caller from trying to free an unused struct in case of expansion failure */
-    matches->gl_pathc = 0;
-    matches->gl_pathv = NULL;
+    *count = 0;
+    if(!pattern || !*pattern)
+    {
+        return NULL;
+    }
 
-    if(!pattern)
+    char *pat = strdup(pattern);
+    if(!pat)
     {
         return NULL;
     }
 
-    /* perform the match */
-    int res = glob(pattern, 0, NULL, matches);
+    struct path_list_s bases = { NULL, 0, 0 };
+    add_path(&bases, strdup(*pat == '/' ? "/" : ""));
+
+    /* a trailing slash means we only want directories */
+    size_t len = strlen(pat);
+    int dirs_only = 0;
+    while(len > 1 && pat[len-1] == '/')
+    {
+        pat[--len] = '\0';
+        dirs_only = 1;
+    }
+
+    struct symtab_entry_s *entry = get_symtab_entry("GLOBSTAR");
+    int globstar = entry && entry->val && *entry->val && strcmp(entry->val, "0") != 0;
+
+    dircache_begin();
+
+    char *p = pat;
+    while(*p == '/')
+    {
+        p++;
+    }
+
+    while(*p && bases.count)
+    {
+        char *comp = p;
+        char *end = strchr(p, '/');
+        if(end)
+        {
+            *end = '\0';
+            for(p = end+1; *p == '/'; p++)
+            {
+                ;
+            }
+        }
+        else
+        {
+            p = comp + strlen(comp);
+        }
+
+        if(globstar && strcmp(comp, "**") == 0)
+        {
+            /* ** followed by another ** walks the same tree: leave it to the last one */
+            if(p[0] == '*' && p[1] == '*' && (p[2] == '/' || p[2] == '\0'))
+            {
+                continue;
+            }
+
+            size_t nfound;
+            struct path_list_s next = { NULL, 0, 0 };
+            if(*p)
+            {
+                /* the directories to match the rest in, the ones we're in included */
+                char **found = dirwalk(bases.paths, bases.count, DIRWALK_DIRS | DIRWALK_BASES, &nfound);
+                next.paths = found;
+                next.count = nfound;
+                next.size = found ? nfound + 1 : 0;
+            }
+            else
+            {
+                /* everything below (like bash, a directory we're in is a match too) */
+                char **found = dirwalk(bases.paths, bases.count,
+                                       dirs_only ? (DIRWALK_DIRS | DIRWALK_LINKS) : 0, &nfound);
+                for(size_t i = 0; i < bases.count; i++)
+                {
+                    if(*bases.paths[i])
+                    {
+                        add_path(&next, bases.paths[i]);
+                        bases.paths[i] = strdup("");
+                    }
+                }
+                for(size_t i = 0; i < nfound; i++)
+                {
+                    add_path(&next, found[i]);
+                }
+                free(found);
+            }
+            free_paths(&bases);
+            bases = next;
+            continue;
+        }
+
+        struct glob_step_s step;
+        step.comp = comp;
+        step.literal = !has_glob_chars(comp, strlen(comp));
+        step.last = (*p == '\0');
+        step.dirs_only = dirs_only;
+        step.bases = bases.paths;
+        step.out = calloc(bases.count, sizeof(struct path_list_s));
+        if(!step.out)
+        {
+            free_paths(&bases);
+            break;
+        }
+        if(step.literal)
+        {
+            unescape_comp(comp);
+        }
+        step.matcher = step.literal ? NULL : globmatch_get(comp);
+
+        workpool_for(bases.count, match_in_dir, &step);
+
+        /* the matches become the next step's directories, in order */
+        struct path_list_s next = { NULL, 0, 0 };
+        for(size_t i = 0; i < bases.count; i++)
+        {
+            for(size_t j = 0; j < step.out[i].count; j++)
+            {
+                add_path(&next, step.out[i].paths[j]);
+            }
+            free(step.out[i].paths);
+        }
+        free(step.out);
+        free_paths(&bases);
+        bases = next;
+    }
+
+    dircache_end();
+    free(pat);
 
-    /* return the result */
-    if(res != 0)
+    if(bases.count == 0)
     {
-        globfree(matches);
+        free_paths(&bases);
         return NULL;
     }
 
-    return matches->gl_pathv;
-}
\ No newline at end of file
+    qsort(bases.paths, bases.count, sizeof(char *), compare_paths);
+    *count = bases.count;
+    return bases.paths;
+}
+
+
+/*
+ * free the list returned by get_filename_matches().
+ */
+void free_filename_matches(char **matches)
+{
+    if(!matches)
+    {
+        return;
+    }
+    for(char **m = matches; *m; m++)
+    {
+        free(*m);
+    }
+    free(matches);
+}
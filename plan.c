@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mshX.h"
+#include "node.h"
+#include "parser.h"
+#include "executor.h"
+#include "plan.h"
+
+/* extern declaration for exit status (defined in wordexp.c) */
+extern int exit_status;
+
+int has_glob_chars(char *p, size_t len);
+
+/* Number of buckets in the plan cache */
+#define PLAN_CACHE_BUCKETS  64
+
+/* Cached plans, hashed by source text and kept in LRU order */
+static struct plan_s *plan_cache[PLAN_CACHE_BUCKETS];
+static struct plan_s *lru_first = NULL, *lru_last = NULL;
+static int plan_cache_count = 0;
+
+
+/*
+ * hash a piece of source text.
+ */
+static unsigned int hash_text(const char *text, size_t len)
+{
+    unsigned int h = 5381;
+
+    while(len--)
+    {
+        h = (h << 5) + h + (unsigned char)*text++;
+    }
+
+    return h;
+}
+
+
+/*
+ * return the index of the next unread char in src.
+ */
+static long src_next_pos(struct source_s *src)
+{
+    return (src->current_pos == INIT_SRC_POS) ? 0 : src->current_pos+1;
+}
+
+
+/*
+ * find out which expansions a word needs.
+ */
+static int classify_word(char *str)
+{
+    int flags = 0;
+
+    if(has_glob_chars(str, strlen(str)))
+    {
+        flags |= WORD_GLOB;
+    }
+
+    for(char *p = str; *p; p++)
+    {
+        switch(*p)
+        {
+            case '~':
+                flags |= WORD_TILDE;
+                break;
+
+            case '\\':
+            case '\'':
+            case  '"':
+                flags |= WORD_QUOTED;
+                break;
+
+            case  '`':
+                flags |= WORD_CMDSUB;
+                break;
+
+            case  '$':
+                if(p[1] == '(')
+                {
+                    flags |= (p[2] == '(') ? WORD_ARITH : WORD_CMDSUB;
+                }
+                else
+                {
+                    flags |= WORD_PARAM;
+                }
+                break;
+        }
+    }
+
+    return flags;
+}
+
+
+/*
+ * check if a command word is a redirection operator.
+ *
+ * returns the REDIRECT_* type, or -1 for a normal word.
+ */
+static int redirect_type(struct node_s *word)
+{
+    char *text = word->val.slice.text;
+
+    switch(word->val.slice.len)
+    {
+        case 1:
+            if(text[0] == '<')
+            {
+                return REDIRECT_INPUT;
+            }
+            if(text[0] == '>')
+            {
+                return REDIRECT_OUTPUT;
+            }
+            break;
+
+        case 2:
+            if(text[0] == '>' && text[1] == '>')
+            {
+                return REDIRECT_APPEND;
+            }
+            break;
+    }
+    return -1;
+}
+
+
+/*
+ * copy a word's text into the plan's string pool.
+ *
+ * returns the copy.
+ */
+static char *copy_word(struct node_s *word, char **pstr)
+{
+    char *str = *pstr;
+
+    memcpy(str, word->val.slice.text, word->val.slice.len);
+    str[word->val.slice.len] = '\0';
+    *pstr = str+word->val.slice.len+1;
+    return str;
+}
+
+
+/*
+ * free the memory used by a plan.
+ */
+static void plan_free(struct plan_s *plan)
+{
+    free(plan->text);
+    free(plan->ops);
+    free(plan->cmds);
+    free(plan->words);
+    free(plan->redirects);
+    free(plan->strings);
+    free(plan);
+}
+
+
+/*
+ * flatten a NODE_LIST tree into a plan.
+ *
+ * returns the malloc'd plan, or NULL if there is insufficient memory.
+ */
+static struct plan_s *plan_compile(struct node_s *list)
+{
+    struct plan_s *plan = malloc(sizeof(struct plan_s));
+    if(!plan)
+    {
+        return NULL;
+    }
+    memset(plan, 0, sizeof(struct plan_s));
+
+    /* first pass: count everything, so each array is alloc'd only once */
+    size_t strings_len = 0;
+    for(struct node_s *pipe = list->first_child; pipe; pipe = pipe->next_sibling)
+    {
+        plan->nops++;
+        for(struct node_s *cmd = pipe->first_child; cmd; cmd = cmd->next_sibling)
+        {
+            plan->ncmds++;
+            for(struct node_s *word = cmd->first_child; word; word = word->next_sibling)
+            {
+                if(redirect_type(word) >= 0)
+                {
+                    /* a redirection operator with no filename is ignored */
+                    if(!(word = word->next_sibling))
+                    {
+                        break;
+                    }
+                    plan->nredirects++;
+                    strings_len += word->val.slice.len+1;
+                    continue;
+                }
+                plan->nwords++;
+                strings_len += word->val.slice.len+1;
+            }
+        }
+    }
+
+    plan->ops       = malloc((plan->nops+1) * sizeof(struct plan_op_s));
+    plan->cmds      = malloc((plan->ncmds+1) * sizeof(struct plan_cmd_s));
+    plan->words     = malloc((plan->nwords+1) * sizeof(struct plan_word_s));
+    plan->redirects = malloc((plan->nredirects+1) * sizeof(struct plan_redirect_s));
+    plan->strings   = malloc(strings_len+1);
+    if(!plan->ops || !plan->cmds || !plan->words || !plan->redirects || !plan->strings)
+    {
+        plan_free(plan);
+        return NULL;
+    }
+
+    /* second pass: fill in the arrays */
+    struct plan_op_s       *op    = plan->ops;
+    struct plan_cmd_s      *pcmd  = plan->cmds;
+    struct plan_word_s     *pword = plan->words;
+    struct plan_redirect_s *predir = plan->redirects;
+    char                   *str   = plan->strings;
+
+    for(struct node_s *pipe = list->first_child; pipe; pipe = pipe->next_sibling, op++)
+    {
+        int flags = pipe->val.sint;
+
+        op->ncmds      = pipe->children;
+        op->cmds       = pcmd;
+        op->background = (flags & PIPELINE_BACKGROUND) ? 1 : 0;
+        op->link       = (flags & PIPELINE_AND) ? LINK_AND :
+                         (flags & PIPELINE_OR ) ? LINK_OR  : LINK_SEQ;
+        if(flags & PIPELINE_SEQUENCE)
+        {
+            plan->has_sequence = 1;
+        }
+
+        for(struct node_s *cmd = pipe->first_child; cmd; cmd = cmd->next_sibling, pcmd++)
+        {
+            pcmd->nwords     = 0;
+            pcmd->words      = pword;
+            pcmd->nredirects = 0;
+            pcmd->redirects  = predir;
+
+            /* the command's words... */
+            for(struct node_s *word = cmd->first_child; word; word = word->next_sibling)
+            {
+                if(redirect_type(word) >= 0)
+                {
+                    word = word->next_sibling;
+                    if(!word)
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                pword->text  = copy_word(word, &str);
+                pword->flags = classify_word(pword->text);
+                pword++;
+                pcmd->nwords++;
+            }
+
+            /* ...and its redirections */
+            for(struct node_s *word = cmd->first_child; word; word = word->next_sibling)
+            {
+                int type = redirect_type(word);
+                if(type < 0)
+                {
+                    continue;
+                }
+                if(!(word = word->next_sibling))
+                {
+                    break;
+                }
+                predir->type         = type;
+                predir->target.text  = copy_word(word, &str);
+                predir->target.flags = classify_word(predir->target.text);
+                predir++;
+                pcmd->nredirects++;
+            }
+        }
+    }
+
+    return plan;
+}
+
+
+/*
+ * unlink a plan from the cache.
+ */
+static void plan_cache_remove(struct plan_s *plan)
+{
+    struct plan_s **pp = &plan_cache[plan->hash % PLAN_CACHE_BUCKETS];
+    while(*pp && *pp != plan)
+    {
+        pp = &(*pp)->hash_next;
+    }
+    if(*pp)
+    {
+        *pp = plan->hash_next;
+    }
+
+    if(plan->lru_prev)
+    {
+        plan->lru_prev->lru_next = plan->lru_next;
+    }
+    else
+    {
+        lru_first = plan->lru_next;
+    }
+    if(plan->lru_next)
+    {
+        plan->lru_next->lru_prev = plan->lru_prev;
+    }
+    else
+    {
+        lru_last = plan->lru_prev;
+    }
+
+    plan->hash_next = plan->lru_prev = plan->lru_next = NULL;
+    plan_cache_count--;
+}
+
+
+/*
+ * add a plan to the front of the cache's LRU list.
+ */
+static void plan_cache_add(struct plan_s *plan)
+{
+    /* make room by dropping the least recently used plan */
+    if(plan_cache_count >= PLAN_CACHE_MAX && lru_last)
+    {
+        struct plan_s *old = lru_last;
+        plan_cache_remove(old);
+        plan_release(old);
+    }
+
+    unsigned int bucket = plan->hash % PLAN_CACHE_BUCKETS;
+    plan->hash_next = plan_cache[bucket];
+    plan_cache[bucket] = plan;
+
+    plan->lru_prev = NULL;
+    plan->lru_next = lru_first;
+    if(lru_first)
+    {
+        lru_first->lru_prev = plan;
+    }
+    lru_first = plan;
+    if(!lru_last)
+    {
+        lru_last = plan;
+    }
+
+    plan->refs++;
+    plan_cache_count++;
+}
+
+
+/*
+ * find the plan compiled from the given text.
+ */
+static struct plan_s *plan_cache_lookup(const char *text, size_t len, unsigned int hash)
+{
+    struct plan_s *plan = plan_cache[hash % PLAN_CACHE_BUCKETS];
+
+    while(plan)
+    {
+        if(plan->hash == hash && plan->text_len == len &&
+           memcmp(plan->text, text, len) == 0)
+        {
+            return plan;
+        }
+        plan = plan->hash_next;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * get the plan for the next line of src.
+ *
+ * the cache is keyed by the text up to (and including) the next newline. a
+ * plan is only cached under the exact text it was compiled from, and parsing
+ * always stops at the newline that ends a line, so a hit is always the plan
+ * the parser would have produced.
+ *
+ * returns the plan (release it with plan_release()), or NULL at the end of
+ * input.
+ */
+struct plan_s *plan_get(struct source_s *src)
+{
+    skip_white_spaces(src);
+
+    long start = src_next_pos(src);
+    if(start >= src->buffer_size)
+    {
+        return NULL;
+    }
+
+    char  *text = src->buffer+start;
+    char  *nl   = memchr(text, '\n', src->buffer_size-start);
+    size_t len  = nl ? (size_t)(nl-text)+1 : (size_t)(src->buffer_size-start);
+    unsigned int hash = hash_text(text, len);
+
+    struct plan_s *plan = plan_cache_lookup(text, len, hash);
+    if(plan)
+    {
+        /* move to the front of the LRU list (keeping the cache's reference) */
+        plan_cache_remove(plan);
+        plan_cache_add(plan);
+        plan->refs--;
+
+        src->current_pos = start+len-1;
+        plan->refs++;
+        return plan;
+    }
+
+    /* cache miss. parse the line and compile it */
+    struct node_s *list = parse_line(src);
+    if(!list)
+    {
+        return NULL;
+    }
+
+    plan = plan_compile(list);
+    if(!plan)
+    {
+        fprintf(stderr, "error: insufficient memory to compile command\n");
+        return NULL;
+    }
+
+    /* remember the text we've actually consumed, which is the cache key */
+    len = src_next_pos(src)-start;
+    if(start+(long)len > src->buffer_size)
+    {
+        len = src->buffer_size-start;
+    }
+    plan->text = malloc(len+1);
+    if(plan->text)
+    {
+        memcpy(plan->text, text, len);
+        plan->text[len] = '\0';
+        plan->text_len  = len;
+        plan->hash      = hash_text(text, len);
+        plan_cache_add(plan);
+    }
+
+    plan->refs++;
+    return plan;
+}
+
+
+/*
+ * drop a reference to a plan, freeing it when it's no longer used.
+ */
+void plan_release(struct plan_s *plan)
+{
+    if(plan && --plan->refs <= 0)
+    {
+        plan_free(plan);
+    }
+}
+
+
+/*
+ * forget all cached plans.
+ */
+void plan_cache_clear(void)
+{
+    while(lru_first)
+    {
+        struct plan_s *plan = lru_first;
+        plan_cache_remove(plan);
+        plan_release(plan);
+    }
+}
+
+
+/*
+ * run the pipelines of a plan, honouring the '&&' and '||' operators
+ * joining them.
+ *
+ * returns 1 if all the pipelines that ran succeeded in starting, 0 otherwise.
+ */
+int plan_execute(struct plan_s *plan)
+{
+    int res = 1;
+
+    if(current_exec_mode == EXEC_DRY && plan->has_sequence)
+    {
+        dry_print_sequence();
+    }
+
+    for(int i = 0; i < plan->nops; i++)
+    {
+        struct plan_op_s *op = &plan->ops[i];
+
+        /* skip this pipeline if the previous one decided so */
+        if(i > 0)
+        {
+            enum plan_link_e link = plan->ops[i-1].link;
+            if((link == LINK_AND && exit_status != 0) ||
+               (link == LINK_OR  && exit_status == 0))
+            {
+                continue;
+            }
+        }
+
+        if(op->background)
+        {
+            res &= do_pipeline_background(op->cmds, op->ncmds);
+        }
+        else
+        {
+            res &= do_pipeline(op->cmds, op->ncmds);
+        }
+    }
+
+    return res;
+}
@@ -0,0 +1,102 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stddef.h>
+#include "source.h"     /* struct source_s */
+
+/*
+ * A plan is the compiled form of one line of input: the node_s trees built
+ * by the parser are flattened into arrays of pre-classified words,
+ * pre-split redirections, commands and pipelines, so that running the same
+ * text again (history replays, function bodies, loop bodies) doesn't need
+ * the scanner or the parser, and the executor doesn't need to strcmp()
+ * every word looking for redirection operators.
+ */
+
+/* flags telling which expansions a word needs (0 means a literal word) */
+#define WORD_TILDE      (1 << 0)    /* has a '~' that may start a tilde prefix */
+#define WORD_PARAM      (1 << 1)    /* has a $var or ${...} parameter expansion */
+#define WORD_CMDSUB     (1 << 2)    /* has a $(...) or `...` command substitution */
+#define WORD_ARITH      (1 << 3)    /* has a $((...)) arithmetic expansion */
+#define WORD_GLOB       (1 << 4)    /* has pathname expansion chars */
+#define WORD_QUOTED     (1 << 5)    /* has quotes or backslashes to remove */
+
+/* Redirection types */
+#define REDIRECT_INPUT    0   /* < */
+#define REDIRECT_OUTPUT   1   /* > */
+#define REDIRECT_APPEND   2   /* >> */
+
+struct plan_word_s
+{
+    char  *text;                /* word text, as typed */
+    int    flags;               /* expansions this word needs */
+};
+
+struct plan_redirect_s
+{
+    int    type;                /* type of redirection */
+    struct plan_word_s target;  /* target filename (before expansion) */
+};
+
+/* a simple command */
+struct plan_cmd_s
+{
+    int    nwords;
+    struct plan_word_s *words;
+    int    nredirects;
+    struct plan_redirect_s *redirects;
+};
+
+/* how an op is joined to the op that follows it */
+enum plan_link_e
+{
+    LINK_SEQ,                   /* ; & or end of line */
+    LINK_AND,                   /* && */
+    LINK_OR,                    /* || */
+};
+
+/* a pipeline: one or more simple commands joined by '|' */
+struct plan_op_s
+{
+    int    ncmds;
+    struct plan_cmd_s *cmds;    /* points into the plan's cmds array */
+    int    background;          /* the pipeline ends with '&' */
+    enum   plan_link_e link;
+};
+
+struct plan_s
+{
+    char  *text;                /* source text the plan was compiled from */
+    size_t text_len;
+    unsigned int hash;          /* hash of text, for the plan cache */
+    int    has_sequence;        /* the text has a ';' (for dry-run output) */
+    int    nops;
+    struct plan_op_s *ops;
+    int    ncmds;
+    struct plan_cmd_s *cmds;
+    int    nwords;
+    struct plan_word_s *words;
+    int    nredirects;
+    struct plan_redirect_s *redirects;
+    char  *strings;             /* all word texts, NUL-separated */
+    int    refs;                /* users of this plan, the cache included */
+    struct plan_s *hash_next;   /* next plan in the same cache bucket */
+    struct plan_s *lru_prev, *lru_next;
+};
+
+/* Maximum number of plans kept in the plan cache */
+#define PLAN_CACHE_MAX  128
+
+/* Get the plan for the next line of src, compiling it on a cache miss */
+struct plan_s *plan_get(struct source_s *src);
+
+/* Drop a reference to a plan returned by plan_get() */
+void plan_release(struct plan_s *plan);
+
+/* Run a plan, returns 1 on success, 0 on failure */
+int plan_execute(struct plan_s *plan);
+
+/* Forget all cached plans */
+void plan_cache_clear(void);
+
+#endif
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE         /* splice() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "relay.h"
+#include "builtins/timeline.h"
+
+
+static void *relay_main(void *arg);
+
+
+struct relay_s *relay_new(int nedges)
+{
+    struct relay_s *relay = calloc(1, sizeof(struct relay_s) + nedges * sizeof(struct relay_edge_s));
+    sigset_t all, old;
+
+    if(!relay || sem_init(&relay->go, 0, 0) < 0)
+    {
+        free(relay);
+        return NULL;
+    }
+    relay->nedges = nedges;
+    for(int i = 0; i < nedges; i++)
+    {
+        relay->edges[i].in = relay->edges[i].out = -1;
+    }
+
+    /*
+     * the thread takes no signals: SIGINT and friends are the shell's, and
+     * a splice() to a pipe whose reader is gone must give us EPIPE, not
+     * kill the shell with SIGPIPE.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int res = pthread_create(&relay->thread, NULL, relay_main, relay);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(res != 0)
+    {
+        sem_destroy(&relay->go);
+        free(relay);
+        return NULL;
+    }
+    return relay;
+}
+
+
+/*
+ * close an edge: the writer gets EOF on its next write (or SIGPIPE) if the
+ * reader went away, and the reader gets EOF once the writer is done.
+ */
+static void close_edge(struct relay_edge_s *edge, uint64_t now)
+{
+    close(edge->in);
+    close(edge->out);
+    edge->in = edge->out = -1;
+    edge->end_ns = now;
+}
+
+
+/*
+ * move what's in the writer's pipe to the reader's pipe. when the reader's
+ * pipe fills up we go on to wait for room in it, else for more data.
+ * returns 0 once the edge is closed.
+ */
+static int move_data(struct relay_edge_s *edge, uint64_t now)
+{
+    ssize_t n = splice(edge->in, NULL, edge->out, NULL, RELAY_SPLICE_MAX,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if(n > 0)
+    {
+        edge->bytes += n;
+        edge->waiting_out = 0;
+    }
+    else if(n == 0)
+    {
+        /* the writer is done */
+        close_edge(edge, now);
+        return 0;
+    }
+    else if(errno == EAGAIN)
+    {
+        /* we were told there's data, so it's the reader's pipe that is full */
+        edge->waiting_out = 1;
+    }
+    else if(errno != EINTR)
+    {
+        /* EPIPE: the reader went away */
+        close_edge(edge, now);
+        return 0;
+    }
+
+    edge->since_ns = now;
+    return 1;
+}
+
+
+/*
+ * the relay loop: one poll() over every open edge, each waiting either for
+ * data from its writer or for room for it in its reader's pipe. the time
+ * between a wait starting and poll() saying it's over goes to empty_ns or
+ * full_ns.
+ */
+static void *relay_main(void *arg)
+{
+    struct relay_s *relay = arg;
+
+    while(sem_wait(&relay->go) < 0 && errno == EINTR)
+    {
+        ;
+    }
+
+    int nedges = relay->nedges;
+    int open_edges = nedges;
+    struct pollfd *fds = malloc((nedges ? nedges : 1) * sizeof(struct pollfd));
+    uint64_t now = timeline_now();
+
+    for(int i = 0; i < nedges; i++)
+    {
+        relay->edges[i].since_ns = now;
+    }
+
+    while(fds && open_edges > 0)
+    {
+        for(int i = 0; i < nedges; i++)
+        {
+            struct relay_edge_s *edge = &relay->edges[i];
+            if(edge->in < 0)
+            {
+                fds[i].fd = -1;
+            }
+            else
+            {
+                fds[i].fd = edge->waiting_out ? edge->out : edge->in;
+                fds[i].events = edge->waiting_out ? POLLOUT : POLLIN;
+            }
+            fds[i].revents = 0;
+        }
+
+        if(poll(fds, nedges, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        now = timeline_now();
+        for(int i = 0; i < nedges; i++)
+        {
+            struct relay_edge_s *edge = &relay->edges[i];
+            if(edge->in < 0 || !fds[i].revents)
+            {
+                continue;
+            }
+
+            if(edge->waiting_out)
+            {
+                edge->full_ns += now - edge->since_ns;
+                if(!(fds[i].revents & POLLOUT))
+                {
+                    /* POLLERR: nobody reads the other end any more */
+                    close_edge(edge, now);
+                    open_edges--;
+                    continue;
+                }
+            }
+            else
+            {
+                edge->empty_ns += now - edge->since_ns;
+            }
+
+            if(!move_data(edge, now))
+            {
+                open_edges--;
+            }
+        }
+    }
+
+    /* if poll() failed, give the stages EOF rather than leave them hanging */
+    for(int i = 0; i < nedges; i++)
+    {
+        if(relay->edges[i].in >= 0)
+        {
+            close_edge(&relay->edges[i], now);
+        }
+    }
+    free(fds);
+
+    /* nobody is going to join us (see relay_abandon) */
+    if(atomic_exchange(&relay->orphaned, 1))
+    {
+        relay_free(relay);
+    }
+    return NULL;
+}
+
+
+void relay_start(struct relay_s *relay)
+{
+    sem_post(&relay->go);
+}
+
+
+void relay_close_fds(struct relay_s *relay)
+{
+    for(int i = 0; i < relay->nedges; i++)
+    {
+        struct relay_edge_s *edge = &relay->edges[i];
+        if(edge->in >= 0)
+        {
+            close(edge->in);
+        }
+        if(edge->out >= 0)
+        {
+            close(edge->out);
+        }
+    }
+}
+
+
+void relay_cancel(struct relay_s *relay)
+{
+    relay_close_fds(relay);
+    relay->nedges = 0;
+    sem_post(&relay->go);
+    relay_finish(relay);
+    relay_free(relay);
+}
+
+
+void relay_finish(struct relay_s *relay)
+{
+    pthread_join(relay->thread, NULL);
+}
+
+
+void relay_abandon(struct relay_s *relay)
+{
+    pthread_detach(relay->thread);
+    if(atomic_exchange(&relay->orphaned, 1))
+    {
+        relay_free(relay);
+    }
+}
+
+
+void relay_free(struct relay_s *relay)
+{
+    sem_destroy(&relay->go);
+    free(relay);
+}
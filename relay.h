@@ -0,0 +1,70 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/*
+ * Instrumented pipes.  When $TIMELINE_PIPES is set and a pipeline is
+ * being timed, every edge of it gets two pipes instead of one, and a relay
+ * thread in the shell moves the data from the writer's pipe to the
+ * reader's with splice() (no copying through user space).  Watching both
+ * sides tells us how many bytes went through each edge, how long the
+ * reader couldn't keep up (the writer's pipe backs up and the writer
+ * blocks) and how long the reader sat waiting for data, which is where
+ * the bottleneck stage of a long text-processing pipeline shows up.
+ */
+
+/* Most bytes one splice() call moves */
+#define RELAY_SPLICE_MAX    (1024 * 1024)
+
+/* One edge of a pipeline: writer -> [in] relay [out] -> reader */
+struct relay_edge_s
+{
+    int in;                     /* read end of the writer's pipe, -1 if none */
+    int out;                    /* write end of the reader's pipe, -1 if none */
+    int waiting_out;            /* waiting for room in out, else for data in in */
+    uint64_t since_ns;          /* when the current wait started */
+    uint64_t bytes;             /* bytes moved */
+    uint64_t full_ns;           /* time spent waiting for the reader to make room */
+    uint64_t empty_ns;          /* time the reader was left waiting for data */
+    uint64_t end_ns;            /* when the edge was closed */
+};
+
+/*
+ * The thread is started before the pipeline's stages (so if we can't have
+ * one, the pipeline simply goes without instrumented pipes), and waits for
+ * relay_start() to hand it the edges.
+ */
+struct relay_s
+{
+    pthread_t thread;
+    sem_t go;                   /* posted by relay_start() or relay_cancel() */
+    _Atomic int orphaned;       /* see relay_abandon() */
+    int nedges;
+    struct relay_edge_s edges[];
+};
+
+/* Get a relay with a waiting thread for nedges edges, NULL if we can't */
+struct relay_s *relay_new(int nedges);
+
+/* Start moving data, once the caller has filled in every edge's in and out */
+void relay_start(struct relay_s *relay);
+
+/* Close the fds of the edges filled in so far (in a forked stage, or to cancel) */
+void relay_close_fds(struct relay_s *relay);
+
+/* Stop a relay that wasn't started, closing the fds it was given, and free it */
+void relay_cancel(struct relay_s *relay);
+
+/* Wait until every edge is closed (all the writers are done), the stats are then final */
+void relay_finish(struct relay_s *relay);
+
+/* Let the relay run on by itself (the job stopped), it frees itself when it's done */
+void relay_abandon(struct relay_s *relay);
+
+/* Free a finished relay */
+void relay_free(struct relay_s *relay);
+
+#endif
@@ -6,10 +6,24 @@
 #include "mshX.h"
 #include "scanner.h"
 #include "source.h"
-
+#include "arena.h"
+
+// Forward declarations (defined in wordexp.c)
+size_t find_closing_quote(char *data, size_t len);
+size_t find_closing_brace(char *data, size_t len);
+
+/*
+ * most tokens are a run of chars straight out of the source buffer, so
+ * tokenize() only remembers where the token starts and how long it is. the
+ * token text is copied to tok_buf only when the scanner has to drop chars
+ * from the middle of the token (a backslash-newline), from then on the rest
+ * of the token is added to tok_buf char by char.
+ */
 char *tok_buf = NULL;
 int   tok_bufsize  = 0;
-int   tok_bufindex = -1;
+int   tok_bufindex = -1;        /* length of the current token */
+long  tok_start    = 0;         /* where the current token starts in the source */
+int   tok_copied   = 0;         /* the current token's text is in tok_buf */
 
 /* special token to indicate end of input */
 struct token_s eof_token = 
@@ -18,60 +32,99 @@ struct token_s eof_token =
 };
 
 
-void add_to_buf(char c)
+/*
+ * make sure tok_buf can hold size chars.
+ *
+ * returns 1 on success, 0 if there is insufficient memory.
+ */
+static int tok_buf_reserve(int size)
 {
-    tok_buf[tok_bufindex++] = c;
+    if(size <= tok_bufsize)
+    {
+        return 1;
+    }
+
+    int newsize = tok_bufsize ? tok_bufsize : 1024;
+    while(newsize < size)
+    {
+        newsize *= 2;
+    }
+
+    char *tmp = realloc(tok_buf, newsize);
+    if(!tmp)
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    tok_buf = tmp;
+    tok_bufsize = newsize;
+    return 1;
+}
 
-    if(tok_bufindex >= tok_bufsize)
+
+/*
+ * add the char at the current source position to the token.
+ */
+void add_to_buf(struct source_s *src, char c)
+{
+    if(tok_bufindex == 0)
     {
-        char *tmp = realloc(tok_buf, tok_bufsize*2);
+        tok_start = src->current_pos;
+    }
 
-        if(!tmp)
+    if(tok_copied)
+    {
+        if(!tok_buf_reserve(tok_bufindex+1))
         {
-            errno = ENOMEM;
             return;
         }
-
-        tok_buf = tmp;
-        tok_bufsize *= 2;
+        tok_buf[tok_bufindex] = c;
     }
+    tok_bufindex++;
 }
 
 
-struct token_s *create_token(char *str)
+/*
+ * switch the current token to copy mode, because the next source chars
+ * are not going to be part of it.
+ */
+static void copy_token_text(struct source_s *src)
 {
-    struct token_s *tok = malloc(sizeof(struct token_s));
-    
-    if(!tok)
+    if(tok_copied || tok_bufindex == 0)
     {
-        return NULL;
+        return;
     }
 
-    memset(tok, 0, sizeof(struct token_s));
-    tok->text_len = strlen(str);
-    
-    char *nstr = malloc(tok->text_len+1);
-    
-    if(!nstr)
+    if(tok_buf_reserve(tok_bufindex))
     {
-        free(tok);
-        return NULL;
+        memcpy(tok_buf, src->buffer+tok_start, tok_bufindex);
+        tok_copied = 1;
     }
-    
-    strcpy(nstr, str);
-    tok->text = nstr;
+}
+
+
+/*
+ * create a token for the given text. the text is not copied, and doesn't
+ * need to be NUL-terminated.
+ */
+struct token_s *create_token(char *text, int len)
+{
+    struct token_s *tok = arena_alloc(sizeof(struct token_s));
+
+    memset(tok, 0, sizeof(struct token_s));
+    tok->text     = text;
+    tok->text_len = len;
     
     return tok;
 }
 
 
-void free_token(struct token_s *tok)
+int token_is(struct token_s *tok, char *str)
 {
-    if(tok->text)
-    {
-        free(tok->text);
-    }
-    free(tok);
+    size_t len = strlen(str);
+
+    return (size_t)tok->text_len == len && memcmp(tok->text, str, len) == 0;
 }
 
 
@@ -85,19 +138,8 @@ struct token_s *tokenize(struct source_s *src)
         return &eof_token;
     }
     
-    if(!tok_buf)
-    {
-        tok_bufsize = 1024;
-        tok_buf = malloc(tok_bufsize);
-        if(!tok_buf)
-        {
-            errno = ENOMEM;
-            return &eof_token;
-        }
-    }
-
     tok_bufindex     = 0;
-    tok_buf[0]       = '\0';
+    tok_copied       = 0;
 
     char nc = next_char(src);
     char nc2;
@@ -119,8 +161,9 @@ struct token_s *tokenize(struct source_s *src)
                  * for quote chars, add the quote, as well as everything between this
                  * quote and the matching closing quote, to the token buffer.
                  */
-                add_to_buf(nc);
-                i = find_closing_quote(src->buffer+src->current_pos);
+                add_to_buf(src, nc);
+                i = find_closing_quote(src->buffer+src->current_pos,
+                                       src->buffer_size-src->current_pos);
 
 		if(!i)
                 {
@@ -132,13 +175,13 @@ struct token_s *tokenize(struct source_s *src)
 
 		while(i--)
                 {
-                    add_to_buf(next_char(src));
+                    add_to_buf(src, next_char(src));
                 }
                 break;
 
             case '\\':
                 /* get the next char after the backslah */
-                nc2 = next_char(src);
+                nc2 = peek_char(src);
 
 		/*
                  * discard backslash+newline '\\n' combination.. in an interactive shell, this
@@ -148,29 +191,32 @@ struct token_s *tokenize(struct source_s *src)
                  */
                 if(nc2 == '\n')
                 {
+                    copy_token_text(src);
+                    next_char(src);
                     break;
                 }
 
 		/* add the backslah to the token buffer */
-                add_to_buf(nc);
+                add_to_buf(src, nc);
 
 		/* add the escaped char to the token buffer */
-                if(nc2 > 0)
+                if(nc2 != EOF)
                 {
-                    add_to_buf(nc2);
+                    add_to_buf(src, next_char(src));
                 }
                 break;
                 
             case '$':
                 /* add the '$' to buffer and check the char after it */
-                add_to_buf(nc);
+                add_to_buf(src, nc);
                 nc = peek_char(src);
 
 		/* we have a '${' or '$(' sequence */
                 if(nc == '{' || nc == '(')
                 {
                     /* find the matching closing brace */
-                    i = find_closing_brace(src->buffer+src->current_pos+1);
+                    i = find_closing_brace(src->buffer+src->current_pos+1,
+                                           src->buffer_size-src->current_pos-1);
 
 		    if(!i)
                     {
@@ -182,7 +228,7 @@ struct token_s *tokenize(struct source_s *src)
 
 		    while(i--)
                     {
-                        add_to_buf(next_char(src));
+                        add_to_buf(src, next_char(src));
                     }
                 }
 		/*
@@ -192,7 +238,7 @@ struct token_s *tokenize(struct source_s *src)
                 else if(isalnum(nc) || nc == '*' || nc == '@' || nc == '#' ||
                                        nc == '!' || nc == '?' || nc == '$')
                 {
-                    add_to_buf(next_char(src));
+                    add_to_buf(src, next_char(src));
                 }
                 break;
 
@@ -211,7 +257,7 @@ struct token_s *tokenize(struct source_s *src)
                 }
                 else
                 {
-                    add_to_buf(nc);
+                    add_to_buf(src, nc);
                 }
                 endloop = 1;
                 break;
@@ -228,10 +274,10 @@ struct token_s *tokenize(struct source_s *src)
                         endloop = 1;
                         break;
                     }
-                    /* consume the second '&' */
+                    /* add both chars, consuming the second '&' */
+                    add_to_buf(src, '&');
                     next_char(src);
-                    add_to_buf('&');
-                    add_to_buf('&');
+                    add_to_buf(src, '&');
                     endloop = 1;
                 }
                 else
@@ -245,7 +291,7 @@ struct token_s *tokenize(struct source_s *src)
                     }
                     else
                     {
-                        add_to_buf('&');
+                        add_to_buf(src, '&');
                         endloop = 1;
                     }
                 }
@@ -263,10 +309,10 @@ struct token_s *tokenize(struct source_s *src)
                         endloop = 1;
                         break;
                     }
-                    /* consume the second '|' */
+                    /* add both chars, consuming the second '|' */
+                    add_to_buf(src, '|');
                     next_char(src);
-                    add_to_buf('|');
-                    add_to_buf('|');
+                    add_to_buf(src, '|');
                     endloop = 1;
                 }
                 else
@@ -280,7 +326,7 @@ struct token_s *tokenize(struct source_s *src)
                     }
                     else
                     {
-                        add_to_buf('|');
+                        add_to_buf(src, '|');
                         endloop = 1;
                     }
                 }
@@ -296,7 +342,7 @@ struct token_s *tokenize(struct source_s *src)
                 }
                 else
                 {
-                    add_to_buf(';');
+                    add_to_buf(src, ';');
                     endloop = 1;
                 }
                 break;
@@ -314,14 +360,14 @@ struct token_s *tokenize(struct source_s *src)
                 if(nc2 == '>')
                 {
                     /* append redirection >> */
+                    add_to_buf(src, '>');
                     next_char(src);
-                    add_to_buf('>');
-                    add_to_buf('>');
+                    add_to_buf(src, '>');
                 }
                 else
                 {
                     /* output redirection > */
-                    add_to_buf('>');
+                    add_to_buf(src, '>');
                 }
                 endloop = 1;
                 break;
@@ -335,12 +381,12 @@ struct token_s *tokenize(struct source_s *src)
                     endloop = 1;
                     break;
                 }
-                add_to_buf('<');
+                add_to_buf(src, '<');
                 endloop = 1;
                 break;
                 
             default:
-                add_to_buf(nc);
+                add_to_buf(src, nc);
                 break;
         }
 
@@ -355,20 +401,17 @@ struct token_s *tokenize(struct source_s *src)
     {
         return &eof_token;
     }
-    
-    if(tok_bufindex >= tok_bufsize)
+
+    struct token_s *tok;
+    if(tok_copied)
     {
-        tok_bufindex--;
+        tok = create_token(arena_strndup(tok_buf, tok_bufindex), tok_bufindex);
     }
-    tok_buf[tok_bufindex] = '\0';
-
-    struct token_s *tok = create_token(tok_buf);
-    if(!tok)
+    else
     {
-        fprintf(stderr, "error: failed to alloc buffer: %s\n", strerror(errno));
-        return &eof_token;
+        tok = create_token(src->buffer+tok_start, tok_bufindex);
     }
 
     tok->src = src;
     return tok;
-}
\ No newline at end of file
+}
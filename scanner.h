@@ -1,17 +1,25 @@
 #ifndef SCANNER_H
 #define SCANNER_H
 
+/*
+ * a token is a slice of its source's buffer: text points into src->buffer
+ * and is NOT NUL-terminated. only tokens the scanner had to rewrite (those
+ * with a backslash-newline in the middle) have their text copied to the
+ * command arena.
+ */
 struct token_s
 {
     struct source_s *src;       /* source of input */
     int    text_len;            /* length of token text */
-    char   *text;               /* token text */
+    char   *text;               /* token text (not NUL-terminated) */
 };
 
 /* the special EOF token, which indicates the end of input */
 extern struct token_s eof_token;
 
 struct token_s *tokenize(struct source_s *src);
-void free_token(struct token_s *tok);
+
+/* check if a token's text is the given string */
+int token_is(struct token_s *tok, char *str);
 
 #endif
\ No newline at end of file
@@ -1,4 +1,9 @@
 #include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "mshX.h"
 #include "source.h"
 
@@ -79,4 +84,142 @@ void skip_white_spaces(struct source_s *src)
     {
         next_char(src);
     }
-}
\ No newline at end of file
+}
+
+
+/*
+ * read everything from fd into a malloc'd buffer, for script files we can't
+ * mmap (pipes, terminals and the like).
+ *
+ * returns the buffer, or NULL on error.
+ */
+static char *read_all(int fd, long *size)
+{
+    long bufsize = 4096, len = 0;
+    char *buf = malloc(bufsize);
+
+    while(buf)
+    {
+        ssize_t n = read(fd, buf+len, bufsize-len);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n < 0)
+        {
+            free(buf);
+            return NULL;
+        }
+        if(n == 0)
+        {
+            break;
+        }
+
+        len += n;
+        if(len == bufsize)
+        {
+            char *buf2 = realloc(buf, bufsize*2);
+            if(!buf2)
+            {
+                free(buf);
+                errno = ENOMEM;
+                return NULL;
+            }
+            buf = buf2;
+            bufsize *= 2;
+        }
+    }
+
+    *size = len;
+    return buf;
+}
+
+
+/*
+ * open a script file as an input source. regular files are mmap'd, so the
+ * scanner reads the file's pages directly and nothing is copied, however
+ * big the script is.
+ *
+ * returns 1 on success, 0 on error (with errno set).
+ */
+int source_open_file(struct source_s *src, char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0)
+    {
+        return 0;
+    }
+
+    if(fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    src->buffer      = NULL;
+    src->buffer_size = 0;
+    src->current_pos = INIT_SRC_POS;
+    src->flags       = 0;
+
+    if(S_ISREG(st.st_mode))
+    {
+        if(st.st_size > 0)
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(map == MAP_FAILED)
+            {
+                int err = errno;
+                close(fd);
+                errno = err;
+                return 0;
+            }
+
+            /* we read the script front to back, exactly once */
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            src->buffer      = map;
+            src->buffer_size = st.st_size;
+            src->flags       = SOURCE_MAPPED;
+        }
+        else
+        {
+            src->buffer = "";
+        }
+    }
+    else
+    {
+        src->buffer = read_all(fd, &src->buffer_size);
+        if(!src->buffer)
+        {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return 0;
+        }
+        src->flags = SOURCE_ALLOCED;
+    }
+
+    close(fd);
+    return 1;
+}
+
+
+/*
+ * release the buffer of a source opened with source_open_file().
+ */
+void source_close(struct source_s *src)
+{
+    if(src->flags & SOURCE_MAPPED)
+    {
+        munmap(src->buffer, src->buffer_size);
+    }
+    else if(src->flags & SOURCE_ALLOCED)
+    {
+        free(src->buffer);
+    }
+
+    src->buffer      = NULL;
+    src->buffer_size = 0;
+    src->flags       = 0;
+}
@@ -6,16 +6,23 @@
 
 #define INIT_SRC_POS    (-2)
 
+/* values for the flags field */
+#define SOURCE_MAPPED   (1 << 0)    /* buffer is a file mmap'd by source_open_file() */
+#define SOURCE_ALLOCED  (1 << 1)    /* buffer was malloc'd by source_open_file() */
+
 struct source_s
 {   
     char *buffer;       /* the input text */
     long buffer_size;       /* size of the input text */
     long  current_pos;       /* absolute char position in source */
+    int   flags;             /* where the buffer came from */
 };
 
 char next_char(struct source_s *src);
 void unget_char(struct source_s *src);
 char peek_char(struct source_s *src);
 void skip_white_spaces(struct source_s *src);
+int  source_open_file(struct source_s *src, char *path);
+void source_close(struct source_s *src);
 
 #endif
\ No newline at end of file
@@ -4,11 +4,283 @@
 #include "../mshX.h"
 #include "../node.h"
 #include "../parser.h"
+#include "../plan.h"
 #include "symtab.h"
+#include "../builtins/hash.h"
+#include "../builtins/history.h"
+#include "../executor.h"
 
 struct symtab_stack_s symtab_stack;
 int symtab_level;
 
+/*
+ * the environment exec'd commands get: "name=value" strings for the exported
+ * variables that have a value.  it's patched whenever one of them is set,
+ * exported or removed, so starting a command never walks the symbol table.
+ * envp_entries[i] is the entry envp[i] was made from.
+ */
+static char **envp = NULL;
+static struct symtab_entry_s **envp_entries = NULL;
+static int envp_count = 0;
+static int envp_size = 0;
+static char *empty_envp[] = { NULL };
+
+/* marks a hash table slot whose entry was removed, so probing goes on past it */
+static struct symtab_entry_s tombstone;
+#define TOMBSTONE   (&tombstone)
+
+/* remembered command paths are only valid for the old $PATH */
+static void path_set(const char *val)
+{
+    (void)val;
+    hash_clear();
+}
+
+/* resize the history list to the new $HISTSIZE */
+static void histsize_set(const char *val)
+{
+    if (val)
+    {
+        history_set_size(atoi(val));
+    }
+}
+
+/* pipes made from now on get the default size */
+static void pipesize_unset(void)
+{
+    set_pipe_size(NULL);
+}
+
+/* fields are split on the new $IFS from now on */
+static void ifs_set(const char *val)
+{
+    (void)val;
+    ifs_changed();
+}
+
+/*
+ * variables the shell itself acts on.  on_set is called with the new value
+ * once it's in place, on_unset when the variable is removed; either may be
+ * NULL.
+ */
+static struct special_var_s
+{
+    char *name;
+    void (*on_set)(const char *val);
+    void (*on_unset)(void);
+} special_vars[] =
+{
+    { "PATH"    , path_set     , hash_clear     },
+    { "HISTSIZE", histsize_set , NULL           },
+    { "PIPESIZE", set_pipe_size, pipesize_unset },
+    { "IFS"     , ifs_set      , ifs_changed    },
+};
+
+static struct special_var_s *special_var(const char *name)
+{
+    for (size_t i = 0; i < sizeof(special_vars) / sizeof(special_vars[0]); i++)
+    {
+        if (strcmp(special_vars[i].name, name) == 0)
+        {
+            return &special_vars[i];
+        }
+    }
+    return NULL;
+}
+
+static unsigned int symtab_hash(const char *str)
+{
+    unsigned int h = 5381;
+
+    while (*str)
+    {
+        h = (h << 5) + h + (unsigned char)*str++;
+    }
+
+    return h;
+}
+
+/* find the slot holding the named entry, or NULL */
+static struct symtab_entry_s **find_slot(struct symtab_s *symtab, const char *name,
+                                         unsigned int hash)
+{
+    if (!symtab->nslots)
+    {
+        return NULL;
+    }
+
+    unsigned int mask = symtab->nslots - 1;
+    unsigned int i = hash & mask;
+    struct symtab_entry_s *entry;
+
+    /* there's always an empty slot to stop at */
+    while ((entry = symtab->slots[i]))
+    {
+        if (entry != TOMBSTONE && entry->hash == hash && strcmp(entry->name, name) == 0)
+        {
+            return &symtab->slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+/* put an entry (known not to be there) in the first free slot of its probe sequence */
+static void insert_slot(struct symtab_s *symtab, struct symtab_entry_s *entry)
+{
+    unsigned int mask = symtab->nslots - 1;
+    unsigned int i = entry->hash & mask;
+
+    while (symtab->slots[i] && symtab->slots[i] != TOMBSTONE)
+    {
+        i = (i + 1) & mask;
+    }
+
+    if (!symtab->slots[i])
+    {
+        symtab->nused++;
+    }
+    symtab->slots[i] = entry;
+}
+
+/*
+ * make room for one more entry, keeping the table at most 3/4 full
+ * (tombstones included).  a rebuild drops the tombstones, and leaves the
+ * table at most half full.
+ */
+static void grow_slots(struct symtab_s *symtab)
+{
+    if (symtab->nslots && (symtab->nused + 1) * 4 <= symtab->nslots * 3)
+    {
+        return;
+    }
+
+    unsigned int nslots = SYMTAB_INIT_SLOTS;
+    while (nslots < (symtab->count + 1) * 2)
+    {
+        nslots *= 2;
+    }
+
+    struct symtab_entry_s **slots = calloc(nslots, sizeof(struct symtab_entry_s *));
+    if (!slots)
+    {
+        fprintf(stderr, "fatal error: no memory for symbol table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(symtab->slots);
+    symtab->slots = slots;
+    symtab->nslots = nslots;
+    symtab->nused = 0;
+
+    for (struct symtab_entry_s *entry = symtab->first; entry; entry = entry->next)
+    {
+        insert_slot(symtab, entry);
+    }
+}
+
+/* take an entry's string out of the exported environment */
+static void env_remove(struct symtab_entry_s *entry)
+{
+    int i = entry->env_index;
+
+    if (i < 0)
+    {
+        return;
+    }
+
+    /* move the last string into the hole */
+    free(envp[i]);
+    envp_count--;
+    envp[i] = envp[envp_count];
+    envp_entries[i] = envp_entries[envp_count];
+    envp_entries[i]->env_index = i;
+    envp[envp_count] = NULL;
+
+    entry->env_index = -1;
+}
+
+/* bring an entry's string in the exported environment up to date */
+static void env_update(struct symtab_entry_s *entry)
+{
+    if (!(entry->flags & FLAG_EXPORT) || !entry->val)
+    {
+        env_remove(entry);
+        return;
+    }
+
+    char *str = malloc(strlen(entry->name) + strlen(entry->val) + 2);
+    if (!str)
+    {
+        fprintf(stderr, "error: no memory for exported variable\n");
+        env_remove(entry);
+        return;
+    }
+    sprintf(str, "%s=%s", entry->name, entry->val);
+
+    if (entry->env_index >= 0)
+    {
+        free(envp[entry->env_index]);
+        envp[entry->env_index] = str;
+        return;
+    }
+
+    /* keep room for the NULL at the end */
+    if (envp_count + 1 >= envp_size)
+    {
+        int size = envp_size ? envp_size * 2 : 64;
+        char **envp2 = realloc(envp, size * sizeof(char *));
+        struct symtab_entry_s **entries2 = envp2 ?
+                realloc(envp_entries, size * sizeof(struct symtab_entry_s *)) : NULL;
+
+        if (!entries2)
+        {
+            fprintf(stderr, "error: no memory for exported variable\n");
+            envp = envp2 ? envp2 : envp;
+            free(str);
+            return;
+        }
+        envp = envp2;
+        envp_entries = entries2;
+        envp_size = size;
+    }
+
+    envp[envp_count] = str;
+    envp_entries[envp_count] = entry;
+    entry->env_index = envp_count++;
+    envp[envp_count] = NULL;
+}
+
+/* mark (or unmark) an entry as exported to the commands we run */
+void symtab_entry_export(struct symtab_entry_s *entry, int export)
+{
+    if (export)
+    {
+        entry->flags |= FLAG_EXPORT;
+    }
+    else
+    {
+        entry->flags &= ~FLAG_EXPORT;
+    }
+
+    env_update(entry);
+}
+
+/* the environment for exec'd commands (a NULL-terminated array) */
+char **get_envp(void)
+{
+    return envp ? envp : empty_envp;
+}
+
+/* look the named entry up in one symbol table */
+static struct symtab_entry_s *lookup(struct symtab_s *symtab, const char *name,
+                                     unsigned int hash)
+{
+    struct symtab_entry_s **slot = find_slot(symtab, name, hash);
+    return slot ? *slot : NULL;
+}
+
 void init_symtab(void)
 {
     symtab_stack.symtab_count = 1;
@@ -65,14 +337,17 @@ void free_symtab(struct symtab_s *symtab)
 
         if (entry->func_body)
         {
-            free_node_tree(entry->func_body);
+            plan_release(entry->func_body);
         }
 
+        env_remove(entry);
+
         struct symtab_entry_s *next = entry->next;
         free(entry);
         entry = next;
     }
 
+    free(symtab->slots);
     free(symtab);
 }
 void dump_local_symtab(void)
@@ -106,8 +381,9 @@ struct symtab_entry_s *add_to_symtab(char *symbol)
 
     struct symtab_s *st = symtab_stack.local_symtab;
     struct symtab_entry_s *entry = NULL;
+    unsigned int hash = symtab_hash(symbol);
 
-    if ((entry = do_lookup(symbol, st)))
+    if ((entry = lookup(st, symbol, hash)))
     {
         return entry;
     }
@@ -130,6 +406,8 @@ struct symtab_entry_s *add_to_symtab(char *symbol)
     }
 
     strcpy(entry->name, symbol);
+    entry->hash = hash;
+    entry->env_index = -1;
 
     if (!st->first)
     {
@@ -138,55 +416,67 @@ struct symtab_entry_s *add_to_symtab(char *symbol)
     }
     else
     {
+        entry->prev = st->last;
         st->last->next = entry;
         st->last = entry;
     }
 
+    grow_slots(st);
+    insert_slot(st, entry);
+    st->count++;
+
     return entry;
 }
 int rem_from_symtab(struct symtab_entry_s *entry, struct symtab_s *symtab)
 {
     int res = 0;
-    if (entry->val)
-    {
-        free(entry->val);
-    }
+    struct special_var_s *special = special_var(entry->name);
 
-    if (entry->func_body)
+    if (special && special->on_unset)
     {
-        free_node_tree(entry->func_body);
+        special->on_unset();
     }
 
-    free(entry->name);
+    struct symtab_entry_s **slot = find_slot(symtab, entry->name, entry->hash);
 
-    if (symtab->first == entry)
+    if (slot && *slot == entry)
     {
-        symtab->first = symtab->first->next;
+        *slot = TOMBSTONE;
+        symtab->count--;
 
-        if (symtab->last == entry)
+        if (entry->prev)
         {
-            symtab->last = NULL;
+            entry->prev->next = entry->next;
         }
-        res = 1;
-    }
-    else
-    {
-        struct symtab_entry_s *e = symtab->first;
-        struct symtab_entry_s *p = NULL;
-
-        while (e && e != entry)
+        else
         {
-            p = e;
-            e = e->next;
+            symtab->first = entry->next;
         }
 
-        if (e == entry)
+        if (entry->next)
         {
-            p->next = entry->next;
-            res = 1;
+            entry->next->prev = entry->prev;
         }
+        else
+        {
+            symtab->last = entry->prev;
+        }
+        res = 1;
     }
 
+    env_remove(entry);
+
+    if (entry->val)
+    {
+        free(entry->val);
+    }
+
+    if (entry->func_body)
+    {
+        plan_release(entry->func_body);
+    }
+
+    free(entry->name);
     free(entry);
     return res;
 }
@@ -197,27 +487,22 @@ struct symtab_entry_s *do_lookup(char *str, struct symtab_s *symtable)
         return NULL;
     }
 
-    struct symtab_entry_s *entry = symtable->first;
-
-    while (entry)
-    {
-        if (strcmp(entry->name, str) == 0)
-        {
-            return entry;
-        }
-        entry = entry->next;
-    }
-
-    return NULL;
+    return lookup(symtable, str, symtab_hash(str));
 }
 struct symtab_entry_s *get_symtab_entry(char *str)
 {
+    if (!str)
+    {
+        return NULL;
+    }
+
     int i = symtab_stack.symtab_count - 1;
+    unsigned int hash = symtab_hash(str);
 
     do
     {
         struct symtab_s *symtab = symtab_stack.symtab_list[i];
-        struct symtab_entry_s *entry = do_lookup(str, symtab);
+        struct symtab_entry_s *entry = lookup(symtab, str, hash);
 
         if (entry)
         {
@@ -254,6 +539,18 @@ void symtab_entry_setval(struct symtab_entry_s *entry, char *val)
 
         entry->val = val2;
     }
+
+    if (entry->flags & FLAG_EXPORT)
+    {
+        env_update(entry);
+    }
+
+    struct special_var_s *special = special_var(entry->name);
+
+    if (special && special->on_set)
+    {
+        special->on_set(entry->val);
+    }
 }
 void symtab_stack_add(struct symtab_s *symtab)
 {
@@ -3,8 +3,13 @@
 
 #include "../node.h"
 
+struct plan_s;
+
 #define MAX_SYMTAB	256
 
+/* initial number of hash table slots in a symbol table (a power of 2) */
+#define SYMTAB_INIT_SLOTS   64
+
 /* the type of a symbol table entry's value */
 enum symbol_type_e
 {
@@ -19,15 +24,25 @@ struct symtab_entry_s
     enum      symbol_type_e val_type;
     char     *val;
     unsigned  int flags;
-    struct    symtab_entry_s *next;
-    struct    node_s *func_body;
+    unsigned  int hash;           /* hash of name, so lookups rarely strcmp() */
+    int       env_index;          /* slot in the exported environment, or -1 */
+    struct    symtab_entry_s *prev, *next;  /* in insertion order */
+    struct    plan_s *func_body;  /* compiled once, run without reparsing */
 };
 
-/* the symbol table structure */
+/*
+ * the symbol table structure.  entries are found through an open-addressing
+ * hash table (linear probing), and also kept in a list in the order they
+ * were added, which is the order dump lists them in.
+ */
 struct symtab_s
 {
     int    level;
     struct symtab_entry_s *first, *last;
+    struct symtab_entry_s **slots;  /* hash table, NULL until the first entry */
+    unsigned int nslots;            /* size of slots, a power of 2 */
+    unsigned int nused;             /* slots holding an entry or a tombstone */
+    unsigned int count;             /* number of entries */
 };
 
 /* values for the flags field of struct symtab_entry_s */                       
@@ -56,5 +71,7 @@ void init_symtab(void);
 void dump_local_symtab(void);
 void free_symtab(struct symtab_s *symtab);
 void symtab_entry_setval(struct symtab_entry_s *entry, char *val); 
+void symtab_entry_export(struct symtab_entry_s *entry, int export);
+char **get_envp(void);
 
 #endif
\ No newline at end of file
@@ -8,30 +8,36 @@
 #include <pwd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <signal.h>
 #include <sys/types.h>
-#include <glob.h>  // for glob_t, glob, globfree
+#include <sys/wait.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "mshX.h"
 #include "symtab/symtab.h"
 #include "executor.h"
+#include "arena.h"
+#include "builtins/jobs.h"
+#include "builtins/timeline.h"
 
 /* Global variables for special parameters */
 int exit_status = 0;      /* $? - exit status of the last command */
 pid_t shell_pid = 0;      /* $$ - PID of the current shell */
 
 // Forward declarations
-char *quote_val(char *str, int add_quotes);
 char *tilde_expand(char *str);
 char *command_substitute(char *str);
 char *var_expand(char *str);
 char *arithm_expand(char *str);
 char *word_expand_to_str(char *word);
-struct word_s *field_split(char *str);
-struct word_s *pathnames_expand(struct word_s *words);
 char *strchr_any(const char *s, const char *accept);
 int match_suffix(char *pattern, char *str, int longest);
 int match_prefix(char *pattern, char *str, int longest);
 int has_glob_chars(char *str, size_t len);
-char **get_filename_matches(char *pattern, void *glob);
+char **get_filename_matches(char *pattern, size_t *count);
+void free_filename_matches(char **matches);
 
 /* special value to represent an invalid variable */
 #define INVALID_VAR     ((char *)-1)
@@ -41,60 +47,20 @@ char **get_filename_matches(char *pattern, void *glob);
  * convert the string *word to a cmd_token struct, so it can be passed to
  * functions such as word_expand().
  *
- * returns the malloc'd cmd_token struct, or NULL if insufficient memory.
+ * returns the cmd_token struct, alloc'd in the command arena.
  */
 struct word_s *make_word(char *str)
 {
-    /* alloc struct memory */
-    struct word_s *word = malloc(sizeof(struct word_s));
-    if(!word)
-    {
-        return NULL;
-    }
+    struct word_s *word = arena_alloc(sizeof(struct word_s));
 
-    /* alloc string memory */
-    size_t  len  = strlen(str);
-    char   *data = malloc(len+1);
-    
-    if(!data)
-    {
-        free(word);
-        return NULL;
-    }
-    
-    /* copy string */
-    strcpy(data, str);
-    word->data = data;
-    word->len  = len;
+    word->len  = strlen(str);
+    word->data = arena_strndup(str, word->len);
     word->next = NULL;
     
-    /* return struct */
     return word;
 }
 
 
-/*
- * free the memory used by a list of words.
- */
-void free_all_words(struct word_s *first)
-{
-    while(first)
-    {
-        struct word_s *del = first;
-        first = first->next;
-        
-	if(del->data)
-        {
-            /* free the word text */
-            free(del->data);
-        }
-        
-	/* free the word */
-        free(del);
-    }
-}
-
-
 /*
  * convert a tree of tokens into a command string (i.e. re-create the original
  * command line from the token tree.
@@ -133,20 +99,6 @@ char *wordlist_to_str(struct word_s *word)
 }
 
 
-/*
- * delete the character at the given index in the given str.
- */
-void delete_char_at(char *str, size_t index)
-{
-    char *p1 = str+index;
-    char *p2 = p1+1;
-    while((*p1++ = *p2++))
-    {
-        ;
-    }
-}
-
-
 /*
  * check if the given str is a valid name.. POSIX says a names can consist of
  * alphanumeric chars and underscores, and start with an alphabetic char or underscore.
@@ -177,11 +129,12 @@ int is_name(char *str)
  * char of the data string.
  * sq_nesting is a flag telling us if we should allow single quote nesting
  * (prohibited by POSIX, but allowed in ANSI-C strings).
+ * len is the number of chars in data, which doesn't have to be NUL-terminated.
  *
  * returns the zero-based index of the closing quote.. a return value of 0
  * means we didn't find the closing quote.
  */
-size_t find_closing_quote(char *data)
+size_t find_closing_quote(char *data, size_t len)
 {
     /* check the type of quote we have */
     char quote = data[0];
@@ -190,7 +143,7 @@ size_t find_closing_quote(char *data)
         return 0;
     }
     /* find the matching closing quote */
-    size_t i = 0, len = strlen(data);
+    size_t i = 0;
     while(++i < len)
     {
         if(data[i] == quote)
@@ -212,11 +165,12 @@ size_t find_closing_quote(char *data)
 /*
  * find the closing brace that matches the opening brace, which is the first
  * char of the data string.
+ * len is the number of chars in data, which doesn't have to be NUL-terminated.
  *
  * returns the zero-based index of the closing brace.. a return value of 0
  * means we didn't find the closing brace.
  */
-size_t find_closing_brace(char *data)
+size_t find_closing_brace(char *data, size_t len)
 {
     /* check the type of opening brace we have */
     char opening_brace = data[0], closing_brace;
@@ -235,7 +189,7 @@ size_t find_closing_brace(char *data)
     }
     /* find the matching closing brace */
     size_t ob_count = 1, cb_count = 0;
-    size_t i = 0, len = strlen(data);
+    size_t i = 0;
     while(++i < len)
     {
         if((data[i] == '"') || (data[i] == '\'') || (data[i] == '`'))
@@ -287,292 +241,247 @@ size_t find_closing_brace(char *data)
 
 
 /*
- * substitute the substring of s1, from character start to character end,
- * with the s2 string.
- *
- * start should point to the first char to be deleted from s1.
- * end should point to the last char to be deleted from s, NOT the
- * char coming after it.
- *
- * returns the malloc'd new string, or NULL on error.
+ * What each char of an expanded word is (see struct expbuf_s).
+ */
+#define EXP_QUOTED      1   /* quoted or escaped: never split or globbed */
+#define EXP_SPLIT       2   /* from an unquoted expansion (or a blank): $IFS chars split here */
+#define EXP_EMPTY       4   /* not a char, just a mark where quotes were (so "" is a field) */
+
+/* room for the expansion buffer to start with, over the word's own length */
+#define EXPBUF_SLACK    64
+
+/*
+ * A word being expanded.  The expansions are written straight into buf as
+ * the word is scanned, quotes are dropped on the way, and flags says what
+ * each char of buf is.  Both live in one malloc'd block (the flags after
+ * the text), which doubles whenever it fills up.
  */
-char *substitute_str(char *s1, char *s2, size_t start, size_t end)
+struct expbuf_s
 {
-    /* get the prefix (the part before start) */
-    char before[start+1];
-    strncpy(before, s1, start);
-    before[start]   = '\0';
-    /* get the postfix (the part after end) */
-    size_t afterlen = strlen(s1)-end+1;
-    char after[afterlen];
-    strcpy(after, s1+end+1);
-    /* alloc memory for the new string */
-    size_t totallen = start+afterlen+strlen(s2);
-    char *final = malloc(totallen+1);
-    if(!final)
-    {
-        fprintf(stderr, "error: insufficient memory to perform variable substitution\n");
-        return NULL;
-    }
-    if(!totallen)       /* empty string */
-    {
-        final[0] = '\0';
-    }
-    else                /* concatenate the three parts into one string */
+    char *buf;
+    unsigned char *flags;
+    size_t len, size;
+    int can_split;      /* some char has EXP_SPLIT set */
+    int can_glob;       /* some unquoted char is a *, ? or [ */
+    int has_marks;      /* some char is EXP_EMPTY */
+};
+
+
+static int expbuf_init(struct expbuf_s *eb, size_t len)
+{
+    size_t size = len + EXPBUF_SLACK;
+    char *block = malloc(2*size);
+    if(!block)
     {
-        strcpy(final, before);
-        strcat(final, s2    );
-        strcat(final, after );
+        fprintf(stderr, "error: insufficient memory to perform word expansion\n");
+        return 0;
     }
-    /* return the new string */
-    return final;
+    eb->buf = block;
+    eb->flags = (unsigned char *)block + size;
+    eb->len = 0;
+    eb->size = size;
+    eb->can_split = 0;
+    eb->can_glob = 0;
+    eb->has_marks = 0;
+    return 1;
 }
 
 
-int substitute_word(char **pstart, char **p, size_t len,
-                    char *(func)(char *),
-                    int add_quotes)
+/*
+ * make room for n more chars (and the NUL that ends the text).
+ */
+static int expbuf_grow(struct expbuf_s *eb, size_t n)
 {
-    /* extract the word to be substituted */
-    char *tmp = malloc(len+1);
-    if(!tmp)
+    if(eb->len + n < eb->size)
     {
-        (*p) += len;
-        return 0;
+        return 1;
     }
-    strncpy(tmp, *p, len);
-    tmp[len--] = '\0';
 
-    /* and expand it */
-    char *tmp2;
-    if(func)
+    size_t size = eb->size * 2;
+    while(eb->len + n >= size)
     {
-        tmp2 = func(tmp);
-        if(tmp2 == INVALID_VAR)
-        {
-            tmp2 = NULL;
-        }
-        if(tmp2)
-        {
-            free(tmp);
-        }
+        size *= 2;
     }
-    else
+    char *block = malloc(2*size);
+    if(!block)
     {
-        tmp2 = tmp;
+        fprintf(stderr, "error: insufficient memory to perform word expansion\n");
+        return 0;
     }
+    memcpy(block, eb->buf, eb->len);
+    memcpy(block + size, eb->flags, eb->len);
+    free(eb->buf);
+    eb->buf = block;
+    eb->flags = (unsigned char *)block + size;
+    eb->size = size;
+    return 1;
+}
 
-    /* error expanding the string. keep the original string as-is */
-    if(!tmp2)
+
+static int expbuf_put(struct expbuf_s *eb, char *s, size_t n, unsigned char flag)
+{
+    if(!expbuf_grow(eb, n))
     {
-        (*p) += len;
-        free(tmp);
         return 0;
     }
-
-    /* save our current position in the word */
-    size_t i = (*p)-(*pstart);
-
-    /* substitute the expanded word */
-    tmp = quote_val(tmp2, add_quotes);
-    free(tmp2);
-    if(tmp)
+    memcpy(eb->buf + eb->len, s, n);
+    memset(eb->flags + eb->len, flag, n);
+    eb->len += n;
+    if(flag & EXP_SPLIT)
     {
-        /* substitute the expanded word */
-        if((tmp2 = substitute_str(*pstart, tmp, i, i+len)))
-        {
-            /* adjust our pointer to point to the new string */
-            free(*pstart);
-            (*pstart) = tmp2;
-            len = strlen(tmp);
-        }
-        free(tmp);
+        eb->can_split = 1;
+    }
+    if(flag & EXP_EMPTY)
+    {
+        eb->has_marks = 1;
+    }
+    else if(!(flag & EXP_QUOTED) && !eb->can_glob)
+    {
+        eb->can_glob = memchr(s, '*', n) || memchr(s, '?', n) || memchr(s, '[', n);
     }
-
-    /* adjust our pointer to point to the new string */
-    (*p) = (*pstart)+i+len-1;
     return 1;
 }
-                 
+
+
+static inline int expbuf_putc(struct expbuf_s *eb, char c, unsigned char flag)
+{
+    return expbuf_put(eb, &c, 1, flag);
+}
+
 
 /*
- * perform word expansion on a single word, pointed to by orig_word.
+ * run one of the expansion functions on the n chars at p (a copy of them,
+ * as the functions may write to their input), and add what it returns.
  *
- * returns the head of the linked list of the expanded fields and stores the last field
- * in the tail pointer.
+ * returns 0 if the expansion failed and the word must be dropped.
  */
-
-struct word_s *word_expand(char *orig_word)
+static int expand_part(struct expbuf_s *eb, char *p, size_t n,
+                       char *(func)(char *), unsigned char flag)
 {
-    if(!orig_word)
+    char *str = arena_strndup(p, n);
+    char *res = func(str);
+
+    if(res == INVALID_VAR)
     {
-        return NULL;
+        return 0;
     }
-    
-    if(!*orig_word)
+    if(!res)
     {
-        return make_word(orig_word);
+        return 1;
     }
+    int ok = expbuf_put(eb, res, strlen(res), flag);
+    free(res);
+    return ok;
+}
+
 
-    char *pstart = malloc(strlen(orig_word)+1);
-    if(!pstart)
+/*
+ * check if the n chars at str make a valid name (see is_name()).
+ */
+static int is_name_n(char *str, size_t n)
+{
+    if(!n || (!isalpha(*str) && *str != '_'))
     {
-        return NULL;
+        return 0;
+    }
+    while(--n)
+    {
+        str++;
+        if(!isalnum(*str) && *str != '_')
+        {
+            return 0;
+        }
     }
-    strcpy(pstart, orig_word);
+    return 1;
+}
 
-    char *p = pstart, *p2;
-    char *tmp;
-    char   c;
-    size_t i = 0;
-    size_t len;
+
+/*
+ * expand the word into eb, in one pass over it: tilde prefixes, parameters,
+ * command substitutions and arithmetic are expanded where they stand, and
+ * quotes and backslashes are removed.  what came from an expansion is never
+ * looked at again, so a word with many expansions takes time in proportion
+ * to its length and theirs.
+ *
+ * returns 1, or 0 if an expansion failed and the word must be dropped.
+ */
+static int expand_into(struct expbuf_s *eb, char *word)
+{
+    char *p = word;
+    char *end = word + strlen(word);
     int in_double_quotes = 0;
     int in_var_assign = 0;
-    int var_assign_eq = 0;
-    int expanded = 0;
-    char *(*func)(char *);
+    char *var_assign_eq = NULL;
+    size_t len;
 
-    do
+    while(p < end)
     {
+        /* literal chars are flagged qflag, expansion results xflag */
+        unsigned char qflag = in_double_quotes ? EXP_QUOTED : 0;
+        unsigned char xflag = in_double_quotes ? EXP_QUOTED : EXP_SPLIT;
+        int ok = 1;
+
         switch(*p)
         {
-            case '~':
-                /* don't perform tilde expansion inside double quotes */
-                if(in_double_quotes)
-                {
-                    break;
-                }
-                /* expand a tilde prefix only if:
-                 * - it is the first unquoted char in the string.
-                 * - it is part of a variable assignment, and is preceded by the first
-                 *   equals sign or a colon.
-                 */
-                if(p == pstart || (in_var_assign && (p[-1] == ':' || (p[-1] == '=' && var_assign_eq == 1))))
-                {
-                    /* find the end of the tilde prefix */
-                    int tilde_quoted = 0;
-                    int endme = 0;
-                    p2 = p+1;
-
-                    while(*p2)
-                    {
-                        switch(*p2)
-                        {
-                            case '\\':
-                                tilde_quoted = 1;
-                                p2++;
-                                break;
-                                
-                            case '"':
-                            case '\'':
-                                i = find_closing_quote(p2);
-                                if(i)
-                                {
-                                    tilde_quoted = 1;
-                                    p2 += i;
-                                }
-                                break;
-                                
-                            case '/':
-                                endme = 1;
-                                break;
-                                
-                            case ':':
-                                if(in_var_assign)
-                                {
-                                    endme = 1;
-                                }
-                                break;
-                        }
-                        if(endme)
-                        {
-                            break;
-                        }
-                        p2++;
-                    }
-                    
-		    /* if any part of the prefix is quoted, no expansion is done */
-                    if(tilde_quoted)
-                    {
-                        /* just skip the tilde prefix */
-                        p = p2;
-                        break;
-                    }
-                    
-		    /* otherwise, extract the prefix */
-                    len = p2-p;
-                    substitute_word(&pstart, &p, len, tilde_expand, !in_double_quotes);
-                    expanded = 1;
-                }
-                break;
-                
             case '"':
-                /* toggle quote mode */
+                /* toggle quote mode, marking where the quotes were */
                 in_double_quotes = !in_double_quotes;
-                break;
-                
-            case '=':
-                /* skip it if inside double quotes */
                 if(in_double_quotes)
                 {
-                    break;
+                    ok = expbuf_putc(eb, '\0', EXP_EMPTY);
                 }
-                /* check the previous string is a valid var name */
-                len = p-pstart;
-                tmp = malloc(len+1);
-                
-		if(!tmp)
+                p++;
+                break;
+
+            case '\'':
+                /* if inside double quotes, treat the single quote as a normal char */
+                if(in_double_quotes)
                 {
-                    fprintf(stderr, "error: insufficient memory for internal buffers\n");
+                    ok = expbuf_putc(eb, *p++, EXP_QUOTED);
                     break;
                 }
-                
-		strncpy(tmp, pstart, len);
-                tmp[len] = '\0';
-                
-		/*
-                 * if the string before '=' is a valid var name, we have a variable
-                 * assignment.. we set in_var_assign to indicate that, and we set
-                 * var_assign_eq which indicates this is the first equals sign (we use
-                 * this when performing tilde expansion -- see code above).
-                 */
-                if(is_name(tmp))
+                /* take everything, up to the closing single quote, as it is */
+                len = find_closing_quote(p, end-p);
+                if(!len)
                 {
-                    in_var_assign = 1;
-                    var_assign_eq++;
+                    len = end-p;
                 }
-                free(tmp);
+                ok = expbuf_putc(eb, '\0', EXP_EMPTY) &&
+                     expbuf_put(eb, p+1, len-1, EXP_QUOTED);
+                p += len+1;
                 break;
-                
+
             case '\\':
-                /* skip backslash (we'll remove it later on) */
-                p++;
-                break;
-                
-            case '\'':
-                /* if inside double quotes, treat the single quote as a normal char */
-                if(in_double_quotes)
+                if(!p[1])
+                {
+                    ok = expbuf_putc(eb, *p++, qflag);
+                    break;
+                }
+                /*
+                 * in double quotes, backslash preserves its special quoting
+                 * meaning only when followed by one of these chars.
+                 */
+                if(in_double_quotes && !strchr("$`\"\\\n", p[1]))
                 {
+                    ok = expbuf_putc(eb, *p++, EXP_QUOTED);
                     break;
                 }
-                
-		/* skip everything, up to the closing single quote */
-                p += find_closing_quote(p);
+                ok = expbuf_putc(eb, p[1], EXP_QUOTED);
+                p += 2;
                 break;
-                
+
             case '`':
                 /* find the closing back quote */
-                if((len = find_closing_quote(p)) == 0)
+                if((len = find_closing_quote(p, end-p)) == 0)
                 {
-                    /* not found. bail out */
+                    /* not found. it's just a char */
+                    ok = expbuf_putc(eb, *p++, qflag);
                     break;
                 }
-                
-		/* otherwise, extract the command and substitute its output */
-                substitute_word(&pstart, &p, len+1, command_substitute, 0);
-                expanded = 1;
+                ok = expand_part(eb, p, len+1, command_substitute, xflag);
+                p += len+1;
                 break;
-                
+
             /*
              * the $ sign might introduce:
              * - parameter expansions: ${var} or $var
@@ -580,172 +489,619 @@ struct word_s *word_expand(char *orig_word)
              * - arithmetic expansions: $(())
              */
             case '$':
-                c = p[1];
-                switch(c)
+                if(p[1] == '{' || p[1] == '(')
                 {
-                    case '{':
-                        /* find the closing quote */
-                        if((len = find_closing_brace(p+1)) == 0)
-                        {
-                            /* not found. bail out */
-                            break;
-                        }
-                        
-			/*
-                         *  calling var_expand() might return an INVALID_VAR result which
-                         *  makes the following call fail.
-                         */
-                        if(!substitute_word(&pstart, &p, len+2, var_expand, 0))
-                        {
-                            free(pstart);
-                            return NULL;
-                        }
-                        
-			expanded = 1;
+                    /* find the closing brace */
+                    if((len = find_closing_brace(p+1, end-p-1)) == 0)
+                    {
+                        /* not found. it's just a char */
+                        ok = expbuf_putc(eb, *p++, qflag);
                         break;
-                        
+                    }
                     /*
-                     * arithmetic expansion $(()) or command substitution $().
+                     * var_expand() might return an INVALID_VAR result, which
+                     * fails the whole word.
                      */
-                    case '(':
-                        /* check if we have one or two opening braces */
-                        i = 0;
-                        
-			if(p[2] == '(')
-                        {
-                            i++;
-                        }
-                        
-			/* find the closing quote */
-                        if((len = find_closing_brace(p+1)) == 0)
-                        {
-                            /* not found. bail out */
-                            break;
-                        }
-                        
-			/*
-                         * otherwise, extract the expression and substitute its value.
-                         * if we have one brace (i == 0), we'll perform command substitution.
-                         * otherwise, arithmetic expansion.
-                         */
-                        func = i ? arithm_expand : command_substitute;
-                        substitute_word(&pstart, &p, len+2, func, 0);
-                        expanded = 1;
-                        break;
-                                                
-                    default:
-                        /* Handle special parameters $? and $$ */
-                        if(p[1] == '?' || p[1] == '$')
-                        {
-                            /* perform variable expansion for special parameters */
-                            substitute_word(&pstart, &p, 2, var_expand, 0);
-                            expanded = 1;
-                            break;
-                        }
-                        
-                        /* var names must start with an alphabetic char or _ */
-                        if(!isalpha(p[1]) && p[1] != '_')
+                    char *(*func)(char *) = (p[1] == '{') ? var_expand :
+                                            (p[2] == '(') ? arithm_expand :
+                                                            command_substitute;
+                    ok = expand_part(eb, p, len+2, func, xflag);
+                    p += len+2;
+                    break;
+                }
+
+                /*
+                 * Handle special parameters $? and $$, and the
+                 * positional parameters $0 to $9
+                 */
+                if(p[1] == '?' || p[1] == '$' || isdigit(p[1]))
+                {
+                    ok = expand_part(eb, p, 2, var_expand, xflag);
+                    p += 2;
+                    break;
+                }
+
+                /* var names must start with an alphabetic char or _ */
+                if(!isalpha(p[1]) && p[1] != '_')
+                {
+                    ok = expbuf_putc(eb, *p++, qflag);
+                    break;
+                }
+
+                /* a plain $name: copy its value straight in */
+                char *name = ++p;
+                while(isalnum(*p) || *p == '_')
+                {
+                    p++;
+                }
+                len = p-name;
+                char namebuf[64];
+                char *var_name = (len < sizeof(namebuf)) ? namebuf : arena_alloc(len+1);
+                memcpy(var_name, name, len);
+                var_name[len] = '\0';
+
+                struct symtab_entry_s *entry = get_symtab_entry(var_name);
+                if(entry && entry->val)
+                {
+                    ok = expbuf_put(eb, entry->val, strlen(entry->val), xflag);
+                }
+                break;
+
+            case '~':
+                /* expand a tilde prefix only if it's unquoted, and:
+                 * - it is the first char in the word, or
+                 * - it is part of a variable assignment, and is preceded by the first
+                 *   equals sign or a colon.
+                 */
+                if(!in_double_quotes &&
+                   (p == word || (in_var_assign && (p[-1] == ':' || p-1 == var_assign_eq))))
+                {
+                    /* find the end of the tilde prefix */
+                    char *p2 = p+1;
+                    while(p2 < end && *p2 != '/' && !(in_var_assign && *p2 == ':'))
+                    {
+                        /* if any part of the prefix is quoted, no expansion is done */
+                        if(*p2 == '\\' || *p2 == '"' || *p2 == '\'')
                         {
                             break;
                         }
-                        
-			p2 = p+1;
-                        
-			/* get the end of the var name */
-                        while(*p2)
-                        {
-                            if(!isalnum(*p2) && *p2 != '_')
-                            {
-                                break;
-                            }
-                            p2++;
-                        }
-                        
-			/* empty name */
-                        if(p2 == p+1)
+                        p2++;
+                    }
+                    if(p2 == end || *p2 == '/' || *p2 == ':')
+                    {
+                        char *res = tilde_expand(arena_strndup(p, p2-p));
+                        /* no such user: the prefix stays as it is */
+                        if(res)
                         {
+                            ok = expbuf_put(eb, res, strlen(res), EXP_QUOTED);
+                            free(res);
+                            p = p2;
                             break;
                         }
-                        
-			/* perform variable expansion */
-                        substitute_word(&pstart, &p, p2-p, var_expand, 0);
-                        expanded = 1;
-                        break;
+                    }
                 }
+                ok = expbuf_putc(eb, *p++, qflag);
                 break;
 
-            default:
-                if(isspace(*p) && !in_double_quotes)
+            case '=':
+                /*
+                 * if the string before the first unquoted '=' is a valid var
+                 * name, we have a variable assignment (we use this when
+                 * performing tilde expansion -- see code above).
+                 */
+                if(!in_double_quotes && !var_assign_eq)
                 {
-                    expanded = 1;
+                    var_assign_eq = p;
+                    in_var_assign = is_name_n(word, p-word);
                 }
+                ok = expbuf_putc(eb, *p++, qflag);
+                break;
+
+            default:
+                /* unquoted blanks in the word itself delimit fields too */
+                ok = expbuf_putc(eb, *p, (!in_double_quotes && isspace(*p)) ? EXP_SPLIT : qflag);
+                p++;
                 break;
         }
-    } while(*(++p));
-    
-    /* if we performed word expansion, do field splitting */
-    struct word_s *words = NULL;
-    if(expanded)
-    {
-        words = field_split(pstart);
-    }
-    
-    /* no expansion done, or no field splitting done */
-    if(!words)
-    {
-        words = make_word(pstart);
-        /* error making word struct */
-        if(!words)
+
+        if(!ok)
         {
-            fprintf(stderr, "error: insufficient memory\n");
-            free(pstart);
-            return NULL;
+            return 0;
         }
     }
-    free(pstart);
-
-    /* perform pathname expansion and quote removal */
-    words = pathnames_expand(words);
-    remove_quotes(words);
 
-    /* return the expanded list */
-    return words;
+    eb->buf[eb->len] = '\0';
+    return 1;
 }
 
 
 /*
- * perform tilde expansion.
- *
- * returns the malloc'd expansion of the tilde prefix, NULL if expansion failed.
+ * add the field made of chars start to end-1 of eb to the list, globbing it
+ * if it has pattern chars that were neither quoted nor escaped.
  */
-char *tilde_expand(char *s)
+static void add_field(struct expbuf_s *eb, size_t start, size_t end,
+                      struct word_s **head, struct word_s **tail)
 {
-    char *home = NULL;
-    size_t len = strlen(s);
-    char   *s2 = NULL;
-    struct symtab_entry_s *entry;
+    char *text = arena_alloc(end-start+1);
+    size_t len = 0;
+    int glob = 0;
 
-    /* null tilde prefix. substitute with the value of home */
-    if(len == 1)
+    for(size_t i = start; i < end; i++)
     {
-        entry = get_symtab_entry("HOME");
-        if(entry && entry->val)
+        if(eb->flags[i] & EXP_EMPTY)
         {
-            home = entry->val;
+            continue;
         }
-        else
+        if(!(eb->flags[i] & EXP_QUOTED) && strchr("*?[", eb->buf[i]))
         {
-            /*
-             * POSIX doesn't say what to do if $HOME is null/unset.. we follow
-             * what bash does, which is searching our home directory in the password
-             * database.
-             */
-            struct passwd *pass;
-            pass = getpwuid(getuid());
-            if(pass)
-            {
-                /* get the value of home */
-                home = pass->pw_dir;
+            glob = 1;
+        }
+        text[len++] = eb->buf[i];
+    }
+    text[len] = '\0';
+
+    /*
+     * perform pathname expansion. quoted chars and backslashes that came from
+     * an expansion match themselves, so they are escaped in the pattern.
+     */
+    char **matches = NULL;
+    size_t count = 0;
+    if(glob)
+    {
+        char *pattern = arena_alloc(2*len+1);
+        char *p = pattern;
+        for(size_t i = start; i < end; i++)
+        {
+            char c = eb->buf[i];
+            if(eb->flags[i] & EXP_EMPTY)
+            {
+                continue;
+            }
+            if(((eb->flags[i] & EXP_QUOTED) && strchr("*?[]\\", c)) ||
+               ((eb->flags[i] & EXP_SPLIT) && c == '\\'))
+            {
+                *p++ = '\\';
+            }
+            *p++ = c;
+        }
+        *p = '\0';
+
+        if(has_glob_chars(pattern, p-pattern))
+        {
+            matches = get_filename_matches(pattern, &count);
+        }
+    }
+
+    /* no matches found: the field stays as it is */
+    if(!matches)
+    {
+        struct word_s *fld = arena_alloc(sizeof(struct word_s));
+        fld->data = text;
+        fld->len  = len;
+        fld->next = NULL;
+        if(*tail)
+        {
+            (*tail)->next = fld;
+        }
+        else
+        {
+            *head = fld;
+        }
+        *tail = fld;
+        return;
+    }
+
+    for(size_t j = 0; j < count; j++)
+    {
+        struct word_s *w = make_word(matches[j]);
+        if(*tail)
+        {
+            (*tail)->next = w;
+        }
+        else
+        {
+            *head = w;
+        }
+        *tail = w;
+    }
+    free_filename_matches(matches);
+}
+
+
+/*
+ * The $IFS chars as 256-bit tables, for the field splitter.  They're
+ * rebuilt the first time fields are split after $IFS is set or unset (see
+ * ifs_changed()), not looked up in the $IFS string for every char.
+ */
+static struct
+{
+    int valid;
+    int split;              /* $IFS isn't empty, so there is splitting at all */
+    int blanks_only;        /* every $IFS char is whitespace */
+    int standard;           /* $IFS is space, tab and newline (or unset) */
+    uint64_t chars[4];      /* a bit for every $IFS char */
+    uint64_t space[4];      /* and for those of them that are whitespace */
+} ifs;
+
+#define IFS_HAS(set, c)     (((set)[(unsigned char)(c) >> 6] >> ((unsigned char)(c) & 63)) & 1)
+
+/* A field, as offsets into the expansion buffer */
+struct field_s
+{
+    size_t start, end;
+};
+
+/* The fields a word is split into, in an array that doubles as it fills */
+struct fieldlist_s
+{
+    struct field_s *fields;
+    size_t count, size;
+};
+
+
+void ifs_changed(void)
+{
+    ifs.valid = 0;
+}
+
+
+static void ifs_build(void)
+{
+    struct symtab_entry_s *entry = get_symtab_entry("IFS");
+    /* POSIX says no IFS means: "space/tab/NL" */
+    char *IFS = (entry && entry->val) ? entry->val : " \t\n";
+
+    memset(&ifs, 0, sizeof(ifs));
+    ifs.blanks_only = 1;
+    for(char *p = IFS; *p; p++)
+    {
+        unsigned char c = *p;
+        ifs.chars[c >> 6] |= (uint64_t)1 << (c & 63);
+        if(isspace(c))
+        {
+            ifs.space[c >> 6] |= (uint64_t)1 << (c & 63);
+        }
+        else
+        {
+            ifs.blanks_only = 0;
+        }
+    }
+
+    /* and empty IFS means no field splitting */
+    ifs.split = (*IFS != '\0');
+    ifs.standard = ifs.chars[0] == (((uint64_t)1 << ' ') | ((uint64_t)1 << '\t') | ((uint64_t)1 << '\n')) &&
+                   !ifs.chars[1] && !ifs.chars[2] && !ifs.chars[3];
+    ifs.valid = 1;
+}
+
+
+static void add_offsets(struct fieldlist_s *fl, size_t start, size_t end)
+{
+    if(fl->count == fl->size)
+    {
+        size_t size = fl->size ? fl->size * 2 : 16;
+        struct field_s *fields = realloc(fl->fields, size * sizeof(struct field_s));
+        if(!fields)
+        {
+            fprintf(stderr, "error: insufficient memory to perform field splitting\n");
+            return;
+        }
+        fl->fields = fields;
+        fl->size = size;
+    }
+    fl->fields[fl->count].start = start;
+    fl->fields[fl->count].end = end;
+    fl->count++;
+}
+
+
+/*
+ * get a bit for each of the n (at most 64) chars at i that delimits
+ * fields: an $IFS char that came from an unquoted expansion.  the standard
+ * $IFS is checked 16 chars at a time with SSE2, where we have it.
+ */
+static uint64_t delim_mask(struct expbuf_s *eb, size_t i, size_t n)
+{
+    uint64_t mask = 0;
+    size_t j = 0;
+
+#ifdef __SSE2__
+    if(ifs.standard)
+    {
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab   = _mm_set1_epi8('\t');
+        const __m128i nl    = _mm_set1_epi8('\n');
+        const __m128i split = _mm_set1_epi8(EXP_SPLIT);
+
+        for( ; j+16 <= n; j += 16)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i *)(eb->buf + i+j));
+            __m128i f = _mm_loadu_si128((const __m128i *)(eb->flags + i+j));
+            __m128i blank = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, space),
+                                                      _mm_cmpeq_epi8(c, tab)),
+                                         _mm_cmpeq_epi8(c, nl));
+            __m128i hit = _mm_and_si128(blank, _mm_cmpeq_epi8(f, split));
+            mask |= (uint64_t)(unsigned int)_mm_movemask_epi8(hit) << j;
+        }
+    }
+#endif
+
+    for( ; j < n; j++)
+    {
+        if(eb->flags[i+j] == EXP_SPLIT && IFS_HAS(ifs.chars, eb->buf[i+j]))
+        {
+            mask |= (uint64_t)1 << j;
+        }
+    }
+    return mask;
+}
+
+
+/*
+ * split on an $IFS that is all whitespace, where the fields are just the
+ * runs of chars between delimiters.  we take 64 chars at a time as a bit
+ * mask of delimiters, and find where each run starts and ends by counting
+ * trailing zeros, so a field costs a few instructions however long it is.
+ */
+static void split_blanks(struct expbuf_s *eb, struct fieldlist_s *fl)
+{
+    size_t start = 0;
+    int in_field = 0;
+
+    for(size_t base = 0; base < eb->len; base += 64)
+    {
+        size_t n = (eb->len - base < 64) ? eb->len - base : 64;
+        uint64_t delims = delim_mask(eb, base, n);
+        uint64_t others = ~delims;
+        if(n < 64)
+        {
+            others &= ((uint64_t)1 << n) - 1;
+        }
+
+        /* look for the next char of the other kind from where the last run changed */
+        size_t pos = 0;
+        while(pos < n)
+        {
+            uint64_t rest = (in_field ? delims : others) >> pos << pos;
+            if(!rest)
+            {
+                break;
+            }
+            pos = __builtin_ctzll(rest);
+            if(in_field)
+            {
+                add_offsets(fl, start, base + pos);
+            }
+            else
+            {
+                start = base + pos;
+            }
+            in_field = !in_field;
+        }
+    }
+
+    if(in_field)
+    {
+        add_offsets(fl, start, eb->len);
+    }
+}
+
+
+/*
+ * split on an $IFS with other chars in it.  POSIX says $IFS whitespace
+ * around a field is dropped, while any other $IFS char delimits a field by
+ * itself (so two of them in a row have an empty field in between).
+ */
+static void split_delims(struct expbuf_s *eb, struct fieldlist_s *fl)
+{
+    /* start is where the current field began, have_field if it has anything at all */
+    size_t start = 0;
+    int have_field = 0;
+    int after_space = 0;
+
+    for(size_t i = 0; i < eb->len; i++)
+    {
+        char c = eb->buf[i];
+        if(eb->flags[i] != EXP_SPLIT || !IFS_HAS(ifs.chars, c))
+        {
+            if(!have_field)
+            {
+                start = i;
+                have_field = 1;
+            }
+            continue;
+        }
+
+        if(IFS_HAS(ifs.space, c))
+        {
+            /* whitespace ends a field, but never makes an empty one */
+            if(have_field)
+            {
+                add_offsets(fl, start, i);
+                have_field = 0;
+                after_space = 1;
+            }
+            continue;
+        }
+
+        /*
+         * any other delimiter ends the field, which is empty if there was
+         * nothing since the last delimiter (but whitespace before us already
+         * ended the field we would be closing).
+         */
+        if(have_field)
+        {
+            add_offsets(fl, start, i);
+            have_field = 0;
+        }
+        else if(!after_space)
+        {
+            add_offsets(fl, i, i);
+        }
+        after_space = 0;
+    }
+
+    if(have_field)
+    {
+        add_offsets(fl, start, eb->len);
+    }
+}
+
+
+/*
+ * turn the fields into a word list.  unless they need globbing or have
+ * quote marks to drop, their text is copied into one block of the command
+ * arena, and their word_s structs are one array, linked in order.
+ */
+static struct word_s *emit_fields(struct expbuf_s *eb, struct field_s *fields, size_t count)
+{
+    struct word_s *head = NULL, *tail = NULL;
+
+    if(eb->can_glob || eb->has_marks)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            add_field(eb, fields[i].start, fields[i].end, &head, &tail);
+        }
+        return head;
+    }
+
+    if(!count)
+    {
+        return NULL;
+    }
+
+    size_t total = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        total += fields[i].end - fields[i].start + 1;
+    }
+    char *text = arena_alloc(total);
+    struct word_s *words = arena_alloc(count * sizeof(struct word_s));
+
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t len = fields[i].end - fields[i].start;
+        memcpy(text, eb->buf + fields[i].start, len);
+        text[len] = '\0';
+        words[i].data = text;
+        words[i].len  = len;
+        words[i].next = (i+1 < count) ? &words[i+1] : NULL;
+        text += len+1;
+    }
+    return words;
+}
+
+
+/*
+ * cut the expanded word into fields at the $IFS chars that came from
+ * unquoted expansions, and perform pathname expansion on each field.
+ *
+ * returns the list of fields, or NULL if there are none.
+ */
+static struct word_s *make_fields(struct expbuf_s *eb)
+{
+    if(eb->can_split && !ifs.valid)
+    {
+        ifs_build();
+    }
+
+    if(!eb->can_split || !ifs.split)
+    {
+        /*
+         * quotes leave a mark even if there's nothing in them, so only
+         * unquoted expansions that came to nothing leave no field.
+         */
+        struct field_s whole = { 0, eb->len };
+        return eb->len ? emit_fields(eb, &whole, 1) : NULL;
+    }
+
+    struct fieldlist_s fl = { NULL, 0, 0 };
+    if(ifs.blanks_only)
+    {
+        split_blanks(eb, &fl);
+    }
+    else
+    {
+        split_delims(eb, &fl);
+    }
+
+    struct word_s *words = emit_fields(eb, fl.fields, fl.count);
+    free(fl.fields);
+    return words;
+}
+
+
+/*
+ * perform word expansion on a single word, pointed to by orig_word.
+ *
+ * returns the head of the linked list of the expanded fields, or NULL if the
+ * word expanded to no fields at all (or the expansion failed).
+ */
+struct word_s *word_expand(char *orig_word)
+{
+    if(!orig_word)
+    {
+        return NULL;
+    }
+
+    if(!*orig_word)
+    {
+        return make_word(orig_word);
+    }
+
+    struct expbuf_s eb;
+    if(!expbuf_init(&eb, strlen(orig_word)))
+    {
+        return NULL;
+    }
+
+    /* expand, then do field splitting and pathname expansion */
+    struct word_s *words = NULL;
+    if(expand_into(&eb, orig_word))
+    {
+        words = make_fields(&eb);
+    }
+    free(eb.buf);
+
+    /* return the expanded list */
+    return words;
+}
+
+
+/*
+ * perform tilde expansion.
+ *
+ * returns the malloc'd expansion of the tilde prefix, NULL if expansion failed.
+ */
+char *tilde_expand(char *s)
+{
+    char *home = NULL;
+    size_t len = strlen(s);
+    char   *s2 = NULL;
+    struct symtab_entry_s *entry;
+
+    /* null tilde prefix. substitute with the value of home */
+    if(len == 1)
+    {
+        entry = get_symtab_entry("HOME");
+        if(entry && entry->val)
+        {
+            home = entry->val;
+        }
+        else
+        {
+            /*
+             * POSIX doesn't say what to do if $HOME is null/unset.. we follow
+             * what bash does, which is searching our home directory in the password
+             * database.
+             */
+            struct passwd *pass;
+            pass = getpwuid(getuid());
+            if(pass)
+            {
+                /* get the value of home */
+                home = pass->pw_dir;
             }
         }
     }
@@ -916,6 +1272,7 @@ char *var_expand(char *orig_var_name)
     char *empty_val  = "";
     char *tmp        = NULL;
     char  setme      = 0;
+    int   is_word    = 0;     /* tmp is an operand word, not a value */
 
     struct symtab_entry_s *entry = get_symtab_entry(var_name);
     tmp = (entry && entry->val && entry->val[0]) ? entry->val : empty_val;
@@ -933,6 +1290,7 @@ char *var_expand(char *orig_var_name)
             {
                 case '-':          /* use default value */
                     tmp = sub+1;
+                    is_word = 1;
                     break;
 
                 case '=':          /* assign the variable a value */
@@ -941,6 +1299,7 @@ char *var_expand(char *orig_var_name)
                      *       assigned this way (we'll fix this later).
                      */
                     tmp = sub+1;
+                    is_word = 1;
                     /*
                      * assign the EXPANSION OF tmp, not tmp
                      * itself, to var_name (we'll set the value below).
@@ -1000,6 +1359,7 @@ char *var_expand(char *orig_var_name)
                 /* use alternative value */
                 case '+':
                     tmp = sub+1;
+                    is_word = 1;
                     break;
 
                 /*
@@ -1009,9 +1369,8 @@ char *var_expand(char *orig_var_name)
                  */
                 case '%':       /* match suffix */
                     sub++;
-                    /* perform word expansion on the value */
-                    char *p = word_expand_to_str(tmp);
-                    /* word expansion failed */
+                    /* work on a copy of the value */
+                    char *p = strdup(tmp);
                     if(!p)
                     {
                         return INVALID_VAR;
@@ -1023,25 +1382,25 @@ char *var_expand(char *orig_var_name)
                         longest = 1, sub++;
                     }
                     /* perform the match */
-                    if((len = match_suffix(sub, p, longest)) == 0)
+                    int match = match_suffix(sub, p, longest);
+                    if(match < 0)
                     {
                         return p;
                     }
                     /* return the match */
-                    char *p2 = malloc(len+1);
+                    char *p2 = malloc(match+1);
                     if(p2)
                     {
-                        strncpy(p2, p, len);
-                        p2[len] = '\0';
+                        memcpy(p2, p, match);
+                        p2[match] = '\0';
                     }
                     free(p);
                     return p2;
 
                 case '#':       /* match prefix */
                     sub++;
-                    /* perform word expansion on the value */
-                    p = word_expand_to_str(tmp);
-                    /* word expansion failed */
+                    /* work on a copy of the value */
+                    p = strdup(tmp);
                     if(!p)
                     {
                         return INVALID_VAR;
@@ -1053,15 +1412,16 @@ char *var_expand(char *orig_var_name)
                         longest = 1, sub++;
                     }
                     /* perform the match */
-                    if((len = match_prefix(sub, p, longest)) == 0)
+                    match = match_prefix(sub, p, longest);
+                    if(match <= 0)
                     {
                         return p;
                     }
                     /* return the match */
-                    p2 = malloc(strlen(p)-len+1);
+                    p2 = malloc(strlen(p)-match+1);
                     if(p2)
                     {
-                        strcpy(p2, p+len);
+                        strcpy(p2, p+match);
                     }
                     free(p);
                     return p2;
@@ -1074,10 +1434,11 @@ char *var_expand(char *orig_var_name)
     }
 
     /*
-     * we have substituted the variable's value. now go POSIX style on it.
+     * a value is used as it is, but an operand word (as in ${var:-word})
+     * gets expanded first.
      */
     int expanded = 0;
-    if(tmp)
+    if(tmp && is_word)
     {
         if((tmp = word_expand_to_str(tmp)))
         {
@@ -1140,30 +1501,106 @@ char *var_expand(char *orig_var_name)
 }
 
 
+/* initial size of the buffer command substitution output is read into */
+#define CMDSUBST_BUFSZ      1024
+
+
 /*
- * perform command substitutions.
- * the backquoted flag tells if we are called from a backquoted command substitution:
- *
- *    `command`
- *
- * or a regular one:
- *
- *    $(command)
+ * check if only whitespace is left to read in src.
+ */
+static int src_at_end(struct source_s *src)
+{
+    long pos = (src->current_pos == INIT_SRC_POS) ? 0 : src->current_pos+1;
+
+    for( ; pos < src->buffer_size; pos++)
+    {
+        if(!isspace((unsigned char)src->buffer[pos]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * run the command of a command substitution in a forked copy of the shell,
+ * with its stdout going to fd_out.  never returns.
+ */
+static void run_subshell(char *cmd, int fd_out)
+{
+    struct source_s src;
+    struct plan_s *plan;
+
+    dup2(fd_out, STDOUT_FILENO);
+    close(fd_out);
+
+    /* the subshell can be stopped with ^C, like a script */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+
+    /* it has no jobs of its own yet, and no timeline */
+    jobs_subshell();
+    timeline_enable(0);
+    current_exec_mode = EXEC_REAL;
+
+    src.buffer      = cmd;
+    src.buffer_size = strlen(cmd);
+    src.current_pos = INIT_SRC_POS;
+    src.flags       = 0;
+
+    /*
+     * like parse_and_execute(), but a lone simple command on the last line
+     * (the usual $(cmd)) is exec'd in place of the subshell, so it costs
+     * one process, not two.
+     */
+    while((plan = plan_get(&src)))
+    {
+        exec_last_command = src_at_end(&src) && plan->nops == 1 &&
+                            plan->ops[0].ncmds == 1 && !plan->ops[0].background;
+        plan_execute(plan);
+        exec_last_command = 0;
+        plan_release(plan);
+    }
+
+    /*
+     * _exit(), not exit(): exit() would also "sync" the stdin we share with
+     * the parent, moving its read offset back under its feet.
+     */
+    fflush(stdout);
+    _exit(exit_status);
+}
+
+
+/*
+ * perform command substitutions.
+ * the backquoted flag tells if we are called from a backquoted command substitution:
+ *
+ *    `command`
+ *
+ * or a regular one:
+ *
+ *    $(command)
+ *
+ * the command is run by a forked copy of this shell (not by /bin/sh), so it
+ * sees our variables and builtins.  its output is read through a pipe into
+ * a buffer that doubles in size whenever it fills up.
+ *
+ * returns the malloc'd output, without trailing newlines.
  */
 char *command_substitute(char *orig_cmd)
 {
-    char    b[1024];
     size_t  bufsz = 0;
+    size_t  bufcap = CMDSUBST_BUFSZ;
     char   *buf   = NULL;
-    char   *p     = NULL;
-    int     i     = 0;
+    int     fds[2];
     int backquoted = (*orig_cmd == '`');
 
     /*
      * fix cmd in the backquoted version.. we skip the first char (if using the
      * old, backquoted version), or the first two chars (if using the POSIX version).
      */
-    char *cmd = malloc(strlen(orig_cmd+1));
+    char *cmd = malloc(strlen(orig_cmd)+1);
     
     if(!cmd)
     {
@@ -1179,7 +1616,7 @@ char *command_substitute(char *orig_cmd)
     if(backquoted)
     {
         /* remove the last back quote */
-        if(cmd[cmdlen-1] == '`')
+        if(cmdlen && cmd[cmdlen-1] == '`')
         {
             cmd[cmdlen-1] = '\0';
         }
@@ -1187,7 +1624,7 @@ char *command_substitute(char *orig_cmd)
 	/* fix the backslash-escaped chars */
         char *p1 = cmd;
         
-	do
+	while(*p1)
         {
             if(*p1 == '\\' &&
                (p1[1] == '$' || p1[1] == '`' || p1[1] == '\\'))
@@ -1198,618 +1635,131 @@ char *command_substitute(char *orig_cmd)
                     ;
                 }
             }
-        } while(*(++p1));
+            p1++;
+        }
     }
     else
     {
         /* remove the last closing brace */
-        if(cmd[cmdlen-1] == ')')
+        if(cmdlen && cmd[cmdlen-1] == ')')
         {
             cmd[cmdlen-1] = '\0';
         }
     }
 
-    FILE *fp = popen(cmd2, "r");
-
-    /* check if we have opened the pipe */
-    if(!fp)
+    if(make_pipe(fds, 0) < 0)
     {
         free(cmd2);
         fprintf(stderr, "error: failed to open pipe: %s\n", strerror(errno));
         return NULL;
     }
 
-    /* read the command output */
-    while((i = fread(b, 1, 1024, fp)))
-    {
-        /* first time. alloc buffer */
-        if(!buf)
-        {
-            /* add 1 for the null terminating byte */
-            buf = malloc(i+1);
-            if(!buf)
-            {
-                goto fin;
-            }
-            
-	    p   = buf;
-        }
-        /* extend buffer */
-        else
-        {
-            char *buf2 = realloc(buf, bufsz+i+1);
-            
-	    if(!buf2)
-            {
-                free(buf);
-                buf = NULL;
-                goto fin;
-            }
-            
-	    buf = buf2;
-            p   = buf+bufsz;
-        }
-        
-	bufsz += i;
-        
-	/* copy the input and add the null terminating byte */
-        memcpy(p, b, i);
-        p[i] = '\0';
-    }
-    
-    if(!bufsz)
-    {
-        free(cmd2);
-        return NULL;
-    }
-    
-    /* now remove any trailing newlines */
-    i = bufsz-1;
-    
-    while(buf[i] == '\n' || buf[i] == '\r')
-    {
-        buf[i] = '\0';
-        i--;
-    }
-
-fin:
-    /* close the pipe */
-    pclose(fp);
+    /* so the child doesn't write out what we have buffered too */
+    fflush(stdout);
 
-    /* free used memory */
-    free(cmd2);
-    
-    if(!buf)
+    pid_t pid = fork();
+    if(pid == 0)
     {
-        fprintf(stderr, "error: insufficient memory to perform command substitution\n");
+        close(fds[0]);
+        run_subshell(cmd2, fds[1]);
     }
-    
-    return buf;
-}
-
+    close(fds[1]);
 
-/*
- * check if char c is a valid $IFS character.
- *
- * returns 1 if char c is an $IFS character, 0 otherwise.
- */
-static inline int is_IFS_char(char c, char *IFS)
-{
-    if(!*IFS)
+    if(pid < 0)
     {
-        return 0;
+        close(fds[0]);
+        free(cmd2);
+        fprintf(stderr, "error: failed to fork: %s\n", strerror(errno));
+        return NULL;
     }
 
-    do
+    /* read the command output, leaving room for the null terminating byte */
+    buf = malloc(bufcap);
+    while(buf)
     {
-        if(c == *IFS)
+        if(bufsz+1 == bufcap)
         {
-            return 1;
+            char *buf2 = realloc(buf, bufcap*2);
+            if(!buf2)
+            {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = buf2;
+            bufcap *= 2;
         }
-    } while(*++IFS);
-    
-    return 0;
-}
-
 
-/*
- * skip all whitespace characters that are part of $IFS.
- */
-void skip_IFS_whitespace(char **str, char *IFS)
-{
-    char *IFS2 = IFS;
-    char *s2   = *str;
-    
-    do
-    {
-        if(*s2 == *IFS2)
+        ssize_t i = read(fds[0], buf+bufsz, bufcap-bufsz-1);
+        if(i < 0 && errno == EINTR)
         {
-            s2++;
-            IFS2 = IFS-1;
+            continue;
         }
-    } while(*++IFS2);
-    
-    *str = s2;
-}
-
-
-/*
- * skip $IFS delimiters, which can be whitespace characters as well as other chars.
- */
-void skip_IFS_delim(char *str, char *IFS_space, char *IFS_delim, size_t *_i, size_t len)
-{
-    size_t i = *_i;
-    
-    while((i < len) && is_IFS_char(str[i], IFS_space))
-    {
-        i++;
-    }
-    
-    while((i < len) && is_IFS_char(str[i], IFS_delim))
-    {
-        i++;
-    }
-    
-    while((i < len) && is_IFS_char(str[i], IFS_space))
-    {
-        i++;
-    }
-    
-    *_i = i;
-}
-
-
-/*
- * convert the words resulting from a word expansion into separate fields.
- *
- * returns a pointer to the first field, NULL if no field splitting was done.
- */
-struct word_s *field_split(char *str)
-{
-    struct symtab_entry_s *entry = get_symtab_entry("IFS");
-    char *IFS = entry ? entry->val : NULL;
-    char *p;
-    
-    /* POSIX says no IFS means: "space/tab/NL" */
-    if(!IFS)
-    {
-        IFS = " \t\n";
-    }
-    
-    /* POSIX says empty IFS means no field splitting */
-    if(IFS[0] == '\0')
-    {
-        return NULL;
-    }
-    
-    /* get the IFS spaces and delimiters separately */
-    char IFS_space[64];
-    char IFS_delim[64];
-    
-    if(strcmp(IFS, " \t\n") == 0)   /* "standard" IFS */
-    {
-        IFS_space[0] = ' ' ;
-        IFS_space[1] = '\t';
-        IFS_space[2] = '\n';
-        IFS_space[3] = '\0';
-        IFS_delim[0] = '\0';
-    }
-    else                            /* "custom" IFS */
-    {
-        p  = IFS;
-        char *sp = IFS_space;
-        char *dp = IFS_delim;
-    
-    	do
+        if(i <= 0)
         {
-            if(isspace(*p))
-            {
-                *sp++ = *p++;
-            }
-            else
-            {
-                *dp++ = *p++;
-            }
-        } while(*p);
-    
-    	*sp = '\0';
-        *dp = '\0';
+            break;
+        }
+        bufsz += i;
     }
+    close(fds[0]);
 
-    size_t len    = strlen(str);
-    size_t i      = 0, j = 0, k;
-    int    fields = 1;
-    char   quote  = 0;
-    
-    /* skip any leading whitespaces in the string */
-    skip_IFS_whitespace(&str, IFS_space);
-    
-    /* estimate the needed number of fields */
-    do
+    /* $? is the exit status of the substituted command */
+    int status = 0;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
     {
-        switch(str[i])
-        {
-            /* skip escaped chars */
-            case '\\':
-                /* backslash has no effect inside single quotes */
-                if(quote != '\'')
-                {
-                    i++;
-                }
-                break;
-
-            /* don't count whitespaces inside quotes */
-            case '\'':
-            case '"':
-            case '`':
-                if(quote == str[i])
-                {
-                    quote = 0;
-                }
-                else
-                {
-                    quote = str[i];
-                }
-                break;
+        ;
+    }
+    exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 
-            default:
-                /* skip normal characters if we're inside quotes */
-                if(quote)
-                {
-                    break;
-                }
+    free(cmd2);
     
-    		if(is_IFS_char(str[i], IFS_space) || is_IFS_char(str[i], IFS_delim))
-                {
-                    skip_IFS_delim(str, IFS_space, IFS_delim, &i, len);
-                    if(i < len)
-                    {
-                        fields++;
-                    }
-                }
-                break;
-        }
-    } while(++i < len);
-
-    /* we have only one field. no field splitting needed */
-    if(fields == 1)
+    if(!buf)
     {
+        fprintf(stderr, "error: insufficient memory to perform command substitution\n");
         return NULL;
     }
-
-    struct word_s *first_field = NULL;
-    struct word_s *cur         = NULL;
-    
-    /* create the fields */
-    i     = 0;
-    j     = 0;
-    quote = 0;
     
-    do
+    /* now remove any trailing newlines */
+    while(bufsz && (buf[bufsz-1] == '\n' || buf[bufsz-1] == '\r'))
     {
-        switch(str[i])
-        {
-            /* skip escaped chars */
-            case '\\':
-                /* backslash has no effect inside single quotes */
-                if(quote != '\'')
-                {
-                    i++;
-                }
-                break;
-
-            /* skip single quoted substrings */
-            case '\'':
-                p = str+i+1;
-                while(*p && *p != '\'')
-                {
-                    p++;
-                }
-                i = p-str;
-                break;
-
-            /* remember if we're inside/outside double and back quotes */
-            case '"':
-            case '`':
-                if(quote == str[i])
-                {
-                    quote = 0;
-                }
-                else
-                {
-                    quote = str[i];
-                }
-                break;
-
-            default:
-                /* skip normal characters if we're inside quotes */
-                if(quote)
-                {
-                    break;
-                }
-    
-    		/*
-                 * delimit the field if we have an IFS space or delimiter char, or if
-                 * we reached the end of the input string.
-                 */
-                if(is_IFS_char(str[i], IFS_space) ||
-                   is_IFS_char(str[i], IFS_delim) || (i == len))
-                {
-                    /* copy the field text */
-                    char *tmp = malloc(i-j+1);
-    
-    		    if(!tmp)
-                    {
-                        fprintf(stderr, "error: insufficient memory for field splitting\n");
-                        return first_field;
-                    }
-    
-    		    strncpy(tmp, str+j, i-j);
-                    tmp[i-j] = '\0';
-    
-    		    /* create a new struct for the field */
-                    struct word_s *fld = malloc(sizeof(struct word_s));
-    
-    		    if(!fld)
-                    {
-                        free(tmp);
-                        return first_field;
-                    }
-    
-    		    fld->data = tmp;
-                    fld->len  = i-j;
-                    fld->next = NULL;
-    
-    		    if(!first_field)
-                    {
-                        first_field = fld;
-                    }
-    
-    		    if(!cur)
-                    {
-                        cur  = fld;
-                    }
-                    else
-                    {
-                        cur->next = fld;
-                        cur       = fld;
-                    }
-    
-    		    k = i;
-    
-    		    /* skip trailing IFS spaces/delimiters */
-                    skip_IFS_delim(str, IFS_space, IFS_delim, &i, len);
-                    j = i;
-    
-    		    if(i != k && i < len)
-                    {
-                        i--;     /* go back one step so the loop will work correctly */
-                    }
-                }
-                break;
-        }
-    } while(++i <= len);
+        bufsz--;
+    }
+    buf[bufsz] = '\0';
     
-    return first_field;
+    return buf;
 }
 
 
 /*
- * perform pathname expansion.
+ * A simple shortcut to perform word-expansions on a string,
+ * returning the result as a string (no field splitting or pathname
+ * expansion is done).
+ *
+ * returns the malloc'd string, or NULL if the expansion failed.
  */
-struct word_s *pathnames_expand(struct word_s *words)
+char *word_expand_to_str(char *word)
 {
-    struct word_s *w = words;
-    struct word_s *pw = NULL;
+    struct expbuf_s eb;
 
-    while(w)
+    if(!expbuf_init(&eb, strlen(word)))
     {
-        char *p = w->data;
-    
-    	/* check if we should perform filename globbing */
-        if(!has_glob_chars(p, strlen(p)))
-        {
-            pw = w;
-            w = w->next;
-            continue;
-        }
-    
-    	glob_t glob;
-        char **matches = get_filename_matches(p, &glob);
-    
-    	/* no matches found */
-        if(!matches || !matches[0])
-        {
-            globfree(&glob);
-        }
-        else
-        {
-            /* save the matches */
-            struct word_s *head = NULL, *tail = NULL;
-    
-    	    for(size_t j = 0; j < glob.gl_pathc; j++)
-            {
-                /* skip '..' and '.' */
-                if(matches[j][0] == '.' &&
-                  (matches[j][1] == '.' || matches[j][1] == '\0' || matches[j][1] == '/'))
-                {
-                    continue;
-                }
-    
-    		/* add the path to the list */
-                if(!head)
-                {
-                    /* first item in the list */
-                    head = make_word(matches[j]);
-                    tail = head;
-                }
-                else
-                {
-                    /* add to the list's tail */
-                    tail->next = make_word(matches[j]);
-    
-    		    if(tail->next)
-                    {
-                        tail = tail->next;
-                    }
-                }
-            }
-    
-    	    /* add the new list to the existing list */
-            if(w == words)
-            {
-                words = head;
-            }
-            else if(pw)
-            {
-                pw->next = head;
-            }
-    
-    	    pw = tail;
-            tail->next = w->next;
-    
-    	    /* free the word we've just globbed */
-            w->next = NULL;
-            free_all_words(w);
-            w = tail;
-    
-    	    /* free the matches list */
-            globfree(&glob);
-            /* finished globbing this word */
-        }
-    
-    	pw = w;
-        w = w->next;
+        return NULL;
     }
-    
-    return words;
-}
-
-
-/*
- * perform quote removal.
- */
-void remove_quotes(struct word_s *wordlist)
-{
-    if(!wordlist)
+    if(!expand_into(&eb, word))
     {
-        return;
+        free(eb.buf);
+        return NULL;
     }
 
-    int in_double_quotes = 0;
-    struct word_s *word = wordlist;
-    char *p;
-    
-    while(word)
+    /* squeeze out the quote marks (the flags after the text go with the buffer) */
+    size_t j = 0;
+    for(size_t i = 0; i < eb.len; i++)
     {
-        p = word->data;
-        while(*p)
+        if(!(eb.flags[i] & EXP_EMPTY))
         {
-            switch(*p)
-            {
-                case '"':
-                    /* toggle quote mode */
-                    in_double_quotes = !in_double_quotes;
-                    delete_char_at(p, 0);
-                    break;
-
-                case '\'':
-                    /* don't delete if inside double quotes */
-                    if(in_double_quotes)
-                    {
-                        p++;
-                        break;
-                    }
-
-                    delete_char_at(p, 0);
-                
-		    /* find the closing quote */
-                    while(*p && *p != '\'')
-                    {
-                        p++;
-                    }
-                
-		    /* and remove it */
-                    if(*p == '\'')
-                    {
-                        delete_char_at(p, 0);
-                    }
-                    break;
-
-                case '`':
-                    delete_char_at(p, 0);
-                    break;
-
-                case '\v':
-                case '\f':
-                case '\t':
-                case '\r':
-                case '\n':
-                    p++;
-                    break;
-
-                case '\\':
-                    if(in_double_quotes)
-                    {
-                        switch(p[1])
-                        {
-                            /*
-                             * in double quotes, backslash preserves its special quoting
-                             * meaning only when followed by one of the following chars.
-                             */
-                            case  '$':
-                            case  '`':
-                            case  '"':
-                            case '\\':
-                            case '\n':
-                                delete_char_at(p, 0);
-                                p++;
-                                break;
-
-                            default:
-                                p++;
-                                break;
-                        }
-                    }
-                    else
-                    {
-                        /* parse single-character backslash quoting. */
-                        delete_char_at(p, 0);
-                        p++;
-                    }
-                    break;
-
-                default:
-                    p++;
-                    break;
-            }
+            eb.buf[j++] = eb.buf[i];
         }
-
-        /* update the word's length */
-        word->len = strlen(word->data);
-
-
-        /* move on to the next word */
-        word = word->next;
     }
-}
-
-
-/*
- * A simple shortcut to perform word-expansions on a string,
- * returning the result as a string.
- */
-char *word_expand_to_str(char *word)
-{
-    struct word_s *w = word_expand(word);
-
-    if(!w)
-    {
-        return NULL;
-    }
-    
-    char *res = wordlist_to_str(w);
-    free_all_words(w);
-    
-    return res;
+    eb.buf[j] = '\0';
+    return eb.buf;
 }
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "workpool.h"
+
+/*
+ * The pool: one batch of work at a time.  Items are handed out from next
+ * under the lock, and pending counts the ones that haven't finished, so
+ * workpool_for() knows when its batch is done.
+ */
+static struct
+{
+    pid_t owner;                /* process the threads run in, 0 before any */
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* a new batch is out */
+    pthread_cond_t done;        /* the last item of the batch finished */
+    void (*func)(void *arg, int i);
+    void *arg;
+    int n, next, pending;
+} pool;
+
+
+/* take items from the current batch until it runs out (with pool.lock held) */
+static void run_items(void)
+{
+    while(pool.next < pool.n)
+    {
+        int i = pool.next++;
+        void (*func)(void *, int) = pool.func;
+        void *arg = pool.arg;
+
+        pthread_mutex_unlock(&pool.lock);
+        func(arg, i);
+        pthread_mutex_lock(&pool.lock);
+
+        if(--pool.pending == 0)
+        {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+}
+
+
+static void *worker_main(void *unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&pool.lock);
+    for(;;)
+    {
+        while(pool.next >= pool.n)
+        {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        run_items();
+    }
+    return NULL;
+}
+
+
+/*
+ * start the threads, if this process hasn't got them. a forked child
+ * inherits the pool's state but not its threads, so it starts over.
+ */
+static void start_pool(void)
+{
+    pid_t pid = getpid();
+    if(pool.owner == pid)
+    {
+        return;
+    }
+
+    pool.owner = pid;
+    pool.nthreads = 0;
+    pool.n = pool.next = pool.pending = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = (ncpus > 1) ? (int)ncpus - 1 : 0;
+    if(want > WORKPOOL_MAX_THREADS)
+    {
+        want = WORKPOOL_MAX_THREADS;
+    }
+
+    /* the threads take no signals, those are for the shell's main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for(int i = 0; i < want; i++)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, worker_main, NULL) != 0)
+        {
+            break;
+        }
+        pthread_detach(thread);
+        pool.nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+int workpool_threads(void)
+{
+    start_pool();
+    return pool.nthreads;
+}
+
+
+void workpool_for(int n, void (*func)(void *arg, int i), void *arg)
+{
+    if(n > 1)
+    {
+        start_pool();
+    }
+
+    /* not worth waking anybody for (or nobody to wake) */
+    if(n <= 1 || pool.nthreads == 0)
+    {
+        for(int i = 0; i < n; i++)
+        {
+            func(arg, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.func = func;
+    pool.arg = arg;
+    pool.n = n;
+    pool.next = 0;
+    pool.pending = n;
+    pthread_cond_broadcast(&pool.work);
+
+    /* lend a hand, then wait for the items still running elsewhere */
+    run_items();
+    while(pool.pending > 0)
+    {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
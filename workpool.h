@@ -0,0 +1,25 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+/*
+ * A small pool of worker threads for spreading independent pieces of work
+ * (like listing and matching the directories of a glob pattern) over the
+ * CPUs.  The threads are started the first time there is work for them and
+ * then wait for more; a forked child that wants them starts its own.
+ */
+
+/* Most worker threads (the thread handing out the work also does some) */
+#define WORKPOOL_MAX_THREADS    4
+
+/*
+ * Call func(arg, i) for every i from 0 to n-1, on the pool's threads and
+ * the calling thread, and return when all the calls have returned.  The
+ * calls must not use the command arena, or anything else that isn't
+ * thread-safe.
+ */
+void workpool_for(int n, void (*func)(void *arg, int i), void *arg);
+
+/* Start the pool if need be, and return how many threads it has */
+int workpool_threads(void);
+
+#endif